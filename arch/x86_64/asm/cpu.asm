@@ -21,6 +21,7 @@ global __write_cr8
 global __hlt
 global __cpu_context_restore
 global __resched_interrupt
+global __rdtsc
 
 ;----------------------------------------
 __wbinvd:
@@ -118,6 +119,12 @@ __invd:
     invd
     ret
 ;----------------------------------------
+__rdtsc:
+    rdtsc
+    shl rdx, 32
+    or rax, rdx
+    ret
+;----------------------------------------
 __read_cr4:
     mov rax, cr4
     ret
@@ -6,6 +6,7 @@ global __start_ap_pml5_on
 global __start_ap_nx_on
 global __start_ap_stack
 global __start_ap_entry_pt
+global __start_ap_percpu
 
 
 
@@ -130,6 +131,7 @@ __start_ap_pml5_on  db 0x0
 __start_ap_nx_on    db 0x0
 __start_ap_stack    dq 0x0
 __start_ap_entry_pt dq 0x0
+__start_ap_percpu   dq 0x0
 
 __start_ap_end:
 
@@ -146,6 +148,16 @@ ap_start_higher:
     mov fs, rax
     mov gs, rax
 
+    ; load the per-CPU area prepared by the BSP
+    ; in both IA32_GS_BASE and IA32_KERNEL_GS_BASE
+    mov rax, qword [0x8000 + __start_ap_percpu - __start_ap_begin]
+    mov rdx, rax
+    shr rdx, 32
+    mov ecx, 0xC0000101
+    wrmsr
+    mov ecx, 0xC0000102
+    wrmsr
+
     mov rsp, qword [0x8000 + __start_ap_stack - __start_ap_begin]
     mov rbp, rsp
     
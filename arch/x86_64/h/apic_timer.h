@@ -7,6 +7,11 @@
 #define APIC_TIMER_NAME "APIC_TIMER"
 
 
+#define APIC_TIMER_LVT_PERIODIC    (0b01 << 17)
+#define APIC_TIMER_LVT_TSC_DEADLINE (0b10 << 17)
+#define IA32_TSC_DEADLINE_MSR      (0x6E0)
+#define CPUID_TSC_DEADLINE         (1 << 24)
+
 struct apic_timer
 {
     struct device_node   dev_node;
@@ -15,6 +20,15 @@ struct apic_timer
     timer_tick_handler_t handler;
     void                *handler_data;
     struct time_spec     tm_res;
+    uint8_t              mode;        /* TIMER_PERIODIC or TIMER_ONESHOT        */
+    uint32_t             armed_count; /* count of the running one-shot          */
+    uint64_t             armed_ns;    /* duration of the running one-shot       */
+    uint64_t             carry_ns;    /* time not reported yet to the handler   */
+    uint64_t             tsc_freq;    /* TSC-deadline mode if not 0             */
+    uint64_t             period_tsc;  /* TSC ticks of the periodic tick         */
+    uint64_t             deadline;    /* armed TSC deadline                     */
+    uint64_t             base_tsc;    /* TSC when the timer was initialized     */
+    uint64_t             reported_ns; /* time reported to the handler since     */
 };
 
 
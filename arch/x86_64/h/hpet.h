@@ -0,0 +1,59 @@
+#ifndef hpeth
+#define hpeth
+
+#include <stdint.h>
+#include <defs.h>
+#include <devmgr.h>
+#include <spinlock.h>
+#include <timer.h>
+#include <isr.h>
+
+#define HPET_TIMER_NAME "HPET"
+
+/* register offsets */
+#define HPET_CAP_ID_REG          (0x000)
+#define HPET_CONFIG_REG          (0x010)
+#define HPET_INT_STATUS_REG      (0x020)
+#define HPET_COUNTER_REG         (0x0F0)
+#define HPET_TIMER_CONFIG_REG(n) (0x100 + 0x20 * (n))
+#define HPET_TIMER_CMP_REG(n)    (0x108 + 0x20 * (n))
+
+/* general capabilities */
+#define HPET_CAP_COUNT_64        (1 << 13)
+#define HPET_CAP_PERIOD(x)       ((x) >> 32)   /* femtoseconds per tick */
+
+/* general configuration */
+#define HPET_CONFIG_ENABLE       (1 << 0)
+#define HPET_CONFIG_LEGACY       (1 << 1)
+
+/* timer configuration */
+#define HPET_TN_LEVEL            (1 << 1)
+#define HPET_TN_INT_ENABLE       (1 << 2)
+#define HPET_TN_PERIODIC         (1 << 3)
+#define HPET_TN_PERIODIC_CAP     (1 << 4)
+#define HPET_TN_VAL_SET          (1 << 6)
+#define HPET_TN_32BIT            (1 << 8)
+#define HPET_TN_ROUTE_SHIFT      (9)
+#define HPET_TN_ROUTE_MASK       (0x1F << HPET_TN_ROUTE_SHIFT)
+#define HPET_TN_ROUTE_CAP(x)     ((x) >> 32)
+
+#define HPET_FS_PER_SEC          (1000000000000000ull)
+
+struct hpet_dev
+{
+    struct device_node    dev_node;
+    struct spinlock_rw    lock;
+    virt_addr_t           vaddr;
+    uint64_t              freq;         /* main counter ticks per second   */
+    uint32_t              irq;          /* interrupt of the event timer    */
+    struct isr            timer_isr;
+    timer_tick_handler_t  handler;
+    void                 *handler_data;
+    struct time_spec      tm_res;
+    uint8_t               mode;         /* TIMER_PERIODIC or TIMER_ONESHOT */
+    uint8_t               periodic_cap;
+    uint64_t              period;       /* counter ticks of the periodic tick */
+    uint64_t              last_count;   /* counter at the last reported step */
+};
+
+#endif
@@ -122,6 +122,7 @@ extern uint8_t  __geti();
 extern void     __lidt(struct idt64_ptr *);
 extern void     __hlt();
 extern void     __pause();
+extern uint64_t __rdtsc();
 
 
 
@@ -130,6 +131,7 @@ extern void     __pause();
 #define cpu_int_lock    __cli
 #define cpu_int_unlock  __sti
 #define cpu_int_check   __geti
+#define cpu_timestamp   __rdtsc
 
 
 int platform_pre_init(void);
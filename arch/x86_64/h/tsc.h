@@ -0,0 +1,16 @@
+#ifndef tsch
+#define tsch
+
+#include <stdint.h>
+
+int tsc_register
+(
+    void
+);
+
+uint64_t tsc_freq_get
+(
+    void
+);
+
+#endif
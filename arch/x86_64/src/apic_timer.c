@@ -10,29 +10,189 @@
 #include <cpu.h>
 #include <platform.h>
 #include <utils.h>
+#include <tsc.h>
+#include <clock.h>
+
+#define APIC_TIMER_CALIBRATION_NS (10000000ull) /* 10 ms */
 
 static struct isr timer_isr;
 
+/* split the conversions so the products do not overflow */
+static uint64_t apic_timer_ns_to_tsc
+(
+    struct apic_timer *timer,
+    uint64_t           ns
+)
+{
+    return((ns / TIMER_RESOLUTION_NS) * timer->tsc_freq + 
+           ((ns % TIMER_RESOLUTION_NS) * timer->tsc_freq) / 
+           TIMER_RESOLUTION_NS);
+}
+
+static uint64_t apic_timer_tsc_to_ns
+(
+    struct apic_timer *timer,
+    uint64_t           tsc
+)
+{
+    return((tsc / timer->tsc_freq) * TIMER_RESOLUTION_NS + 
+           ((tsc % timer->tsc_freq) * TIMER_RESOLUTION_NS) / 
+           timer->tsc_freq);
+}
+
+/* the TSC-deadline mode needs a TSC with a known frequency */
+static uint64_t apic_timer_tsc_deadline_freq
+(
+    void
+)
+{
+    uint32_t eax = 1;
+    uint32_t ebx = 0;
+    uint32_t ecx = 0;
+    uint32_t edx = 0;
+
+    __cpuid(&eax, &ebx, &ecx, &edx);
+
+    if(~ecx & CPUID_TSC_DEADLINE)
+    {
+        return(0);
+    }
+
+    return(tsc_freq_get());
+}
+
+/* arm the TSC deadline - 0 stops the timer */
+static void apic_timer_deadline_arm
+(
+    struct apic_timer *timer,
+    uint64_t           deadline
+)
+{
+    timer->deadline = deadline;
+
+    /* the LVT write must be visible before the deadline is armed */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    __wrmsr(IA32_TSC_DEADLINE_MSR, deadline);
+}
+
+static uint64_t apic_timer_res_ns
+(
+    struct apic_timer *timer
+)
+{
+    return((uint64_t)timer->tm_res.seconds * TIMER_RESOLUTION_NS + 
+           timer->tm_res.nanosec);
+}
+
+static struct apic_drv *apic_timer_apic_get
+(
+    struct apic_timer *timer
+)
+{
+    struct device_node *apic_dev = NULL;
+
+    apic_dev = devmgr_dev_parent_get(&timer->dev_node);
+
+    return((struct apic_drv*)devmgr_dev_drv_get(apic_dev));
+}
+
+/* keep the time that passed from a one-shot that is being reprogrammed */
+static void apic_timer_oneshot_carry
+(
+    struct apic_timer *timer,
+    struct apic_drv   *apic_drv
+)
+{
+    uint32_t current = 0;
+
+    if((timer->mode != TIMER_ONESHOT) || (timer->armed_count == 0) ||
+       (timer->tsc_freq != 0))
+    {
+        return;
+    }
+
+    apic_drv->apic_read(apic_drv->vaddr, 
+                        CURRENT_COUNT_REGISTER, 
+                        &current, 
+                        1);
+
+    timer->carry_ns += ((uint64_t)(timer->armed_count - current) * 
+                        apic_timer_res_ns(timer)) / timer->calib_value;
+
+    timer->armed_count = 0;
+    timer->armed_ns    = 0;
+}
+
 static int apic_timer_isr(void *drv, struct isr_info *inf)
 {
     struct apic_timer  *timer     = NULL;
-    struct device_node      *dev = NULL;
+    struct platform_cpu *pcpu     = NULL;
+    struct time_spec    step;
+    uint64_t            step_ns   = 0;
+    uint64_t            now       = 0;
+    uint64_t            deadline  = 0;
 
-    dev = devmgr_dev_get_by_name(APIC_TIMER_NAME, inf->cpu_id);
+    /* the timer is part of the cpu that took the interrupt */
+    pcpu = (struct platform_cpu*)inf->cpu;
 
-    if(dev == NULL)
+    if(pcpu == NULL || 
+      (~pcpu->apic_tmr.dev_node.flags & DEVMGR_DEV_INITIALIZED))
     {
         return(-1);
     }
     
-    timer = (struct apic_timer*)dev;
+    timer = &pcpu->apic_tmr;
+
+    /* report the time that really passed since the last interrupt */
+    if(timer->tsc_freq != 0)
+    {
+        now     = __rdtsc();
+        step_ns = apic_timer_tsc_to_ns(timer, now - timer->base_tsc) - 
+                  timer->reported_ns;
+
+        timer->reported_ns += step_ns;
+
+        /* the periodic tick is emulated by moving the deadline */
+        if(timer->mode == TIMER_PERIODIC)
+        {
+            deadline = timer->deadline + timer->period_tsc;
+
+            if(deadline <= now)
+            {
+                deadline = now + timer->period_tsc;
+            }
+
+            apic_timer_deadline_arm(timer, deadline);
+        }
+        else
+        {
+            timer->deadline = 0;
+        }
+    }
+    else if(timer->mode == TIMER_ONESHOT)
+    {
+        step_ns = timer->armed_ns;
+        timer->armed_count = 0;
+        timer->armed_ns    = 0;
+    }
+    else
+    {
+        step_ns = apic_timer_res_ns(timer);
+    }
+
+    step_ns += timer->carry_ns;
+    timer->carry_ns = 0;
+
+    step.seconds = step_ns / TIMER_RESOLUTION_NS;
+    step.nanosec = step_ns % TIMER_RESOLUTION_NS;
 
     spinlock_read_lock(&timer->lock);
     
     /* Call the callback */
     if(timer->handler != NULL)
     {
-        timer->handler(timer->handler_data, &timer->tm_res, inf);
+        timer->handler(timer->handler_data, &step, inf);
     }
 
     spinlock_read_unlock(&timer->lock);
@@ -80,6 +240,8 @@ static int apic_timer_init(struct device_node *dev)
     struct timer            calib_timer;
     struct time_spec        req_res      = {.nanosec = 1000000, .seconds = 0};
     uint8_t            timer_done   = 0;
+    uint64_t           ns_start     = 0;
+    uint64_t           ns_end       = 0;
 
 
     apic_timer  = (struct apic_timer*)dev;
@@ -92,16 +254,36 @@ static int apic_timer_init(struct device_node *dev)
         return(-1);
     }
 
-    /* Save the interrupt flag */
-    int_status = cpu_int_check();
+    spinlock_rw_init(&apic_timer->lock);
 
-    /* Enable the interrupts */
+    apic_timer->tm_res   = req_res;
+    apic_timer->mode     = TIMER_PERIODIC;
+    apic_timer->tsc_freq = apic_timer_tsc_deadline_freq();
 
-    if(!int_status)
+    /* no need to calibrate if the timer can use TSC deadlines */
+    if(apic_timer->tsc_freq != 0)
     {
-        cpu_int_unlock();
+        apic_timer->period_tsc  = apic_timer_ns_to_tsc(apic_timer, 
+                                                       apic_timer_res_ns(apic_timer));
+        apic_timer->base_tsc    = __rdtsc();
+        apic_timer->reported_ns = 0;
+
+        kprintf("APIC_TIMER TSC-DEADLINE %d KHz PERIOD %d\n",
+                apic_timer->tsc_freq / 1000,
+                apic_timer->period_tsc);
+
+        data = APIC_LVT_VECTOR_MASK(PLATFORM_LOCAL_TIMER_VECTOR) | 
+               APIC_TIMER_LVT_TSC_DEADLINE;
+
+        apic_drv->apic_write(apic_drv->vaddr, 
+                             LVT_TIMER_REGISTER, 
+                             &data, 
+                             1);
+
+        apic_timer_deadline_arm(apic_timer, 
+                                apic_timer->base_tsc + apic_timer->period_tsc);
+        return(0);
     }
-    spinlock_rw_init(&apic_timer->lock);
 
     data = 0b1011;
     apic_drv->apic_write(apic_drv->vaddr, 
@@ -109,37 +291,76 @@ static int apic_timer_init(struct device_node *dev)
                          &data, 
                          1);
 
-    /* Let's calibrate this */
-    data = UINT32_MAX;
-    apic_drv->apic_write(apic_drv->vaddr, 
-                         INITIAL_COUNT_REGISTER, 
-                         &data, 
-                         1);
-
-    timer_enqeue_static(NULL, 
-                        &req_res, 
-                        apic_timer_loop, 
-                        &timer_done,
-                        TIMER_ONESHOT, 
-                        &calib_timer);
-
-    while(!timer_done)
+    /* a clock source is a precise reference that needs no interrupts */
+    if(clock_source_active())
     {
-        cpu_pause();
-    }
+        data = UINT32_MAX;
+        apic_drv->apic_write(apic_drv->vaddr, 
+                             INITIAL_COUNT_REGISTER, 
+                             &data, 
+                             1);
+
+        ns_start = clock_monotonic_ns();
+
+        while((ns_end = clock_monotonic_ns()) - ns_start < 
+              APIC_TIMER_CALIBRATION_NS)
+        {
+            cpu_pause();
+        }
+
+        apic_drv->apic_read(apic_drv->vaddr, 
+                            CURRENT_COUNT_REGISTER, 
+                            &data, 
+                            1);
 
-    /* restore the status of the interrupt flag */
-    if(!int_status) 
-    {
-        cpu_int_lock();
+        apic_timer->calib_value = ((uint64_t)(UINT32_MAX - data) * 
+                                   apic_timer_res_ns(apic_timer)) / 
+                                  (ns_end - ns_start);
     }
+    else
+    {
+        /* Save the interrupt flag */
+        int_status = cpu_int_check();
+
+        /* Enable the interrupts */
+
+        if(!int_status)
+        {
+            cpu_int_unlock();
+        }
+
+        /* Let's calibrate this */
+        data = UINT32_MAX;
+        apic_drv->apic_write(apic_drv->vaddr, 
+                             INITIAL_COUNT_REGISTER, 
+                             &data, 
+                             1);
+
+        timer_enqeue_static(NULL, 
+                            &req_res, 
+                            apic_timer_loop, 
+                            &timer_done,
+                            TIMER_ONESHOT, 
+                            &calib_timer);
+
+        while(!timer_done)
+        {
+            cpu_pause();
+        }
+
+        /* restore the status of the interrupt flag */
+        if(!int_status) 
+        {
+            cpu_int_lock();
+        }
+
+        apic_drv->apic_read(apic_drv->vaddr, 
+                            CURRENT_COUNT_REGISTER, 
+                            &data, 
+                            1);
 
-    apic_drv->apic_read(apic_drv->vaddr, 
-                           CURRENT_COUNT_REGISTER, 
-                           &data, 
-                           1);
-
-    apic_timer->calib_value = UINT32_MAX - data;
+        apic_timer->calib_value = UINT32_MAX - data;
+    }
  
      /* disable the timer */
     data = apic_timer->calib_value;
@@ -149,14 +370,13 @@ static int apic_timer_init(struct device_node *dev)
                          &data, 
                          1);
 
-    apic_timer->tm_res = req_res;
     kprintf("APIC_TIMER_CALIB %d SEC %d NSEC %d\n",
             apic_timer->calib_value,
             req_res.seconds,
             req_res.nanosec);
 
     data = APIC_LVT_VECTOR_MASK(PLATFORM_LOCAL_TIMER_VECTOR) | 
-           0b01 << 17;
+           APIC_TIMER_LVT_PERIODIC;
 
     apic_drv->apic_write(apic_drv->vaddr, 
                          LVT_TIMER_REGISTER, 
@@ -244,6 +464,23 @@ static int timer_toggle(struct device_node *dev, int en)
     apic_drv    = (struct apic_drv*)devmgr_dev_drv_get(apic_dev);
     apic_timer  = (struct apic_timer *)dev;
 
+    if(apic_timer->tsc_freq != 0)
+    {
+        if(en && (apic_timer->mode == TIMER_PERIODIC))
+        {
+            apic_timer_deadline_arm(apic_timer, 
+                                    __rdtsc() + apic_timer->period_tsc);
+        }
+        else if(!en)
+        {
+            apic_timer_deadline_arm(apic_timer, 0);
+        }
+
+        return(0);
+    }
+
+    apic_timer_oneshot_carry(apic_timer, apic_drv);
+
     if(en)
     {
         data = apic_timer->calib_value;
@@ -271,13 +508,161 @@ static int apic_timer_reset(struct device_node *dev)
     return(timer_toggle(dev, 1));
 }
 
+/*
+ * apic_timer_set_mode - switch between the periodic tick and one-shot
+ * In one-shot mode the timer stays stopped until set_timer is called.
+ * Must be called on the CPU that owns the timer with interrupts disabled.
+ */
+
+static int apic_timer_set_mode
+(
+    struct device_node *dev,
+    uint8_t             mode
+)
+{
+    struct apic_drv   *apic_drv   = NULL;
+    struct apic_timer *apic_timer = NULL;
+    uint32_t           data       = 0;
+
+    apic_timer = (struct apic_timer *)dev;
+    apic_drv   = apic_timer_apic_get(apic_timer);
+
+    if((mode != TIMER_PERIODIC) && (mode != TIMER_ONESHOT))
+    {
+        return(-1);
+    }
+
+    /* the LVT stays in TSC-deadline mode - only the deadline changes */
+    if(apic_timer->tsc_freq != 0)
+    {
+        apic_timer->mode = mode;
+
+        if(mode == TIMER_PERIODIC)
+        {
+            apic_timer_deadline_arm(apic_timer, 
+                                    __rdtsc() + apic_timer->period_tsc);
+        }
+        else
+        {
+            apic_timer_deadline_arm(apic_timer, 0);
+        }
+
+        return(0);
+    }
+
+    apic_timer_oneshot_carry(apic_timer, apic_drv);
+
+    /* stop the timer before changing the mode */
+    apic_drv->apic_write(apic_drv->vaddr, 
+                         INITIAL_COUNT_REGISTER, 
+                         &data, 
+                         1);
+
+    data = APIC_LVT_VECTOR_MASK(PLATFORM_LOCAL_TIMER_VECTOR);
+
+    if(mode == TIMER_PERIODIC)
+    {
+        data |= APIC_TIMER_LVT_PERIODIC;
+    }
+
+    apic_drv->apic_write(apic_drv->vaddr, 
+                         LVT_TIMER_REGISTER, 
+                         &data, 
+                         1);
+
+    apic_timer->mode = mode;
+
+    if(mode == TIMER_PERIODIC)
+    {
+        data = apic_timer->calib_value;
+
+        apic_drv->apic_write(apic_drv->vaddr, 
+                             INITIAL_COUNT_REGISTER, 
+                             &data, 
+                             1);
+    }
+
+    return(0);
+}
+
+/*
+ * apic_timer_set_timer - arm the one-shot timer to fire after tm
+ * In TSC-deadline mode the relative time is turned into an absolute
+ * TSC deadline, otherwise it is converted to a calibrated count.
+ */
+
+static int apic_timer_set_timer
+(
+    struct device_node *dev,
+    struct time_spec   *tm
+)
+{
+    struct apic_drv   *apic_drv   = NULL;
+    struct apic_timer *apic_timer = NULL;
+    uint64_t           ns         = 0;
+    uint64_t           count      = 0;
+    uint32_t           data       = 0;
+
+    apic_timer = (struct apic_timer *)dev;
+    apic_drv   = apic_timer_apic_get(apic_timer);
+
+    if((tm == NULL) || (apic_timer->mode != TIMER_ONESHOT))
+    {
+        return(-1);
+    }
+
+    ns    = (uint64_t)tm->seconds * TIMER_RESOLUTION_NS + tm->nanosec;
+
+    /* a single write with the precision of the TSC */
+    if(apic_timer->tsc_freq != 0)
+    {
+        count = apic_timer_ns_to_tsc(apic_timer, ns);
+
+        if(count == 0)
+        {
+            count = 1;
+        }
+
+        apic_timer_deadline_arm(apic_timer, __rdtsc() + count);
+
+        return(0);
+    }
+
+    apic_timer_oneshot_carry(apic_timer, apic_drv);
+    count = (ns * apic_timer->calib_value) / apic_timer_res_ns(apic_timer);
+
+    if(count == 0)
+    {
+        count = 1;
+    }
+    else if(count > UINT32_MAX)
+    {
+        count = UINT32_MAX;
+    }
+
+    apic_timer->armed_count = count;
+    apic_timer->armed_ns    = (count * apic_timer_res_ns(apic_timer)) / 
+                              apic_timer->calib_value;
+
+    data = count;
+
+    apic_drv->apic_write(apic_drv->vaddr, 
+                         INITIAL_COUNT_REGISTER, 
+                         &data, 
+                         1);
+
+    return(0);
+}
+
 static struct timer_api apic_timer_api = 
 {
     .enable       = apic_timer_enable,
     .disable      = apic_timer_disable,
     .reset        = apic_timer_reset,
     .set_handler  = apic_timer_set_handler,
-    .get_handler  = apic_timer_get_handler
+    .get_handler  = apic_timer_get_handler,
+    .set_timer    = apic_timer_set_timer,
+    .set_mode     = apic_timer_set_mode
 };
 
 static struct driver_node apic_timer_drv = 
@@ -19,6 +19,7 @@
 #include <sched.h>
 #include <ioapic.h>
 #include <thread.h>
+#include <percpu.h>
 
 #define _BSP_STACK_TOP    ((virt_addr_t)&kstack_top)
 #define _BSP_STACK_BASE   ((virt_addr_t)&kstack_base)
@@ -35,6 +36,7 @@ extern virt_addr_t __start_ap_pml5_on;
 extern virt_addr_t __start_ap_nx_on;
 extern virt_addr_t __start_ap_stack;
 extern virt_addr_t __start_ap_entry_pt;
+extern virt_addr_t __start_ap_percpu;
 
 extern virt_addr_t isr_no_ec_begin;
 extern virt_addr_t isr_no_ec_end;
@@ -59,6 +61,17 @@ int32_t cpu_process_call_list
 );
 
 uint32_t cpu_id_get(void)
+{
+    return(percpu_read(percpu_cpu_id));
+}
+
+/* cpu_id_query - ask the CPU for its id 
+ * This is slow (and traps when virtualized) so it should be used only
+ * while setting up the per-CPU area. 
+ * Everything else should use cpu_id_get()
+ */
+
+uint32_t cpu_id_query(void)
 {
     static uint32_t hi_leaf = 0;
     uint32_t eax = 0;
@@ -302,6 +315,7 @@ static void cpu_prepare_trampoline
 static int cpu_bring_ap_up
 (
     struct device_node *issuer,
+    virt_addr_t trampoline,
     uint32_t cpu,
     uint32_t timeout
 )
@@ -309,6 +323,8 @@ static int cpu_bring_ap_up
     struct ipi_packet ipi;
     uint32_t expected = 0;
     struct intc_api *api = NULL;
+    virt_addr_t *percpu = NULL;
+    virt_addr_t percpu_base = 0;
 
     /* wipe the ipi garbage */
     memset(&ipi, 0, sizeof(struct ipi_packet));
@@ -336,6 +352,20 @@ static int cpu_bring_ap_up
         return(-1);
     }
 
+    /* Prepare the per-CPU area of the AP. The trampoline
+     * will load it before jumping to the kernel code
+     */
+    percpu_base = percpu_area_alloc(cpu);
+
+    if(percpu_base == 0)
+    {
+        return(-1);
+    }
+
+    percpu = (virt_addr_t*)(((virt_addr_t)&__start_ap_percpu
+                                          - _TRAMPOLINE_BEGIN) + trampoline);
+    percpu[0] = percpu_base;
+
     api->send_ipi(issuer, &ipi);
 
     /* Start-up SIPI */
@@ -364,6 +394,9 @@ static int cpu_bring_ap_up
         }
     }
 
+    percpu[0] = 0;
+    percpu_area_free(percpu_base);
+
     return(-1);
 }
 
@@ -372,9 +405,7 @@ void cpu_signal_on
     void
 )
 {
-    uint32_t current_cpu_id = 0;
-    current_cpu_id = cpu_id_get();
-    __atomic_store_n(&cpu_on, current_cpu_id, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&cpu_on, cpu_id_get(), __ATOMIC_SEQ_CST);
 }
 
 int cpu_issue_ipi
@@ -531,7 +562,10 @@ int cpu_ap_start
 
             if(target_cpu_dev == NULL)
             {
-                if(cpu_bring_ap_up(dev, start_cpu_id, timeout) == 0)
+                if(cpu_bring_ap_up(dev, 
+                                   trampoline, 
+                                   start_cpu_id, 
+                                   timeout) == 0)
                 {
                     started_cpu++;
                 }
@@ -610,6 +644,101 @@ static void cpu_ap_entry_point(void)
     }
 }
 
+/* 
+ * cpu_get_topology - find the core and the package of the CPU 
+ * The x2APIC id is split into SMT, core(s) and package fields and the
+ * width of each field is reported by the levels of leaf 0x1F or 0xB
+ */
+
+static void cpu_get_topology
+(
+    uint32_t cpu_id,
+    uint32_t *core_id,
+    uint32_t *package_id
+)
+{
+    uint32_t eax       = 0;
+    uint32_t ebx       = 0;
+    uint32_t ecx       = 0;
+    uint32_t edx       = 0;
+    uint32_t leaf      = 0;
+    uint32_t level     = 0;
+    uint32_t type      = 0;
+    uint32_t smt_shift = 0;
+    uint32_t pkg_shift = 0;
+
+    eax = 0x0;
+    __cpuid(&eax, &ebx, &ecx, &edx);
+
+    if(eax >= 0x1F)
+    {
+        leaf = 0x1F;
+    }
+    else if(eax >= 0xB)
+    {
+        leaf = 0xB;
+    }
+
+    /* a leaf that is not implemented reports nothing in its first level */
+    while(leaf != 0)
+    {
+        eax = leaf;
+        ebx = 0;
+        ecx = 0;
+        edx = 0;
+
+        __cpuid(&eax, &ebx, &ecx, &edx);
+
+        if((ebx != 0) && (((ecx >> 8) & 0xFF) != 0))
+        {
+            break;
+        }
+
+        leaf = (leaf == 0x1F) ? 0xB : 0;
+    }
+
+    if(leaf != 0)
+    {
+        for(level = 0; ; level++)
+        {
+            eax = leaf;
+            ebx = 0;
+            ecx = level;
+            edx = 0;
+
+            __cpuid(&eax, &ebx, &ecx, &edx);
+
+            type = (ecx >> 8) & 0xFF;
+
+            /* no more levels */
+            if(type == 0)
+            {
+                break;
+            }
+
+            /* level type 1 is SMT */
+            if(type == 1)
+            {
+                smt_shift = eax & 0x1F;
+            }
+
+            /* the last level gives the width of everything below the package */
+            pkg_shift = eax & 0x1F;
+        }
+    }
+
+    /* without the topology leaves every CPU is a core of the same package */
+    if(pkg_shift == 0)
+    {
+        *core_id    = cpu_id;
+        *package_id = 0;
+        return;
+    }
+
+    *core_id    = cpu_id >> smt_shift;
+    *package_id = cpu_id >> pkg_shift;
+}
+
 static uint32_t cpu_get_domain
 (
     uint32_t cpu_id
@@ -700,6 +829,8 @@ static int pcpu_dev_init
 
     cpu = &pcpu->hdr;
 
+    /* make the cpu structure reachable through the per-CPU area */
+    cpu_current_set(cpu);
 
     /* Store cpu id and proximity domain */
     cpu->cpu_id = cpu_id;
@@ -707,6 +838,9 @@ static int pcpu_dev_init
     /* store proximity domain of the CPU */
     cpu->proximity_domain = cpu_get_domain(cpu_id);
 
+    /* store the position of the CPU in the package */
+    cpu_get_topology(cpu_id, &cpu->core_id, &cpu->package_id);
+
     /* Prepare the GDT */
     gdt_per_cpu_init(pcpu);
 
@@ -3,6 +3,7 @@
 #include <gdt.h>
 #include <utils.h>
 #include <platform.h>
+#include <percpu.h>
 
 extern void __lgdt(void *gdt);
 extern void __ltr(uint64_t segment);
@@ -66,6 +67,7 @@ int gdt_per_cpu_init(void *cpu_pv)
     struct tss64_entry *tss      = NULL;
     struct gdt_ptr       gdt_ptr  = {.limit = 0, .addr = 0};
     uint8_t        *desc_mem = NULL;
+    virt_addr_t     percpu_base = 0;
 
     desc_mem = (uint8_t*)vm_alloc(NULL, 
                                  VM_BASE_AUTO, 
@@ -142,10 +144,17 @@ int gdt_per_cpu_init(void *cpu_pv)
     gdt_ptr.addr = (virt_addr_t)gdt;
     gdt_ptr.limit = GDT_TABLE_LIMIT;
 
+    /* Reloading GS clears its base so save the per-CPU area 
+     * and load it again after the segments are flushed
+     */
+    percpu_base = percpu_base_get();
+
     __lgdt(&gdt_ptr);
     __ltr(TSS_SEGMENT);
     __flush_gdt();
 
+    percpu_area_load(percpu_base);
+
     kprintf("GDT 0x%x TSS 0x%x\n", gdt, tss);
     return (0);
 }
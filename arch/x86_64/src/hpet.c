@@ -0,0 +1,528 @@
+/* High Precision Event Timer */
+
+#include <devmgr.h>
+#include <timer.h>
+#include <clock.h>
+#include <isr.h>
+#include <acpi.h>
+#include <vm.h>
+#include <hpet.h>
+#include <platform.h>
+#include <utils.h>
+
+/*
+ * The main counter of the HPET is used as a clock source and the
+ * comparator of timer 0 as an event timer. The event timer keeps
+ * running in the deep C-states that stop the local APIC timers. Its
+ * interrupt is routed to an I/O APIC input above the ISA ones, so it
+ * does not take over the PIT.
+ */
+
+#define HPET_FIRST_ROUTE       (16)
+#define HPET_LAST_ROUTE        (23)
+#define HPET_MIN_DELTA         (64)      /* counter ticks */
+
+static struct hpet_dev _hpet_dev = {0};
+
+static int hpet_irq_handler
+(
+    void *dev, 
+    struct isr_info *inf
+);
+
+static inline uint64_t hpet_read
+(
+    struct hpet_dev *hpet,
+    uint32_t         reg
+)
+{
+    return(*(volatile uint64_t*)(hpet->vaddr + reg));
+}
+
+static inline void hpet_write
+(
+    struct hpet_dev *hpet,
+    uint32_t         reg,
+    uint64_t         val
+)
+{
+    *(volatile uint64_t*)(hpet->vaddr + reg) = val;
+}
+
+static uint64_t hpet_clock_read
+(
+    void
+)
+{
+    return(hpet_read(&_hpet_dev, HPET_COUNTER_REG));
+}
+
+static struct clock_source hpet_clock =
+{
+    .name   = "hpet",
+    .read   = hpet_clock_read,
+    .freq   = 0,
+    .rating = 250
+};
+
+/* split the conversions so the products do not overflow */
+static uint64_t hpet_ns_to_ticks
+(
+    struct hpet_dev *hpet,
+    uint64_t         ns
+)
+{
+    return((ns / TIMER_RESOLUTION_NS) * hpet->freq + 
+           ((ns % TIMER_RESOLUTION_NS) * hpet->freq) / TIMER_RESOLUTION_NS);
+}
+
+static uint64_t hpet_ticks_to_ns
+(
+    struct hpet_dev *hpet,
+    uint64_t         ticks
+)
+{
+    return((ticks / hpet->freq) * TIMER_RESOLUTION_NS + 
+           ((ticks % hpet->freq) * TIMER_RESOLUTION_NS) / hpet->freq);
+}
+
+static int hpet_probe(struct device_node *dev)
+{
+    ACPI_STATUS      status = AE_OK;
+    ACPI_TABLE_HPET *tbl    = NULL;
+
+    if(!devmgr_dev_name_match(dev, HPET_TIMER_NAME) ||
+       !devmgr_dev_type_match(dev, TIMER_DEVICE_TYPE))
+    {
+        return(-1);
+    }
+
+    status = AcpiGetTable(ACPI_SIG_HPET, 0, (ACPI_TABLE_HEADER**)&tbl);
+
+    if(ACPI_FAILURE(status))
+    {
+        return(-1);
+    }
+
+    AcpiPutTable((ACPI_TABLE_HEADER*)tbl);
+
+    return(0);
+}
+
+/* arm the comparator - fails if the counter already went past it */
+static int hpet_arm
+(
+    struct hpet_dev *hpet,
+    uint64_t         delta
+)
+{
+    uint64_t cmp = 0;
+
+    if(delta < HPET_MIN_DELTA)
+    {
+        delta = HPET_MIN_DELTA;
+    }
+
+    cmp = hpet_read(hpet, HPET_COUNTER_REG) + delta;
+    hpet_write(hpet, HPET_TIMER_CMP_REG(0), cmp);
+
+    if((int64_t)(cmp - hpet_read(hpet, HPET_COUNTER_REG)) <= 0)
+    {
+        return(-1);
+    }
+
+    return(0);
+}
+
+static void hpet_start
+(
+    struct hpet_dev *hpet,
+    uint8_t          mode,
+    uint64_t         delta
+)
+{
+    uint64_t config = 0;
+
+    config = hpet_read(hpet, HPET_TIMER_CONFIG_REG(0));
+    config &= ~(HPET_TN_PERIODIC | HPET_TN_VAL_SET | HPET_TN_INT_ENABLE);
+
+    if((mode == TIMER_PERIODIC) && hpet->periodic_cap)
+    {
+        /* the first write sets the comparator, the second the period */
+        config |= HPET_TN_PERIODIC | HPET_TN_VAL_SET | HPET_TN_INT_ENABLE;
+        hpet_write(hpet, HPET_TIMER_CONFIG_REG(0), config);
+        hpet_write(hpet, HPET_TIMER_CMP_REG(0), 
+                   hpet_read(hpet, HPET_COUNTER_REG) + delta);
+        hpet_write(hpet, HPET_TIMER_CMP_REG(0), delta);
+        return;
+    }
+
+    config |= HPET_TN_INT_ENABLE;
+    hpet_write(hpet, HPET_TIMER_CONFIG_REG(0), config);
+
+    /* too close - push the deadline further away until it sticks */
+    while(hpet_arm(hpet, delta) != 0)
+    {
+        delta *= 2;
+    }
+}
+
+static void hpet_stop
+(
+    struct hpet_dev *hpet
+)
+{
+    uint64_t config = 0;
+
+    config = hpet_read(hpet, HPET_TIMER_CONFIG_REG(0));
+    config &= ~(HPET_TN_PERIODIC | HPET_TN_INT_ENABLE);
+    hpet_write(hpet, HPET_TIMER_CONFIG_REG(0), config);
+}
+
+/* pick an I/O APIC input that timer 0 can use */
+static int hpet_route_get
+(
+    struct hpet_dev *hpet,
+    uint32_t        *irq
+)
+{
+    uint64_t config = 0;
+    uint32_t cap    = 0;
+    uint32_t i      = 0;
+
+    config = hpet_read(hpet, HPET_TIMER_CONFIG_REG(0));
+    cap    = HPET_TN_ROUTE_CAP(config);
+
+    for(i = HPET_FIRST_ROUTE; i <= HPET_LAST_ROUTE; i++)
+    {
+        if(cap & (1u << i))
+        {
+            *irq = i;
+            return(0);
+        }
+    }
+
+    return(-1);
+}
+
+static int hpet_init(struct device_node *dev)
+{
+    struct hpet_dev *hpet   = NULL;
+    ACPI_STATUS      status = AE_OK;
+    ACPI_TABLE_HPET *tbl    = NULL;
+    phys_addr_t      phys   = 0;
+    uint64_t         cap    = 0;
+    uint64_t         config = 0;
+
+    hpet = (struct hpet_dev*)dev;
+
+    status = AcpiGetTable(ACPI_SIG_HPET, 0, (ACPI_TABLE_HEADER**)&tbl);
+
+    if(ACPI_FAILURE(status))
+    {
+        return(-1);
+    }
+
+    phys = tbl->Address.Address;
+
+    AcpiPutTable((ACPI_TABLE_HEADER*)tbl);
+
+    hpet->vaddr = vm_map(NULL, VM_BASE_AUTO,
+                         PAGE_SIZE,
+                         phys,
+                         0, 
+                         VM_ATTR_STRONG_UNCACHED |
+                         VM_ATTR_WRITABLE);
+
+    if(hpet->vaddr == VM_INVALID_ADDRESS)
+    {
+        return(-1);
+    }
+
+    spinlock_rw_init(&hpet->lock);
+
+    cap = hpet_read(hpet, HPET_CAP_ID_REG);
+
+    if(HPET_CAP_PERIOD(cap) == 0)
+    {
+        vm_unmap(NULL, hpet->vaddr, PAGE_SIZE);
+        return(-1);
+    }
+
+    hpet->freq = HPET_FS_PER_SEC / HPET_CAP_PERIOD(cap);
+
+    /* start the main counter without the legacy routing */
+    config = hpet_read(hpet, HPET_CONFIG_REG);
+    config &= ~HPET_CONFIG_LEGACY;
+    config |= HPET_CONFIG_ENABLE;
+    hpet_write(hpet, HPET_CONFIG_REG, config);
+
+    kprintf("HPET at %x %d KHz %d-bit\n", 
+            phys, 
+            hpet->freq / 1000, 
+            (cap & HPET_CAP_COUNT_64) ? 64 : 32);
+
+    /* a 32-bit counter wraps too often to back the clock */
+    if(cap & HPET_CAP_COUNT_64)
+    {
+        hpet_clock.freq = hpet->freq;
+        clock_source_register(&hpet_clock);
+    }
+
+    /* set up timer 0 as an edge triggered one-shot timer */
+    config = hpet_read(hpet, HPET_TIMER_CONFIG_REG(0));
+
+    hpet->periodic_cap = (config & HPET_TN_PERIODIC_CAP) != 0;
+    hpet->tm_res.seconds = 0;
+    hpet->tm_res.nanosec = 1000000;
+    hpet->period = hpet_ns_to_ticks(hpet, hpet->tm_res.nanosec);
+    hpet->mode = TIMER_ONESHOT;
+
+    if(hpet_route_get(hpet, &hpet->irq) != 0)
+    {
+        kprintf("HPET timer 0 cannot be routed - no event timer\n");
+        return(0);
+    }
+
+    config &= ~(HPET_TN_LEVEL | HPET_TN_PERIODIC | HPET_TN_INT_ENABLE |
+                HPET_TN_32BIT | HPET_TN_ROUTE_MASK);
+    config |= (uint64_t)hpet->irq << HPET_TN_ROUTE_SHIFT;
+
+    hpet_write(hpet, HPET_TIMER_CONFIG_REG(0), config);
+
+    isr_install(hpet_irq_handler, 
+                &hpet->dev_node, 
+                IRQ(hpet->irq), 
+                0, 
+                &hpet->timer_isr);
+
+    return(0);
+}
+
+static int hpet_drv_init(struct driver_node *drv)
+{
+    if(!devmgr_device_node_init(&_hpet_dev.dev_node))
+    {
+        devmgr_dev_name_set(&_hpet_dev.dev_node, HPET_TIMER_NAME);
+        devmgr_dev_type_set(&_hpet_dev.dev_node, TIMER_DEVICE_TYPE);
+        devmgr_dev_index_set(&_hpet_dev.dev_node, 0);
+        devmgr_dev_add(&_hpet_dev.dev_node, NULL);
+    }
+
+    return(0);
+}
+
+static int hpet_irq_handler
+(
+    void *dev, 
+    struct isr_info *inf
+)
+{
+    struct hpet_dev  *hpet    = NULL;
+    struct time_spec  step;
+    uint64_t          now     = 0;
+    uint64_t          step_ns = 0;
+
+    hpet = (struct hpet_dev *)dev;
+
+    /* report the time that really passed since the last interrupt */
+    now     = hpet_read(hpet, HPET_COUNTER_REG);
+    step_ns = hpet_ticks_to_ns(hpet, now - hpet->last_count);
+    hpet->last_count += hpet_ns_to_ticks(hpet, step_ns);
+
+    step.seconds = step_ns / TIMER_RESOLUTION_NS;
+    step.nanosec = step_ns % TIMER_RESOLUTION_NS;
+
+    /* periodic mode without hardware support is emulated */
+    if((hpet->mode == TIMER_PERIODIC) && !hpet->periodic_cap)
+    {
+        hpet_start(hpet, TIMER_PERIODIC, hpet->period);
+    }
+
+    spinlock_read_lock(&hpet->lock);
+    
+    if(hpet->handler != NULL)
+    {
+        hpet->handler(hpet->handler_data, &step, inf);
+    }
+
+    spinlock_read_unlock(&hpet->lock);
+
+    return(0);
+}
+
+static int hpet_set_handler
+(
+    struct device_node   *dev,
+    timer_tick_handler_t  th,
+    void                 *arg
+)
+{
+    struct hpet_dev *hpet     = NULL;
+    uint8_t          int_flag = 0;
+
+    hpet = (struct hpet_dev *)dev;
+
+    spinlock_write_lock_int(&hpet->lock, &int_flag);
+
+    hpet->handler      = th;
+    hpet->handler_data = arg;
+
+    spinlock_write_unlock_int(&hpet->lock, int_flag);
+
+    return(0);
+}
+
+static int hpet_get_handler
+(
+    struct device_node    *dev,
+    timer_tick_handler_t  *th,
+    void                 **arg
+)
+{
+    struct hpet_dev *hpet       = NULL;
+    uint8_t          int_status = 0;
+    
+    if(th == NULL || arg == NULL)
+    {
+        return(-1);
+    }
+
+    hpet = (struct hpet_dev *)dev;
+
+    spinlock_read_lock_int(&hpet->lock, &int_status);
+
+    *th  = hpet->handler;
+    *arg = hpet->handler_data;
+
+    spinlock_read_unlock_int(&hpet->lock, int_status);
+
+    return(0);
+}
+
+static int hpet_enable(struct device_node *dev)
+{
+    struct hpet_dev *hpet = NULL;
+
+    hpet = (struct hpet_dev *)dev;
+
+    if(hpet->irq == 0)
+    {
+        return(-1);
+    }
+
+    hpet->last_count = hpet_read(hpet, HPET_COUNTER_REG);
+
+    if(hpet->mode == TIMER_PERIODIC)
+    {
+        hpet_start(hpet, TIMER_PERIODIC, hpet->period);
+    }
+
+    return(0);
+}
+
+static int hpet_disable(struct device_node *dev)
+{
+    struct hpet_dev *hpet = NULL;
+
+    hpet = (struct hpet_dev *)dev;
+
+    if(hpet->irq == 0)
+    {
+        return(-1);
+    }
+
+    hpet_stop(hpet);
+
+    return(0);
+}
+
+/* 
+ * hpet_set_mode - a periodic tick or one-shot events armed by set_timer
+ */
+
+static int hpet_set_mode
+(
+    struct device_node *dev,
+    uint8_t             mode
+)
+{
+    struct hpet_dev *hpet = NULL;
+
+    hpet = (struct hpet_dev *)dev;
+
+    if((hpet->irq == 0) || 
+       ((mode != TIMER_PERIODIC) && (mode != TIMER_ONESHOT)))
+    {
+        return(-1);
+    }
+
+    hpet_stop(hpet);
+
+    hpet->mode = mode;
+
+    if(mode == TIMER_PERIODIC)
+    {
+        hpet_start(hpet, TIMER_PERIODIC, hpet->period);
+    }
+
+    return(0);
+}
+
+/*
+ * hpet_set_timer - arm the comparator to fire once after tm
+ */
+
+static int hpet_set_timer
+(
+    struct device_node *dev,
+    struct time_spec   *tm
+)
+{
+    struct hpet_dev *hpet = NULL;
+    uint64_t         ns   = 0;
+
+    hpet = (struct hpet_dev *)dev;
+
+    if((tm == NULL) || (hpet->irq == 0) || (hpet->mode != TIMER_ONESHOT))
+    {
+        return(-1);
+    }
+
+    ns = (uint64_t)tm->seconds * TIMER_RESOLUTION_NS + tm->nanosec;
+
+    hpet_start(hpet, TIMER_ONESHOT, hpet_ns_to_ticks(hpet, ns));
+
+    return(0);
+}
+
+static struct timer_api hpet_api = 
+{
+    .enable      = hpet_enable,
+    .disable     = hpet_disable,
+    .reset       = hpet_enable,
+    .set_handler = hpet_set_handler,
+    .get_handler = hpet_get_handler,
+    .set_timer   = hpet_set_timer,
+    .set_mode    = hpet_set_mode
+};
+
+static struct driver_node hpet_drv = 
+{
+    .drv_name   = HPET_TIMER_NAME,
+    .drv_type   = TIMER_DEVICE_TYPE,
+    .dev_probe  = hpet_probe,
+    .dev_init   = hpet_init,
+    .dev_uninit = NULL,
+    .drv_init   = hpet_drv_init,
+    .drv_uninit = NULL,
+    .drv_api    = &hpet_api
+};
+
+int hpet_register(void)
+{
+    devmgr_drv_add(&hpet_drv);
+    devmgr_drv_init(&hpet_drv);
+    
+    return(0);
+}
@@ -0,0 +1,167 @@
+/*
+ * Per-CPU data area
+ */
+
+#include <percpu.h>
+#include <platform.h>
+#include <utils.h>
+#include <vm.h>
+
+#define IA32_GS_BASE_MSR        (0xC0000101)
+#define IA32_KERNEL_GS_BASE_MSR (0xC0000102)
+
+/* The first entry of each area points to the area itself */
+static virt_addr_t percpu_self PERCPU_FIRST_SECTION = 0;
+
+PERCPU_DEFINE(uint32_t, percpu_cpu_id) = 0;
+
+/* the areas of all the CPUs - used by code that has to walk them */
+static virt_addr_t percpu_areas[PERCPU_MAX_AREAS];
+static uint32_t    percpu_area_top = 0;
+
+static void percpu_area_setup
+(
+    virt_addr_t base,
+    uint32_t cpu_id
+)
+{
+    /* copy the template and fill in the identity of the area */
+    memcpy((void*)base, &_percpu, PERCPU_SIZE);
+
+    *percpu_remote_ptr(base, percpu_self)   = base;
+    *percpu_remote_ptr(base, percpu_cpu_id) = cpu_id;
+
+    if(cpu_id < PERCPU_MAX_AREAS)
+    {
+        __atomic_store_n(&percpu_areas[cpu_id], base, __ATOMIC_RELEASE);
+
+        if(cpu_id >= percpu_area_top)
+        {
+            __atomic_store_n(&percpu_area_top, cpu_id + 1, __ATOMIC_RELEASE);
+        }
+    }
+}
+
+int percpu_area_load
+(
+    virt_addr_t base
+)
+{
+    if(base == 0)
+    {
+        return(-1);
+    }
+
+    /* we are not switching to user space yet so keep
+     * both bases pointing to the same area
+     */
+    __wrmsr(IA32_GS_BASE_MSR,        base);
+    __wrmsr(IA32_KERNEL_GS_BASE_MSR, base);
+
+    return(0);
+}
+
+/*
+ * percpu_bsp_init - set up the per-CPU area of the BSP
+ * This is called before memory allocation is available so
+ * the area used by the BSP is reserved by the linker script
+ */
+
+int percpu_bsp_init
+(
+    uint32_t cpu_id
+)
+{
+    virt_addr_t base = 0;
+
+    base = (virt_addr_t)&_percpu_bsp;
+
+    percpu_area_setup(base, cpu_id);
+
+    return(percpu_area_load(base));
+}
+
+/*
+ * percpu_area_alloc - allocate and initialize the per-CPU area of an AP
+ */
+
+virt_addr_t percpu_area_alloc
+(
+    uint32_t cpu_id
+)
+{
+    virt_addr_t base = 0;
+
+    base = vm_alloc(NULL,
+                    VM_BASE_AUTO,
+                    ALIGN_UP(PERCPU_SIZE, PAGE_SIZE),
+                    VM_HIGH_MEM,
+                    VM_ATTR_WRITABLE);
+
+    if(base == VM_INVALID_ADDRESS)
+    {
+        return(0);
+    }
+
+    percpu_area_setup(base, cpu_id);
+
+    return(base);
+}
+
+void percpu_area_free
+(
+    virt_addr_t base
+)
+{
+    uint32_t i = 0;
+
+    if(base != 0)
+    {
+        for(i = 0; i < percpu_area_top; i++)
+        {
+            if(percpu_areas[i] == base)
+            {
+                __atomic_store_n(&percpu_areas[i], 0, __ATOMIC_RELEASE);
+            }
+        }
+
+        memset((void*)base, 0, PERCPU_SIZE);
+        vm_free(NULL, base, ALIGN_UP(PERCPU_SIZE, PAGE_SIZE));
+    }
+}
+
+virt_addr_t percpu_base_get
+(
+    void
+)
+{
+    return(percpu_read(percpu_self));
+}
+
+/*
+ * percpu_area_get - get the area of the CPU with the given id
+ * Returns 0 if the CPU has no area.
+ */
+
+virt_addr_t percpu_area_get
+(
+    uint32_t index
+)
+{
+    if(index >= PERCPU_MAX_AREAS)
+    {
+        return(0);
+    }
+
+    return(__atomic_load_n(&percpu_areas[index], __ATOMIC_ACQUIRE));
+}
+
+/* percpu_area_count - upper bound of the ids that have an area */
+
+uint32_t percpu_area_count
+(
+    void
+)
+{
+    return(__atomic_load_n(&percpu_area_top, __ATOMIC_ACQUIRE));
+}
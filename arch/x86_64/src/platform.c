@@ -14,6 +14,7 @@
 #include <utils.h>
 #include <vga.h>
 #include <timer.h>
+#include <percpu.h>
 
 extern int pcpu_init(void);
 extern int apic_register(void);
@@ -22,6 +23,8 @@ extern int acpi_mem_mgr_on(void);
 extern int ioapic_register(void);
 extern int pit8254_register(void);
 extern int apic_timer_register(void);
+extern int tsc_register(void);
+extern int hpet_register(void);
 
 
 /******************************************************************************
@@ -197,6 +200,11 @@ int platform_pre_init(void)
 {
     int status = 0;
 
+    /* set up the per-CPU area of the BSP before anything else
+     * as it is used to identify the running CPU
+     */
+    percpu_bsp_init(cpu_id_query());
+
     /* init polling console */
     init_serial();
 
@@ -244,6 +252,17 @@ int platform_early_init(void)
     /* Register and initialize APIC */
     apic_register();
    
+    /* the HPET is a precise reference for the calibration of the TSC
+     * and of the APIC timer and an event timer that does not stop 
+     * in deep idle
+     */
+    hpet_register();
+
+    /* use the TSC for the monotonic clock if it is reliable 
+     * the APIC timer needs its frequency for the TSC-deadline mode
+     */
+    tsc_register();
+
     /* Register and initialize APIC TIMER */
     apic_timer_register();
 
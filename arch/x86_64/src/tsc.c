@@ -0,0 +1,178 @@
+/*
+ * Time Stamp Counter clock source
+ */
+
+#include <clock.h>
+#include <timer.h>
+#include <utils.h>
+#include <platform.h>
+#include <tsc.h>
+
+#define TSC_CPUID_EXT_MAX       (0x80000000)
+#define TSC_CPUID_EXT_POWER     (0x80000007)
+#define TSC_CPUID_FREQ          (0x15)
+#define TSC_INVARIANT           (1 << 8)
+#define TSC_CALIBRATION_NS      (50000000ull) /* 50 ms */
+
+static struct clock_source tsc_clock =
+{
+    .name   = "tsc",
+    .read   = __rdtsc,
+    .freq   = 0,
+    .rating = 300
+};
+
+/* the TSC ticks at a constant rate in all P, C and T states */
+static int tsc_is_invariant
+(
+    void
+)
+{
+    uint32_t eax = 0;
+    uint32_t ebx = 0;
+    uint32_t ecx = 0;
+    uint32_t edx = 0;
+
+    eax = TSC_CPUID_EXT_MAX;
+    __cpuid(&eax, &ebx, &ecx, &edx);
+
+    if(eax < TSC_CPUID_EXT_POWER)
+    {
+        return(0);
+    }
+
+    eax = TSC_CPUID_EXT_POWER;
+    ebx = 0;
+    ecx = 0;
+    edx = 0;
+
+    __cpuid(&eax, &ebx, &ecx, &edx);
+
+    return((edx & TSC_INVARIANT) != 0);
+}
+
+/* some CPUs report the TSC frequency through the crystal ratio */
+static uint64_t tsc_cpuid_freq
+(
+    void
+)
+{
+    uint32_t eax = 0;
+    uint32_t ebx = 0;
+    uint32_t ecx = 0;
+    uint32_t edx = 0;
+
+    __cpuid(&eax, &ebx, &ecx, &edx);
+
+    if(eax < TSC_CPUID_FREQ)
+    {
+        return(0);
+    }
+
+    eax = TSC_CPUID_FREQ;
+    ebx = 0;
+    ecx = 0;
+    edx = 0;
+
+    __cpuid(&eax, &ebx, &ecx, &edx);
+
+    if((eax == 0) || (ebx == 0) || (ecx == 0))
+    {
+        return(0);
+    }
+
+    return(((uint64_t)ecx * ebx) / eax);
+}
+
+/* count the TSC ticks against the clock source or the system timer */
+static uint64_t tsc_calibrate
+(
+    void
+)
+{
+    uint64_t tsc_start = 0;
+    uint64_t tsc_end   = 0;
+    uint64_t ns_start  = 0;
+    uint64_t ns_end    = 0;
+    int      int_status = 0;
+
+    /* a counter such as the HPET does not need interrupts */
+    if(clock_source_active())
+    {
+        ns_start  = clock_monotonic_ns();
+        tsc_start = __rdtsc();
+
+        while((ns_end = clock_monotonic_ns()) - ns_start < TSC_CALIBRATION_NS)
+        {
+            cpu_pause();
+        }
+
+        tsc_end = __rdtsc();
+
+        return(((tsc_end - tsc_start) * TIMER_RESOLUTION_NS) / 
+               (ns_end - ns_start));
+    }
+
+    int_status = cpu_int_check();
+
+    if(!int_status)
+    {
+        cpu_int_unlock();
+    }
+
+    /* start right after a tick */
+    ns_start = timer_system_now_ns();
+
+    while((ns_end = timer_system_now_ns()) == ns_start)
+    {
+        cpu_pause();
+    }
+
+    tsc_start = __rdtsc();
+    ns_start  = ns_end;
+
+    while((ns_end = timer_system_now_ns()) - ns_start < TSC_CALIBRATION_NS)
+    {
+        cpu_pause();
+    }
+
+    tsc_end = __rdtsc();
+
+    if(!int_status)
+    {
+        cpu_int_lock();
+    }
+
+    return(((tsc_end - tsc_start) * TIMER_RESOLUTION_NS) / 
+           (ns_end - ns_start));
+}
+
+/* frequency of an invariant TSC, 0 if it cannot be trusted */
+uint64_t tsc_freq_get
+(
+    void
+)
+{
+    return(tsc_clock.freq);
+}
+
+int tsc_register
+(
+    void
+)
+{
+    if(!tsc_is_invariant())
+    {
+        kprintf("TSC is not invariant - not using it as clock source\n");
+        return(-1);
+    }
+
+    tsc_clock.freq = tsc_cpuid_freq();
+
+    if(tsc_clock.freq == 0)
+    {
+        tsc_clock.freq = tsc_calibrate();
+    }
+
+    return(clock_source_register(&tsc_clock));
+}
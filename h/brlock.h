@@ -0,0 +1,74 @@
+#ifndef brlock_h
+#define brlock_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <spinlock.h>
+
+/* Big-reader lock - for data that is read very often and written rarely.
+ * A reader only touches a counter in the per-CPU area of its CPU, a
+ * writer blocks new readers and waits for the counters of all CPUs
+ * to drain. Readers must not migrate so the read side is held with
+ * the interrupts disabled.
+ */
+
+#define BRLOCK_MAX    (16)          /* readers counters in each per-CPU area */
+#define BRLOCK_NO_ID  (UINT32_MAX)  /* out of counters - readers exclude each other */
+
+struct brlock
+{
+    struct spinlock   lock;    /* serializes the writers */
+    volatile uint32_t writer;
+    uint32_t          id;
+};
+
+int brlock_init
+(
+    struct brlock *b
+);
+
+void brlock_read_lock
+(
+    struct brlock *b
+);
+
+void brlock_read_unlock
+(
+    struct brlock *b
+);
+
+void brlock_read_lock_int
+(
+    struct brlock *b,
+    uint8_t *flag
+);
+
+void brlock_read_unlock_int
+(
+    struct brlock *b,
+    uint8_t flag
+);
+
+void brlock_write_lock
+(
+    struct brlock *b
+);
+
+void brlock_write_unlock
+(
+    struct brlock *b
+);
+
+void brlock_write_lock_int
+(
+    struct brlock *b,
+    uint8_t *flag
+);
+
+void brlock_write_unlock_int
+(
+    struct brlock *b,
+    uint8_t flag
+);
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef clockh
+#define clockh
+
+#include <stdint.h>
+#include <defs.h>
+
+/* A clock source is a free running counter with a known frequency.
+ * The best registered source backs the monotonic clock, before that
+ * the time is taken from the ticks of the system timer.
+ */
+
+struct clock_source
+{
+    const char *name;
+    uint64_t  (*read)(void);  /* read the counter                */
+    uint64_t    freq;         /* counter increments per second   */
+    uint32_t    rating;       /* the highest rated source is used */
+};
+
+int clock_source_register
+(
+    struct clock_source *cs
+);
+
+uint64_t clock_monotonic_ns
+(
+    void
+);
+
+uint64_t clock_cycles
+(
+    void
+);
+
+int clock_source_active
+(
+    void
+);
+
+#endif
@@ -4,7 +4,9 @@
 #include <linked_list.h>
 #include <defs.h>
 #include <devmgr.h>
-#include <sched.h>
+
+struct sched_exec_unit;
+
 #define CPU_DEVICE_TYPE "cpu"
 #define CPU_IPI_EXEC_NODE_COUNT 64
 
@@ -34,8 +36,11 @@ struct cpu
     struct list_head avail_ipi_cb_slots;
     struct spinlock  ipi_cb_lock;
     uint32_t cpu_id;
+    uint32_t core_id;          /* same for the SMT siblings of a core */
+    uint32_t package_id;       /* same for the cores of a package     */
     uint32_t proximity_domain;
     struct sched_exec_unit *sched;
+    virt_addr_t percpu_base;
 };
 
 
@@ -44,6 +49,11 @@ uint32_t cpu_id_get
     void
 );
 
+uint32_t cpu_id_query
+(
+    void
+);
+
 int cpu_init
 (
     void
@@ -70,6 +80,11 @@ struct cpu *cpu_current_get
     void
 );
 
+void cpu_current_set
+(
+    struct cpu *cpu
+);
+
 void cpu_signal_on
 (
     void
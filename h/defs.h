@@ -9,5 +9,6 @@ typedef unsigned long long phys_size_t;
 
 #define WAIT_FOREVER (-1)
 #define NO_WAIT      (0)
+#define WAIT_FOREVER_NS (0xFFFFFFFFFFFFFFFFull)
 
 #endif
\ No newline at end of file
@@ -103,4 +103,32 @@ int32_t linked_list_concat
     struct list_head *dst
 );
 
+int32_t linked_list_add_head_rcu
+(
+    struct list_head *lh, 
+    struct list_node *ln
+);
+
+int32_t linked_list_add_tail_rcu
+(
+    struct list_head *lh, 
+    struct list_node *ln
+);
+
+int32_t linked_list_remove_rcu
+(
+    struct list_head *lh, 
+    struct list_node *ln
+);
+
+struct list_node *linked_list_first_rcu
+(
+    struct list_head *lh
+);
+
+struct list_node *linked_list_next_rcu
+(
+    struct list_node *ln
+);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,73 @@
+#ifndef lockstat_h
+#define lockstat_h
+
+#include <stdint.h>
+
+/* Lock statistics - build with LOCKSTAT defined and every spinlock,
+ * mutex and semaphore counts its acquisitions, the contended ones, the
+ * time spent waiting and holding it in timestamp counter cycles and the
+ * call sites that waited the most. The statistics are kept in a table
+ * indexed by the address of the lock so the locks do not grow. Without
+ * LOCKSTAT the hooks below compile to nothing.
+ */
+
+#define LOCKSTAT_SPINLOCK  (0)
+#define LOCKSTAT_MUTEX     (1)
+#define LOCKSTAT_SEM       (2)
+
+#ifdef LOCKSTAT
+
+#define LOCKSTAT_CALLER    ((uintptr_t)__builtin_return_address(0))
+
+#define lockstat_now()     lockstat_timestamp()
+
+#define lockstat_acquired(lock, type, wait_start, caller) \
+        lockstat_record_acquire((lock), (type), (wait_start), (caller))
+
+#define lockstat_released(lock)    lockstat_record_release(lock)
+#define lockstat_name(lock, name)  lockstat_set_name((lock), (name))
+
+uint64_t lockstat_timestamp
+(
+    void
+);
+
+void lockstat_record_acquire
+(
+    const void *lock,
+    uint32_t    type,
+    uint64_t    wait_start,
+    uintptr_t   caller
+);
+
+void lockstat_record_release
+(
+    const void *lock
+);
+
+void lockstat_set_name
+(
+    const void *lock,
+    const char *name
+);
+
+void lockstat_show
+(
+    void
+);
+
+#else
+
+#define LOCKSTAT_CALLER    (0)
+
+#define lockstat_now()     (0)
+
+#define lockstat_acquired(lock, type, wait_start, caller) ((void)(wait_start))
+
+#define lockstat_released(lock)    ((void)0)
+#define lockstat_name(lock, name)  ((void)0)
+#define lockstat_show()            ((void)0)
+
+#endif
+
+#endif
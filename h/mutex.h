@@ -3,6 +3,7 @@
 #include <linked_list.h>
 #include <spinlock.h>
 #include <sched.h>
+#include <wait_queue.h>
 
 #define MUTEX_RECUSRIVE (1 << 0)
 #define MUTEX_FIFO      (1 << 1)
@@ -10,13 +11,20 @@
 #define MUTEX_TASK_ORDER (MUTEX_FIFO | MUTEX_PRIO)
 #define MUTEX_LOWEST_PRIO  SCHED_MAX_PRIORITY
 
+/* the owner word holds the owning thread and these flags */
+#define MUTEX_WAITERS      (0x1ull)  /* the pend queue is not empty */
+#define MUTEX_OWNER_FLAGS  (0x7ull)
+#define MUTEX_SPIN_NS      (20000ull) /* how long to spin on a running owner */
+#define MUTEX_PI_MAX_DEPTH (16)       /* owners boosted through a chain of mutexes */
+
 struct mutex
 {
-    struct list_head pendq;
-    struct spinlock lock;
-    volatile void *owner;
+    struct wait_queue wq;      /* threads waiting for the mutex */
+    volatile uintptr_t owner;
     volatile uint32_t rlevel;
-    volatile uint32_t owner_prio;
+    volatile uint32_t owner_prio; /* highest priority of the waiters */
+    struct list_node pi_node;     /* node in the pi_held list of the owner */
+    uint8_t          pi_linked;
     int opts;
 };
 
@@ -37,6 +45,12 @@ int mtx_acquire
     uint32_t wait_ms
 );
 
+int mtx_acquire_timeout
+(
+    struct mutex *mtx, 
+    uint64_t timeout_ns
+);
+
 int mtx_release
 (
     struct mutex *mtx
@@ -0,0 +1,79 @@
+#ifndef percpuh
+#define percpuh
+
+#include <stdint.h>
+#include <defs.h>
+
+/* Per-CPU variables are placed in the .percpu section which acts as a
+ * template. Each CPU gets its own copy of the template and the GS base
+ * of the CPU points to the start of that copy, so the variable is
+ * accessed by a single GS-relative load/store using its offset in
+ * the template.
+ */
+
+extern virt_addr_t _percpu;
+extern virt_addr_t _percpu_end;
+extern virt_addr_t _percpu_bsp;
+
+#define PERCPU_SECTION       __attribute__((section(".percpu")))
+#define PERCPU_FIRST_SECTION __attribute__((section(".percpu.first")))
+
+#define PERCPU_DEFINE(type, name)  type name PERCPU_SECTION
+#define PERCPU_DECLARE(type, name) extern type name
+
+#define PERCPU_SIZE ((virt_size_t)&_percpu_end - (virt_size_t)&_percpu)
+#define PERCPU_MAX_AREAS (4096) /* areas are tracked by the id of their CPU */
+
+#define PERCPU_OFFSET(name) ((virt_addr_t)&(name) - (virt_addr_t)&_percpu)
+
+/* access the variable of the current CPU */
+#define percpu_read(name) \
+        (*(__typeof__(name) __seg_gs *)PERCPU_OFFSET(name))
+
+#define percpu_write(name, val) \
+        (*(__typeof__(name) __seg_gs *)PERCPU_OFFSET(name) = (val))
+
+/* access the variable of a CPU by the base of its per-CPU area */
+#define percpu_remote_ptr(base, name) \
+        ((__typeof__(name)*)((virt_addr_t)(base) + PERCPU_OFFSET(name)))
+
+#define percpu_ptr(name) percpu_remote_ptr(percpu_base_get(), name)
+
+PERCPU_DECLARE(uint32_t, percpu_cpu_id);
+
+int percpu_bsp_init
+(
+    uint32_t cpu_id
+);
+
+virt_addr_t percpu_area_alloc
+(
+    uint32_t cpu_id
+);
+
+void percpu_area_free
+(
+    virt_addr_t base
+);
+
+int percpu_area_load
+(
+    virt_addr_t base
+);
+
+virt_addr_t percpu_base_get
+(
+    void
+);
+
+virt_addr_t percpu_area_get
+(
+    uint32_t index
+);
+
+uint32_t percpu_area_count
+(
+    void
+);
+
+#endif
@@ -24,6 +24,7 @@ struct rb_tree
     struct rb_node nil;
 };
 
+/* returns > 0 if tree_node goes after key, < 0 if before and 0 if equal */
 typedef int (*rb_tree_commpare)(struct rb_node *tree_node, void *key);
 
 void rb_tree_init
@@ -45,4 +46,30 @@ int rb_insert
     void *cmp_pv
 );
 
+uint32_t rb_tree_find
+(
+    struct rb_tree *tree, 
+    rb_tree_commpare cmp_func, 
+    void *key,
+    struct rb_node **result
+);
+
+struct rb_node *rb_tree_minimum
+(
+    struct rb_tree *t,
+    struct rb_node *x
+);
+
+struct rb_node *rb_tree_maximum
+(
+    struct rb_tree *t,
+    struct rb_node *x
+);
+
+struct rb_node *rb_tree_predecessor
+(
+    struct rb_tree *t,
+    struct rb_node *x
+);
+
 #endif
\ No newline at end of file
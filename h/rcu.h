@@ -0,0 +1,57 @@
+#ifndef rcu_h
+#define rcu_h
+
+#include <stdint.h>
+#include <linked_list.h>
+
+/* Read-copy-update - readers only disable preemption while the
+ * writers publish new versions of the data and free the old ones
+ * after every CPU went through a quiescent state (a context switch,
+ * the idle loop or an interrupt that did not hit a reader).
+ */
+
+#define RCU_POLL_NS  (1000000ull) /* how often synchronize_rcu checks the CPUs */
+
+struct rcu_head
+{
+    struct list_node node;
+    void (*func)(struct rcu_head *head);
+};
+
+int rcu_init
+(
+    void
+);
+
+void rcu_cpu_online
+(
+    void
+);
+
+void rcu_quiescent
+(
+    void
+);
+
+void rcu_read_lock
+(
+    void
+);
+
+void rcu_read_unlock
+(
+    void
+);
+
+void synchronize_rcu
+(
+    void
+);
+
+void call_rcu
+(
+    struct rcu_head *head,
+    void (*func)(struct rcu_head *head)
+);
+
+#endif
@@ -0,0 +1,65 @@
+#ifndef rwsem_h
+#define rwsem_h
+
+#include <stdint.h>
+#include <wait_queue.h>
+
+/* Reader-writer semaphore - a sleeping reader-writer lock for long
+ * read-mostly sections. The state is a single word: the number of
+ * readers, a writer bit and a bit telling that the wait queue is not
+ * empty. Readers get in with an atomic add, and while anybody waits
+ * new readers queue up behind them so the writers are not starved.
+ * It must not be taken from interrupt context or with the preemption
+ * disabled - only a CPU that does not run the scheduler yet spins for
+ * it instead of sleeping. Read locks do not nest.
+ */
+
+#define RWSEM_WRITER      (0x1)
+#define RWSEM_WAITERS     (0x2)
+#define RWSEM_READER      (0x100)
+#define RWSEM_FLAGS_MASK  (RWSEM_READER - 1)
+
+#define RWSEM_READERS(x)  ((x) / RWSEM_READER)
+
+struct rwsem
+{
+    volatile int64_t  count;
+    struct wait_queue wq;
+};
+
+void rwsem_init
+(
+    struct rwsem *sem
+);
+
+int rwsem_read_try_lock
+(
+    struct rwsem *sem
+);
+
+void rwsem_read_lock
+(
+    struct rwsem *sem
+);
+
+void rwsem_read_unlock
+(
+    struct rwsem *sem
+);
+
+int rwsem_write_try_lock
+(
+    struct rwsem *sem
+);
+
+void rwsem_write_lock
+(
+    struct rwsem *sem
+);
+
+void rwsem_write_unlock
+(
+    struct rwsem *sem
+);
+
+#endif
@@ -3,6 +3,8 @@
 #include <devmgr.h>
 #include <cpu.h>
 #include <timer.h>
+#include <rb_tree.h>
+#include <seqlock.h>
 
 #define THREAD_NAME_LENGTH      (64)
 
@@ -13,9 +15,26 @@
 #define THREAD_NEED_RESCHEDULE  (1 << 4)
 #define THREAD_INACTIVE         (1 << 5)
 
+#define UNIT_BALANCE_PENDING    (1 << 0)
+#define UNIT_TICK_STOPPED       (1 << 1)
+
+#define EDF_THROTTLED           (1 << 0)
+#define EDF_MISS_COUNTED        (1 << 1)
+
 #define CPU_AFFINITY_VECTOR     (0x8)
 
+/* scheduling domains - from the closest to the farthest */
+#define SCHED_DOMAIN_SMT        (0) /* SMT siblings of the same core   */
+#define SCHED_DOMAIN_PACKAGE    (1) /* cores of the same package       */
+#define SCHED_DOMAIN_NUMA       (2) /* packages of the same NUMA node  */
+#define SCHED_DOMAIN_SYSTEM     (3) /* all the units                   */
+#define SCHED_DOMAIN_LEVELS     (4)
+
 #define SCHED_MAX_PRIORITY 255
+#define SCHED_PRIO_NONE    (0xFFFF) /* no inherited priority */
+
+/* how late a sleeping thread may be woken up by default */
+#define SCHED_DEFAULT_TIMER_SLACK_NS (50000ull)
 
 #define SYSTEM_NODE_TO_THREAD(x) (struct sched_thread*) (((uint8_t*)(x)) -  \
                                  offsetof(struct sched_thread, system_node))
@@ -36,12 +55,16 @@ typedef unsigned char cpu_aff_t[CPU_AFFINITY_VECTOR] ;
 
 struct sched_thread;
 struct sched_exec_unit;
+struct mutex;
 
 enum sched_policy_id
 {
     sched_policy_default = 0,
     sched_idle_task_policy = 1,
-    sched_basic_policy = 2
+    sched_basic_policy = 2,
+    sched_prio_policy = 3,
+    sched_fair_policy = 4,
+    sched_edf_policy = 5
 };
 
 struct sched_policy
@@ -92,10 +115,48 @@ struct sched_policy
         struct sched_exec_unit *unit
     );
 
+    /* check if th should preempt cur, both of the same policy */
+    int32_t (*check_preempt)
+    (
+        struct sched_exec_unit *unit,
+        struct sched_thread    *cur,
+        struct sched_thread    *th
+    );
+
+    /* find a queued thread on src that can be moved to dst */
+    int32_t (*select_migrate)
+    (
+        struct sched_exec_unit *src,
+        struct sched_exec_unit *dst,
+        struct sched_thread   **th
+    );
+
+    /* the priority of a queued thread changed from old_prio */
+    int32_t (*prio_changed)
+    (
+        struct sched_exec_unit *unit,
+        struct sched_thread    *th,
+        uint16_t                old_prio
+    );
+
     void *pv;
 
 };
 
+/* earliest deadline first reservation of a thread - times are in ns */
+struct sched_edf
+{
+    struct rb_node     node;          /* node in the EDF policy tree          */
+    struct timer       timer;         /* periodic replenishment timer         */
+    uint64_t           runtime;       /* budget per period                    */
+    uint64_t           deadline;      /* relative deadline                    */
+    uint64_t           period;        /* replenishment period                 */
+    uint64_t           runtime_left;  /* budget left in the current period    */
+    uint64_t           abs_deadline;  /* deadline on the unit clock           */
+    uint64_t           misses;        /* number of missed deadlines           */
+    uint32_t           flags;
+};
+
 struct sched_thread
 {
     struct list_node        system_node;  /* system-wide node                              */
@@ -112,6 +173,10 @@ struct sched_thread
     virt_addr_t        context;      /* thread context                                */
 
     uint16_t           prio;         /* priority                                      */
+    uint16_t           base_prio;    /* priority without the inherited one            */
+    uint16_t           pi_prio;      /* priority inherited from the waiters           */
+    struct mutex      *pi_blocked_on; /* mutex the thread is waiting for             */
+    struct list_head   pi_held;      /* owned mutexes that have waiters               */
     void              *entry_point;  /* entry point of the thread                     */
     void              *arg;          /* parameter for the entry point of the thread   */
     struct sched_exec_unit *unit;         /* execution unit on which the thread is running */
@@ -123,6 +188,18 @@ struct sched_thread
     uint8_t           name[THREAD_NAME_LENGTH];
 
     uint64_t           context_switches;
+    uint64_t           last_run;     /* unit tick when the thread last ran   */
+
+    struct rb_node     fair_node;    /* node in the fair policy tree         */
+    int64_t            vruntime;     /* weighted runtime for the fair policy */
+    uint64_t           exec_start;   /* timestamp when the runtime was last charged */
+
+    struct sched_edf   edf;
+
+    struct sched_thread *wake_next;  /* next thread in the wake list of the unit */
+    uint32_t           wake_pending; /* thread is in the wake list of the unit   */
+
+    uint64_t           timer_slack;  /* ns its sleeps may be extended with     */
 };
 
 struct sched_exec_unit
@@ -137,9 +214,29 @@ struct sched_exec_unit
     uint32_t        flags;     /* flags for the execution unit               */
     uint32_t        preempt_lock; /* preemption lock count */
     struct device_node       *timer_dev; /* timer device which is connected to this unit  */
-    struct spinlock      wake_q_lock; /* lock for the wake queue */
-    struct list_head     wake_q;    /* queue of threads that wait to be woken up  */
+    struct sched_thread *wake_list; /* lock-free list of threads to be woken up */
     struct list_head     unit_threads;
+    uint64_t        ticks;          /* ticks elapsed on this unit            */
+    uint64_t        next_balance;   /* tick of the next periodic balancing   */
+    uint32_t        nr_ready;       /* threads queued in the policies        */
+    uint64_t        migrations_in;  /* threads pulled from other units       */
+    uint64_t        migrations_out; /* threads pulled by other units         */
+    uint32_t        domain_id[SCHED_DOMAIN_LEVELS]; /* domain of each level */
+    uint64_t        clock_ns;       /* time elapsed on this unit in ns       */
+    uint64_t        tick_ns;        /* length of the last tick in ns         */
+    uint64_t        tick_period_ns; /* length of the periodic tick in ns     */
+    struct seqcount stats_seq;      /* published ticks, clock and migrations */
+};
+
+/* consistent snapshot of the statistics of a unit */
+struct sched_unit_stats
+{
+    uint64_t ticks;
+    uint64_t clock_ns;
+    uint64_t tick_ns;
+    uint32_t nr_ready;
+    uint64_t migrations_in;
+    uint64_t migrations_out;
 };
 
 struct sched_owner
@@ -190,11 +287,56 @@ void sched_yield
     void
 );
 
+void sched_disable_preempt
+(
+    void
+);
+
+void sched_enable_preempt
+(
+    void
+);
+
 void sched_sleep
 (
     uint32_t delay
 );
 
+int sched_sleep_ns
+(
+    uint64_t ns
+);
+
+int sched_sleep_unlock
+(
+    struct spinlock *lock,
+    uint8_t          int_state,
+    uint64_t         ns
+);
+
+int sched_sleep_until
+(
+    uint64_t deadline_ns
+);
+
+void sched_thread_set_priority
+(
+    struct sched_thread *th, 
+    uint16_t prio
+);
+
+void sched_thread_inherit_priority
+(
+    struct sched_thread *th,
+    uint16_t pi_prio
+);
+
+int sched_thread_timer_slack_set
+(
+    struct sched_thread *th,
+    uint64_t             slack_ns
+);
+
 int sched_start_thread
 (
     struct sched_thread *th
@@ -230,4 +372,52 @@ void sched_show_threads
     void
 );
 
+void sched_show_units
+(
+    void
+);
+
+int sched_unit_stats_get
+(
+    struct sched_exec_unit  *unit,
+    struct sched_unit_stats *stats
+);
+
+int sched_thread_policy_set
+(
+    struct sched_thread *th,
+    enum sched_policy_id id
+);
+
+void sched_unit_kick
+(
+    struct sched_exec_unit *unit
+);
+
+int sched_unit_allowed
+(
+    struct sched_exec_unit *unit,
+    struct sched_thread    *th
+);
+
+int sched_edf_reserve
+(
+    struct sched_thread *th,
+    uint64_t runtime_ns,
+    uint64_t deadline_ns,
+    uint64_t period_ns
+);
+
+int sched_edf_release
+(
+    struct sched_thread *th
+);
+
+int sched_can_migrate
+(
+    struct sched_exec_unit *src,
+    struct sched_exec_unit *dst,
+    struct sched_thread    *th
+);
+
 #endif
\ No newline at end of file
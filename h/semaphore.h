@@ -2,12 +2,16 @@
 #define semaphoreh
 #include <linked_list.h>
 #include <spinlock.h>
+#include <wait_queue.h>
 
+/* count goes negative by the number of threads that have to wait so
+ * the wait queue is touched only when somebody waits
+ */
 struct sem
 {
-    struct list_head       pendq;
-    struct spinlock        lock;
-    volatile uint32_t count;
+    struct wait_queue wq;
+    volatile int64_t  count;
+    uint32_t          wakeups;   /* releases for waiters not queued yet */
     uint32_t          max_count;
 };
 
@@ -30,6 +34,12 @@ int sem_acquire
     uint32_t wait_ms
 );
 
+int sem_acquire_timeout
+(
+    struct sem *sem, 
+    uint64_t timeout_ns
+);
+
 int sem_release
 (
     struct sem *sem
@@ -0,0 +1,97 @@
+#ifndef seqlock_h
+#define seqlock_h
+
+#include <stdint.h>
+#include <spinlock.h>
+
+/* Sequence counter - for data that is read far more often than it is
+ * written. The writer makes the sequence odd while it updates the data
+ * and even again when it is done. Readers only load the sequence: they
+ * copy the data and retry if the sequence was odd or has changed, so
+ * they never write to the cache line of the data.
+ *
+ * The writers of a seqcount must be serialized by the caller and must
+ * not be interrupted by a reader on the same CPU. A seqlock carries its
+ * own ticket lock to serialize them - the writers are rare and the lock
+ * keeps the seqlock in eight bytes.
+ */
+
+#define SEQCOUNT_INIT {.seq = 0}
+#define SEQLOCK_INIT  {.sc = SEQCOUNT_INIT, .lock = {.next = 0, .owner = 0}}
+
+struct seqcount
+{
+    volatile uint32_t seq;
+};
+
+struct seqlock
+{
+    struct seqcount        sc;
+    struct spinlock_ticket lock; /* serializes the writers */
+};
+
+void seqcount_init
+(
+    struct seqcount *s
+);
+
+uint32_t seqcount_read_begin
+(
+    const struct seqcount *s
+);
+
+int seqcount_read_retry
+(
+    const struct seqcount *s,
+    uint32_t seq
+);
+
+void seqcount_write_begin
+(
+    struct seqcount *s
+);
+
+void seqcount_write_end
+(
+    struct seqcount *s
+);
+
+void seqlock_init
+(
+    struct seqlock *s
+);
+
+uint32_t seqlock_read_begin
+(
+    const struct seqlock *s
+);
+
+int seqlock_read_retry
+(
+    const struct seqlock *s,
+    uint32_t seq
+);
+
+void seqlock_write_lock
+(
+    struct seqlock *s
+);
+
+void seqlock_write_unlock
+(
+    struct seqlock *s
+);
+
+void seqlock_write_lock_int
+(
+    struct seqlock *s,
+    uint8_t *flag
+);
+
+void seqlock_write_unlock_int
+(
+    struct seqlock *s,
+    uint8_t flag
+);
+
+#endif
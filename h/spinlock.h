@@ -6,10 +6,32 @@
 
 #define SPINLOCK_INIT {.lock = 0};
 #define SPINLOCK_RW_INIT {.lock = UINT32_MAX};
+#define SPINLOCK_TICKET_INIT {.next = 0, .owner = 0};
+
+/* Queued spinlock - bit 0 of the lock word is the locked bit and the
+ * rest of it points to the queue node of the last waiter. The waiters
+ * spin on their own node and get the lock in FIFO order.
+ */
+#define SPINLOCK_LOCKED     (0x1ull)
+#define SPINLOCK_TAIL_MASK  (~0x3Full)
+#define SPINLOCK_NODES      (4)  /* nesting levels - thread, irq, nmi, fault */
+
+struct spinlock_node
+{
+    struct spinlock_node *volatile next;
+    volatile uint32_t             locked;
+} __attribute__((aligned(64)));
 
 struct spinlock
 {
-    volatile uint32_t lock;
+    volatile uint64_t lock;
+};
+
+/* Ticket lock - four bytes and FIFO, for small structures */
+struct spinlock_ticket
+{
+    volatile uint16_t next;
+    volatile uint16_t owner;
 };
 
 struct spinlock_rw
@@ -57,6 +79,38 @@ int8_t spinlock_try_lock_int
     uint8_t *flag
 )
 ;
+void spinlock_ticket_init
+(
+    struct spinlock_ticket *s
+);
+
+void spinlock_ticket_lock
+(
+    struct spinlock_ticket *s
+);
+
+int8_t spinlock_ticket_try_lock
+(
+    struct spinlock_ticket *s
+);
+
+void spinlock_ticket_unlock
+(
+    struct spinlock_ticket *s
+);
+
+void spinlock_ticket_lock_int
+(
+    struct spinlock_ticket *s,
+    uint8_t *flag
+);
+
+void spinlock_ticket_unlock_int
+(
+    struct spinlock_ticket *s,
+    uint8_t flag
+);
+
 void spinlock_write_unlock_int
 (
     struct spinlock_rw *s,
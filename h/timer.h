@@ -16,6 +16,19 @@
 #define TIMER_RESOLUTION_NS  (1000000000ull) // nanosecond
 #define NODE_TO_TIMER (node)    ((uint8_t*)(node) - offsetof((node), struct timer))
 
+/* Timers are kept in a hierarchical timing wheel. Each level has 64 slots
+ * and each slot of a level covers 64 slots of the level below. A wheel
+ * tick is 2^20 ns (~1ms) so the wheel covers 2^50 ns (~13 days), longer
+ * timers are parked in the last level and cascaded again when they get
+ * there.
+ */
+#define TIMER_WHEEL_LEVELS   (5)
+#define TIMER_WHEEL_BITS     (6)
+#define TIMER_WHEEL_SLOTS    (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK     (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_SHIFT    (20)
+#define TIMER_WHEEL_RANGE    (1ull << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))
+
 struct time_spec
 {
     uint32_t nanosec;
@@ -34,13 +47,14 @@ typedef uint32_t (*timer_handler_t) \
 struct timer_device
 {
     struct device_node    *backing_dev;  /* backing timer device      */
-    struct list_head active_q;      /* timer queue               */
-    struct list_head pend_q;
-    struct spinlock  lock_active_q;       /* lock to ptorect the queue */
+    struct list_head pend_q;             /* timers not yet in the wheel */
+    struct spinlock  lock_wheel;         /* lock to protect the wheel */
     struct spinlock  lock_pend_q; 
-    struct time_spec step;
-    struct time_spec next_increment;
-    struct time_spec current_increment;
+    uint64_t         now_ns;             /* time since the timer started */
+    uint64_t         now_clk;            /* monotonic clock at now_ns    */
+    uint64_t         wheel_clk;          /* next wheel tick to expire */
+    uint32_t         wheel_count;        /* timers in the wheel       */
+    struct list_head wheel[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
 };
 
 struct timer
@@ -48,8 +62,11 @@ struct timer
     struct list_node       node;
     timer_handler_t   callback;
     void              *arg;
-    struct time_spec       to_sleep;
-    struct time_spec       cursor;
+    struct time_spec       to_sleep;     /* timeout and period        */
+    uint64_t          expires;           /* absolute deadline in ns   */
+    uint64_t          slack;             /* allowed delay in ns       */
+    struct list_head  *slot;             /* queue holding the timer   */
+    struct timer_device *dev;            /* device the timer is on    */
     uint8_t           flags;
 };
 
@@ -74,6 +91,27 @@ int timer_system_init
     void
 );
 
+uint64_t timer_system_now_ns
+(
+    void
+);
+
+int timer_cpu_init
+(
+    void
+);
+
+uint32_t timer_cpu_tick
+(
+    const struct time_spec *step,
+    const void             *isr_inf
+);
+
+int timer_cpu_next_event
+(
+    uint64_t *ns
+);
+
 int timer_enqeue
 (
     struct timer_device     *timer_dev,
@@ -93,6 +131,17 @@ int timer_enqeue_static
     struct timer         *tm
 );
 
+int timer_enqeue_slack
+(
+    struct timer_device *timer_dev,
+    struct time_spec    *ts,
+    uint64_t             slack_ns,
+    timer_handler_t      func,
+    void                *arg,
+    uint8_t              flags,
+    struct timer        *tm
+);
+
 int timer_dequeue
 (
     struct timer_device *timer_dev,
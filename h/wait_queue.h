@@ -0,0 +1,77 @@
+#ifndef wait_queue_h
+#define wait_queue_h
+
+#include <stdint.h>
+#include <linked_list.h>
+#include <spinlock.h>
+
+struct sched_thread;
+
+/* Wait queue - threads sleep on it until a waker hands them what they
+ * wait for. The lock of the queue is also the lock of the object that
+ * owns it so the waiter checks its condition and queues itself
+ * atomically with respect to the wakers.
+ */
+
+#define WAIT_QUEUE_EXCLUSIVE  (1 << 0)  /* woken one at a time             */
+#define WAIT_QUEUE_PRIO       (1 << 1)  /* queued by priority, not in FIFO */
+
+#define WAIT_ENTRY_TO_THREAD(x) (((struct wait_queue_entry*)(x))->th)
+
+struct wait_queue
+{
+    struct list_head head;
+    struct spinlock  lock;
+};
+
+struct wait_queue_entry
+{
+    struct list_node     node;
+    struct sched_thread *th;
+    uint32_t             flags;
+    volatile uint32_t    woken;  /* set by the waker, the entry is off the queue */
+};
+
+void wait_queue_init
+(
+    struct wait_queue *wq
+);
+
+void wait_queue_add
+(
+    struct wait_queue       *wq,
+    struct wait_queue_entry *we,
+    uint32_t                 flags
+);
+
+void wait_queue_remove
+(
+    struct wait_queue       *wq,
+    struct wait_queue_entry *we
+);
+
+int wait_queue_sleep
+(
+    struct wait_queue       *wq,
+    struct wait_queue_entry *we,
+    uint64_t                 timeout_ns,
+    uint8_t                 *int_state
+);
+
+uint32_t wait_queue_wake
+(
+    struct wait_queue *wq,
+    uint32_t           nr_exclusive
+);
+
+struct sched_thread *wait_queue_wake_one
+(
+    struct wait_queue *wq
+);
+
+struct sched_thread *wait_queue_first
+(
+    struct wait_queue *wq
+);
+
+#endif
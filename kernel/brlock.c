@@ -0,0 +1,209 @@
+/*
+ * Big-reader lock
+ */
+
+#include <brlock.h>
+#include <percpu.h>
+#include <platform.h>
+
+/* readers of each lock on this CPU */
+static PERCPU_DEFINE(volatile uint32_t, brlock_readers[BRLOCK_MAX]);
+static uint32_t brlock_next_id = 0;
+
+int brlock_init
+(
+    struct brlock *b
+)
+{
+    uint32_t id = 0;
+
+    spinlock_init(&b->lock);
+    b->writer = 0;
+
+    id = __atomic_fetch_add(&brlock_next_id, 1, __ATOMIC_RELAXED);
+
+    if(id >= BRLOCK_MAX)
+    {
+        b->id = BRLOCK_NO_ID;
+        return(-1);
+    }
+
+    b->id = id;
+
+    return(0);
+}
+
+/* brlock_readers_sum - readers of the lock on all the CPUs */
+
+static uint32_t brlock_readers_sum
+(
+    struct brlock *b
+)
+{
+    virt_addr_t base = 0;
+    uint32_t count = 0;
+    uint32_t sum = 0;
+    uint32_t i = 0;
+
+    count = percpu_area_count();
+
+    for(i = 0; i < count; i++)
+    {
+        base = percpu_area_get(i);
+
+        if(base != 0)
+        {
+            sum += *percpu_remote_ptr(base, brlock_readers[b->id]);
+        }
+    }
+
+    return(sum);
+}
+
+void brlock_read_lock
+(
+    struct brlock *b
+)
+{
+    uint32_t readers = 0;
+
+    if(b->id == BRLOCK_NO_ID)
+    {
+        spinlock_lock(&b->lock);
+        return;
+    }
+
+    readers = percpu_read(brlock_readers[b->id]);
+    percpu_write(brlock_readers[b->id], readers + 1);
+
+    /* a nested reader already holds off the writers */
+    if(readers != 0)
+    {
+        return;
+    }
+
+    /* the writer must see our counter or we must see the writer */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    while(__atomic_load_n(&b->writer, __ATOMIC_ACQUIRE))
+    {
+        percpu_write(brlock_readers[b->id], 0);
+
+        while(__atomic_load_n(&b->writer, __ATOMIC_RELAXED))
+        {
+            cpu_pause();
+        }
+
+        percpu_write(brlock_readers[b->id], 1);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    }
+}
+
+void brlock_read_unlock
+(
+    struct brlock *b
+)
+{
+    uint32_t readers = 0;
+
+    if(b->id == BRLOCK_NO_ID)
+    {
+        spinlock_unlock(&b->lock);
+        return;
+    }
+
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    readers = percpu_read(brlock_readers[b->id]);
+    percpu_write(brlock_readers[b->id], readers - 1);
+}
+
+void brlock_read_lock_int
+(
+    struct brlock *b,
+    uint8_t *flag
+)
+{
+    *flag = cpu_int_check();
+
+    cpu_int_lock();
+
+    brlock_read_lock(b);
+}
+
+void brlock_read_unlock_int
+(
+    struct brlock *b,
+    uint8_t flag
+)
+{
+    brlock_read_unlock(b);
+
+    if(flag)
+    {
+        cpu_int_unlock();
+    }
+}
+
+void brlock_write_lock
+(
+    struct brlock *b
+)
+{
+    spinlock_lock(&b->lock);
+
+    if(b->id == BRLOCK_NO_ID)
+    {
+        return;
+    }
+
+    /* stop new readers and wait for the current ones to leave */
+    __atomic_store_n(&b->writer, 1, __ATOMIC_SEQ_CST);
+
+    while(brlock_readers_sum(b) != 0)
+    {
+        cpu_pause();
+    }
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+}
+
+void brlock_write_unlock
+(
+    struct brlock *b
+)
+{
+    if(b->id != BRLOCK_NO_ID)
+    {
+        __atomic_store_n(&b->writer, 0, __ATOMIC_RELEASE);
+    }
+
+    spinlock_unlock(&b->lock);
+}
+
+void brlock_write_lock_int
+(
+    struct brlock *b,
+    uint8_t *flag
+)
+{
+    *flag = cpu_int_check();
+
+    cpu_int_lock();
+
+    brlock_write_lock(b);
+}
+
+void brlock_write_unlock_int
+(
+    struct brlock *b,
+    uint8_t flag
+)
+{
+    brlock_write_unlock(b);
+
+    if(flag)
+    {
+        cpu_int_unlock();
+    }
+}
@@ -0,0 +1,137 @@
+#include <clock.h>
+#include <timer.h>
+#include <seqlock.h>
+#include <utils.h>
+#include <platform.h>
+
+/*
+ * Monotonic clock - the counter of the clock source is converted to
+ * nanoseconds as base_ns + ((cycles - base_cycles) * mult) >> shift.
+ * The conversion parameters only change when a source is registered
+ * and they are published with a seqlock so the readers never take a
+ * lock or write to the shared state.
+ */
+
+#define CLOCK_SHIFT (32)
+
+struct clock_params
+{
+    struct clock_source *cs;
+    uint64_t             mult;
+    uint32_t             shift;
+    uint64_t             base_cycles;
+    uint64_t             base_ns;
+};
+
+struct clock_state
+{
+    struct seqlock       lock;
+    struct clock_params  p;
+};
+
+static struct clock_state clock = {0};
+
+static inline uint64_t clock_cycles_to_ns
+(
+    uint64_t cycles,
+    uint64_t mult,
+    uint32_t shift
+)
+{
+    return((uint64_t)(((unsigned __int128)cycles * mult) >> shift));
+}
+
+static uint64_t clock_params_ns
+(
+    const struct clock_params *p
+)
+{
+    if(p->cs == NULL)
+    {
+        return(timer_system_now_ns());
+    }
+
+    return(p->base_ns + clock_cycles_to_ns(p->cs->read() - p->base_cycles, 
+                                           p->mult, 
+                                           p->shift));
+}
+
+uint64_t clock_monotonic_ns
+(
+    void
+)
+{
+    struct clock_params p   = {0};
+    uint32_t            seq = 0;
+
+    do
+    {
+        seq = seqlock_read_begin(&clock.lock);
+        p   = clock.p;
+    }while(seqlock_read_retry(&clock.lock, seq));
+
+    return(clock_params_ns(&p));
+}
+
+uint64_t clock_cycles
+(
+    void
+)
+{
+    struct clock_source *cs = NULL;
+
+    cs = __atomic_load_n(&clock.p.cs, __ATOMIC_ACQUIRE);
+
+    if(cs == NULL)
+    {
+        return(timer_system_now_ns());
+    }
+
+    return(cs->read());
+}
+
+/* tell if the clock is backed by a counter rather than by ticks */
+int clock_source_active
+(
+    void
+)
+{
+    return(__atomic_load_n(&clock.p.cs, __ATOMIC_ACQUIRE) != NULL);
+}
+
+int clock_source_register
+(
+    struct clock_source *cs
+)
+{
+    uint8_t  int_flag = 0;
+    uint64_t now      = 0;
+
+    if((cs == NULL) || (cs->read == NULL) || (cs->freq == 0))
+    {
+        return(-1);
+    }
+
+    seqlock_write_lock_int(&clock.lock, &int_flag);
+
+    if((clock.p.cs != NULL) && (clock.p.cs->rating >= cs->rating))
+    {
+        seqlock_write_unlock_int(&clock.lock, int_flag);
+        return(-1);
+    }
+
+    /* continue from where the previous source is */
+    now = clock_params_ns(&clock.p);
+
+    clock.p.mult        = (TIMER_RESOLUTION_NS << CLOCK_SHIFT) / cs->freq;
+    clock.p.shift       = CLOCK_SHIFT;
+    clock.p.base_cycles = cs->read();
+    clock.p.base_ns     = now;
+    __atomic_store_n(&clock.p.cs, cs, __ATOMIC_RELEASE);
+
+    seqlock_write_unlock_int(&clock.lock, int_flag);
+
+    kprintf("CLOCK: using %s at %d KHz\n", cs->name, cs->freq / 1000);
+
+    return(0);
+}
@@ -3,32 +3,24 @@
 #include <platform.h>
 #include <intc.h>
 #include <utils.h>
+#include <percpu.h>
+
+static PERCPU_DEFINE(struct cpu*, current_cpu) = NULL;
 
 struct cpu *cpu_current_get(void)
 {
-    struct device_node *dev = NULL;
-    uint32_t cpu_id = 0;
-    struct cpu    *cpu = NULL;
-    int int_state = 0;
-
-    int_state = cpu_int_check();
-
-    if(int_state)
-    {
-        cpu_int_lock();
-    }
+    return(percpu_read(current_cpu));
+}
 
-    cpu_id = cpu_id_get();
-    
-    dev = devmgr_dev_get_by_name(PLATFORM_CPU_NAME, cpu_id);
-    cpu = (struct cpu*)dev;
+/* cpu_current_set - bind the cpu structure to the CPU we are running on */
 
-    if(int_state)
-    {
-        cpu_int_unlock();
-    }
-    
-    return(cpu);
+void cpu_current_set
+(
+    struct cpu *cpu
+)
+{
+    cpu->percpu_base = percpu_base_get();
+    percpu_write(current_cpu, cpu);
 }
 
 
@@ -4,15 +4,17 @@
 #include <linked_list.h>
 #include <devmgr.h>
 #include <spinlock.h>
+#include <brlock.h>
+#include <rwsem.h>
 #include <liballoc.h>
 #include <utils.h>
 #define DEVMGR_SRCH_STACK 128
 
 
 static struct list_head drv_list;
-static struct spinlock_rw  drv_list_lock;
+static struct rwsem       drv_list_lock;
 static struct device_node    root_bus;
-static struct spinlock_rw  dev_list_lock;
+static struct brlock      dev_list_lock;
 
 static int devmgr_dev_add_to_parent
 (
@@ -29,9 +31,12 @@ int devmgr_show_devices
     struct list_node **dev_stack = NULL;
     struct list_node *node        = NULL;
     int          stack_index = 0;
+    uint8_t      int_flag    = 0;
 
     dev_stack = kcalloc(DEVMGR_SRCH_STACK, sizeof(struct list_node*));
 
+    brlock_read_lock_int(&dev_list_lock, &int_flag);
+
     node = linked_list_first(&root_bus.children);
 
     for(;;)
@@ -80,6 +85,9 @@ int devmgr_show_devices
             break;
         }
     }
+
+    brlock_read_unlock_int(&dev_list_lock, int_flag);
+
     kfree(dev_stack);
     return(0);
 }
@@ -90,8 +98,8 @@ int devmgr_init
 )
 {
     linked_list_init(&drv_list);
-    spinlock_rw_init(&drv_list_lock);
-    spinlock_rw_init(&dev_list_lock);
+    rwsem_init(&drv_list_lock);
+    brlock_init(&dev_list_lock);
     memset(&root_bus, 0, sizeof(struct device_node));
     devmgr_dev_name_set(&root_bus, "root_bus");
     devmgr_dev_type_set(&root_bus, DEVMGR_ROOT_BUS);
@@ -194,11 +202,11 @@ int devmgr_dev_remove
         return(-1);
     }
 
-    spinlock_write_lock_int(&dev_list_lock, &int_flag);
+    brlock_write_lock_int(&dev_list_lock, &int_flag);
 
     if((linked_list_count(&dev->children) > 0) && (remove_children == 0))
     {
-        spinlock_write_unlock_int(&dev_list_lock, int_flag);
+        brlock_write_unlock_int(&dev_list_lock, int_flag);
         return(-1);
     }
 
@@ -255,7 +263,7 @@ int devmgr_dev_remove
         devmgr_dev_delete(dev);
     }
 
-    spinlock_write_unlock_int(&dev_list_lock, int_flag);
+    brlock_write_unlock_int(&dev_list_lock, int_flag);
 
     return(0);
 }
@@ -299,8 +307,6 @@ int devmgr_drv_add
 )
 {
     int status = 0;
-    
-    uint8_t int_flag = 0;
 
     if(drv == NULL)
         return(-1);
@@ -313,11 +319,11 @@ int devmgr_drv_add
     }
     else
     {
-        spinlock_write_lock_int(&drv_list_lock, &int_flag);
+        rwsem_write_lock(&drv_list_lock);
 
         linked_list_add_tail(&drv_list, &drv->drv_node);
 
-        spinlock_write_unlock_int(&drv_list_lock, int_flag);
+        rwsem_write_unlock(&drv_list_lock);
     }
 
     return(status);
@@ -333,14 +339,13 @@ int devmgr_drv_remove
 )
 {
     int status = 0;
-    uint8_t int_flag = 0;
 
     if(drv == NULL)
     {
         return(-1);
     }
 
-    spinlock_write_lock_int(&drv_list_lock, &int_flag);
+    rwsem_write_lock(&drv_list_lock);
 
     /* If the driver is not in the list, then bail out */
     if(linked_list_find_node(&drv_list, &drv->drv_node))
@@ -352,7 +357,7 @@ int devmgr_drv_remove
         linked_list_remove(&drv_list, &drv->drv_node);
     }
     
-    spinlock_write_unlock_int(&drv_list_lock, int_flag);
+    rwsem_write_unlock(&drv_list_lock);
 
     return(status);
 }
@@ -424,11 +429,11 @@ static int devmgr_dev_add_to_parent
     if(dev->parent != NULL)
         return(-1);
    
-    spinlock_write_lock_int(&dev_list_lock, &int_flag);
+    brlock_write_lock_int(&dev_list_lock, &int_flag);
    
     if(!linked_list_find_node(&parent->children, &dev->dev_node))
     {
-        spinlock_write_unlock_int(&dev_list_lock, int_flag);
+        brlock_write_unlock_int(&dev_list_lock, int_flag);
         return(-1);
     }
 
@@ -436,7 +441,7 @@ static int devmgr_dev_add_to_parent
     
     dev->parent = parent;
 
-    spinlock_write_unlock_int(&dev_list_lock, int_flag);
+    brlock_write_unlock_int(&dev_list_lock, int_flag);
     
     return(0);
 }
@@ -450,9 +455,8 @@ struct driver_node *devmgr_drv_find
 {
     struct driver_node    *drv  = NULL;
     struct list_node *node = NULL;
-    uint8_t     int_flag = 0;
 
-    spinlock_read_lock_int(&drv_list_lock, &int_flag);
+    rwsem_read_lock(&drv_list_lock);
     
     node = linked_list_first(&drv_list);
     
@@ -470,7 +474,7 @@ struct driver_node *devmgr_drv_find
         node = linked_list_next(node);
     }
 
-    spinlock_read_unlock_int(&drv_list_lock, int_flag);
+    rwsem_read_unlock(&drv_list_lock);
 
     return(drv);
 }
@@ -507,9 +511,8 @@ int devmgr_dev_probe
     int status        = -1;
     struct list_node *node = NULL;
     struct driver_node       *drv  = NULL;
-    uint8_t int_flag = 0;
 
-    spinlock_read_lock_int(&drv_list_lock, &int_flag);
+    rwsem_read_lock(&drv_list_lock);
 
     node = linked_list_first(&drv_list);
 
@@ -551,7 +554,7 @@ int devmgr_dev_probe
         node = linked_list_next(node);
     }
 
-    spinlock_read_unlock_int(&drv_list_lock, int_flag);
+    rwsem_read_unlock(&drv_list_lock);
 
     return(status);
 }
@@ -767,7 +770,7 @@ struct device_node *devmgr_dev_get_by_name
 
     memset(dev_stack, 0, sizeof(dev_stack));
     
-    spinlock_read_lock_int(&dev_list_lock, &int_status);
+    brlock_read_lock_int(&dev_list_lock, &int_status);
 
     node = linked_list_first(&root_bus.children);
 
@@ -781,7 +784,7 @@ struct device_node *devmgr_dev_get_by_name
             if(dev->index == index && 
                !strcmp(dev->dev_name, name))
             {
-                spinlock_read_unlock_int(&dev_list_lock, int_status);
+                brlock_read_unlock_int(&dev_list_lock, int_status);
                 return(dev);
             }
 
@@ -810,7 +813,7 @@ struct device_node *devmgr_dev_get_by_name
             break;
     }
 
-    spinlock_read_unlock_int(&dev_list_lock, int_status);
+    brlock_read_unlock_int(&dev_list_lock, int_status);
 
     return(NULL);
 }
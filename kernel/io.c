@@ -3,13 +3,14 @@
 #include <stddef.h>
 #include <linked_list.h>
 #include <spinlock.h>
+#include <brlock.h>
 #include <utils.h>
 #include <io.h>
 
 #define MAX_FD_COUNT 128
 
 static struct list_head    io_entries;
-static struct spinlock_rw  io_entry_lock;
+static struct brlock      io_entry_lock;
 static struct io_file_descriptor  fd_array[MAX_FD_COUNT];
 static struct spinlock  opened_fd_lock;
 static struct spinlock  avail_fd_lock;
@@ -33,7 +34,7 @@ int io_entry_register
            (entry->ioctl_func != NULL)  && 
            (entry->close_func != NULL))
         {
-            spinlock_write_lock_int(&io_entry_lock, &int_status);
+            brlock_write_lock_int(&io_entry_lock, &int_status);
 
             if(linked_list_find_node(&io_entries, &entry->node) == -1)
             {
@@ -41,7 +42,7 @@ int io_entry_register
                 status = 0;
             }
 
-            spinlock_write_unlock_int(&io_entry_lock, int_status);
+            brlock_write_unlock_int(&io_entry_lock, int_status);
         }
     }
 
@@ -59,7 +60,7 @@ static struct io_device_node *io_find_entry
 
     if(entry_name != NULL)
     {
-        spinlock_read_lock_int(&io_entry_lock, &int_status);
+        brlock_read_lock_int(&io_entry_lock, &int_status);
 
         node = linked_list_first(&io_entries);
 
@@ -79,7 +80,7 @@ static struct io_device_node *io_find_entry
             ent = NULL;
         }
 
-        spinlock_read_unlock_int(&io_entry_lock, int_status);
+        brlock_read_unlock_int(&io_entry_lock, int_status);
     }
 
     return(ent); 
@@ -343,7 +344,7 @@ int io_init
     linked_list_init(&io_entries);
     linked_list_init(&avail_fd);
     linked_list_init(&opened_fd);
-    spinlock_rw_init(&io_entry_lock);
+    brlock_init(&io_entry_lock);
     spinlock_init(&opened_fd_lock);
     spinlock_init(&avail_fd_lock);
     memset(fd_array, 0, sizeof(fd_array));
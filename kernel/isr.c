@@ -10,31 +10,30 @@
 #include <liballoc.h>
 #include <platform.h>
 #include <sched.h>
+#include <brlock.h>
+#include <rcu.h>
+#include <lockstat.h>
 
 struct isr_list
 {
     struct list_head head;
-    struct spinlock_rw  lock;
-
 };
 
 
 
 static struct isr_list handlers[MAX_ISR_HANDLERS];
 static struct isr_list eoi;
+static struct brlock   isr_lock; /* all the handler lists are read on every interrupt */
 static struct spinlock serial_lock;
 
 int isr_init(void)
 {
     memset(&handlers, 0, sizeof(handlers));
     linked_list_init(&eoi.head);
-    spinlock_rw_init(&eoi.lock);
+    brlock_init(&isr_lock);
     spinlock_init(&serial_lock);
 
-    for(int i = 0; i < MAX_ISR_HANDLERS; i++)
-    {
-        spinlock_rw_init(&handlers[i].lock);
-    }
+    lockstat_name(&isr_lock.lock, "isr_lock");
 
     return(0);
 }
@@ -88,11 +87,11 @@ struct isr *isr_install
         isr_list = &handlers[index];
     }
 
-    spinlock_write_lock_int(&isr_list->lock, &int_status);
+    brlock_write_lock_int(&isr_lock, &int_status);
 
     linked_list_add_head(&isr_list->head, &intr->node);
 
-    spinlock_write_unlock_int(&isr_list->lock, int_status);
+    brlock_write_unlock_int(&isr_lock, int_status);
 
     return(intr);
 }
@@ -128,7 +127,7 @@ int isr_uninstall
 
     for(uint16_t i = 0; i <  max_index; i++)
     {        
-        spinlock_write_lock_int(&isr_lst->lock, &int_status);
+        brlock_write_lock_int(&isr_lock, &int_status);
         
         node = linked_list_first(&isr_lst->head);
 
@@ -150,7 +149,7 @@ int isr_uninstall
 
             node = next_node;
         }
-        spinlock_write_unlock_int(&isr_lst->lock, int_status);
+        brlock_write_unlock_int(&isr_lock, int_status);
 
         isr_lst++;
     }
@@ -179,8 +178,8 @@ void isr_dispatcher
         inf.cpu_id = cpu_id_get();
         inf.cpu    = cpu_current_get();
 
-        /* gain exclusive access to the list */
-        spinlock_read_lock(&int_lst->lock);
+        /* keep the lists from changing under us */
+        brlock_read_lock(&isr_lock);
 
         node = linked_list_first(&int_lst->head);
 
@@ -201,10 +200,6 @@ void isr_dispatcher
             node = linked_list_next(node);
         }
 
-        spinlock_read_unlock(&int_lst->lock);
-
-        spinlock_read_lock(&eoi.lock);
-
         /* Send EOIs */
         node = linked_list_first(&eoi.head);
 
@@ -224,7 +219,13 @@ void isr_dispatcher
             node = linked_list_next(node);
         }
 
-        spinlock_read_unlock(&eoi.lock);
+        brlock_read_unlock(&isr_lock);
+
+        /* report a quiescent state unless we interrupted a reader -
+         * this is how a CPU that does not switch or idles with the
+         * tick stopped lets a grace period end
+         */
+        rcu_quiescent();
 
         /* check if we need to reschedule */
         if(inf.cpu && inf.cpu->sched)
@@ -24,6 +24,7 @@
 #include <owner.h>
 #include <i8254.h>
 #include <io.h>
+#include <rcu.h>
 
 struct sem *kb_sem = NULL;
 struct mutex mtx;
@@ -80,6 +81,9 @@ void *kmain_sys_init
     void *arg
 )
 {
+    /* deferred RCU callbacks run in their own thread */
+    rcu_init();
+
     kprintf("Performing platform initialization...\n");
     platform_init();    
     
@@ -0,0 +1,329 @@
+/*
+ * Lock statistics
+ *
+ * The entry of a lock is claimed the first time the lock is taken and
+ * it is never given back, so a lock that is freed and whose memory is
+ * reused for another lock keeps adding to the same entry. Everything is
+ * updated with atomics - the statistics code cannot take locks itself.
+ */
+
+#include <lockstat.h>
+#include <percpu.h>
+#include <platform.h>
+#include <utils.h>
+
+#ifdef LOCKSTAT
+
+#define LOCKSTAT_MAX    (1024) /* locks tracked - must be a power of 2 */
+#define LOCKSTAT_SITES  (8)    /* call sites tracked for each lock     */
+
+struct lockstat_site
+{
+    volatile uintptr_t caller;
+    volatile uint64_t  count;
+    volatile uint64_t  wait_total;
+};
+
+struct lockstat
+{
+    volatile uintptr_t   lock;
+    const char          *name;
+    uint32_t             type;
+    volatile uint64_t    acquired;
+    volatile uint64_t    contended;
+    volatile uint64_t    wait_total;
+    volatile uint64_t    wait_max;
+    volatile uint64_t    hold_total;
+    volatile uint64_t    hold_max;
+    volatile uint64_t    hold_start;
+    struct lockstat_site sites[LOCKSTAT_SITES];
+};
+
+static struct lockstat   lockstat_table[LOCKSTAT_MAX];
+static volatile uint64_t lockstat_dropped = 0;
+
+static const char *lockstat_types[] =
+{
+    "spinlock",
+    "mutex",
+    "sem"
+};
+
+uint64_t lockstat_timestamp
+(
+    void
+)
+{
+    return(cpu_timestamp());
+}
+
+/* lockstat_get - find or claim the entry of the lock */
+
+static struct lockstat *lockstat_get
+(
+    const void *lock
+)
+{
+    struct lockstat *ls       = NULL;
+    uintptr_t        key      = 0;
+    uintptr_t        expected = 0;
+    uint32_t         ix       = 0;
+    uint32_t         i        = 0;
+
+    key = (uintptr_t)lock;
+    ix  = (uint32_t)((key >> 3) * 2654435761u);
+
+    for(i = 0; i < LOCKSTAT_MAX; i++)
+    {
+        ls = &lockstat_table[(ix + i) & (LOCKSTAT_MAX - 1)];
+
+        expected = __atomic_load_n(&ls->lock, __ATOMIC_ACQUIRE);
+
+        if(expected == 0)
+        {
+            if(__atomic_compare_exchange_n(&ls->lock,
+                                           &expected,
+                                           key,
+                                           0,
+                                           __ATOMIC_ACQ_REL,
+                                           __ATOMIC_ACQUIRE))
+            {
+                return(ls);
+            }
+        }
+
+        if(expected == key)
+        {
+            return(ls);
+        }
+    }
+
+    __atomic_add_fetch(&lockstat_dropped, 1, __ATOMIC_RELAXED);
+
+    return(NULL);
+}
+
+static void lockstat_max
+(
+    volatile uint64_t *max,
+    uint64_t           val
+)
+{
+    uint64_t cur = 0;
+
+    cur = __atomic_load_n(max, __ATOMIC_RELAXED);
+
+    while((val > cur) &&
+          !__atomic_compare_exchange_n(max,
+                                       &cur,
+                                       val,
+                                       0,
+                                       __ATOMIC_RELAXED,
+                                       __ATOMIC_RELAXED));
+}
+
+/*
+ * lockstat_site_record - account the acquisition to its call site
+ * When all the slots are taken, the site that waited the least makes
+ * room for one that waited longer, so the slots end up holding the
+ * sites that waited the most.
+ */
+
+static void lockstat_site_record
+(
+    struct lockstat *ls,
+    uintptr_t        caller,
+    uint64_t         wait
+)
+{
+    struct lockstat_site *site     = NULL;
+    struct lockstat_site *min      = NULL;
+    uintptr_t             expected = 0;
+    uint32_t              i        = 0;
+
+    for(i = 0; i < LOCKSTAT_SITES; i++)
+    {
+        site = &ls->sites[i];
+
+        expected = __atomic_load_n(&site->caller, __ATOMIC_RELAXED);
+
+        if(expected == 0)
+        {
+            __atomic_compare_exchange_n(&site->caller,
+                                        &expected,
+                                        caller,
+                                        0,
+                                        __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED);
+
+            expected = __atomic_load_n(&site->caller, __ATOMIC_RELAXED);
+        }
+
+        if(expected == caller)
+        {
+            __atomic_add_fetch(&site->count, 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&site->wait_total, wait, __ATOMIC_RELAXED);
+            return;
+        }
+
+        if((min == NULL) || (site->wait_total < min->wait_total))
+        {
+            min = site;
+        }
+    }
+
+    if(min->wait_total < wait)
+    {
+        __atomic_store_n(&min->caller, caller, __ATOMIC_RELAXED);
+        __atomic_store_n(&min->count, 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&min->wait_total, wait, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * lockstat_record_acquire - the lock was taken
+ * wait_start is the timestamp at which the caller started to wait or
+ * 0 if the lock was free.
+ */
+
+void lockstat_record_acquire
+(
+    const void *lock,
+    uint32_t    type,
+    uint64_t    wait_start,
+    uintptr_t   caller
+)
+{
+    struct lockstat *ls   = NULL;
+    uint64_t         now  = 0;
+    uint64_t         wait = 0;
+
+    now = cpu_timestamp();
+    ls  = lockstat_get(lock);
+
+    if(ls == NULL)
+    {
+        return;
+    }
+
+    ls->type = type;
+
+    __atomic_add_fetch(&ls->acquired, 1, __ATOMIC_RELAXED);
+
+    if(wait_start != 0)
+    {
+        wait = now - wait_start;
+
+        __atomic_add_fetch(&ls->contended, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&ls->wait_total, wait, __ATOMIC_RELAXED);
+        lockstat_max(&ls->wait_max, wait);
+    }
+
+    lockstat_site_record(ls, caller, wait);
+
+    /* a semaphore has more than one holder */
+    if(type != LOCKSTAT_SEM)
+    {
+        __atomic_store_n(&ls->hold_start, now, __ATOMIC_RELAXED);
+    }
+}
+
+/* lockstat_record_release - must be called before the lock is released */
+
+void lockstat_record_release
+(
+    const void *lock
+)
+{
+    struct lockstat *ls    = NULL;
+    uint64_t         start = 0;
+    uint64_t         hold  = 0;
+
+    ls = lockstat_get(lock);
+
+    if(ls == NULL)
+    {
+        return;
+    }
+
+    start = __atomic_exchange_n(&ls->hold_start, 0, __ATOMIC_RELAXED);
+
+    if(start != 0)
+    {
+        hold = cpu_timestamp() - start;
+
+        __atomic_add_fetch(&ls->hold_total, hold, __ATOMIC_RELAXED);
+        lockstat_max(&ls->hold_max, hold);
+    }
+}
+
+void lockstat_set_name
+(
+    const void *lock,
+    const char *name
+)
+{
+    struct lockstat *ls = NULL;
+
+    ls = lockstat_get(lock);
+
+    if(ls != NULL)
+    {
+        ls->name = name;
+    }
+}
+
+void lockstat_show
+(
+    void
+)
+{
+    struct lockstat      *ls   = NULL;
+    struct lockstat_site *site = NULL;
+    uint32_t              i    = 0;
+    uint32_t              j    = 0;
+
+    for(i = 0; i < LOCKSTAT_MAX; i++)
+    {
+        ls = &lockstat_table[i];
+
+        if(__atomic_load_n(&ls->acquired, __ATOMIC_RELAXED) == 0)
+        {
+            continue;
+        }
+
+        kprintf("LOCK %x %s %s ACQ %d CONTENDED %d\n",
+                ls->lock,
+                lockstat_types[ls->type],
+                ls->name != NULL ? ls->name : "-",
+                ls->acquired,
+                ls->contended);
+
+        kprintf("    WAIT TOTAL %d MAX %d HOLD TOTAL %d MAX %d\n",
+                ls->wait_total,
+                ls->wait_max,
+                ls->hold_total,
+                ls->hold_max);
+
+        for(j = 0; j < LOCKSTAT_SITES; j++)
+        {
+            site = &ls->sites[j];
+
+            if(site->caller != 0)
+            {
+                kprintf("    SITE %x COUNT %d WAIT %d\n",
+                        site->caller,
+                        site->count,
+                        site->wait_total);
+            }
+        }
+    }
+
+    if(lockstat_dropped != 0)
+    {
+        kprintf("LOCKSTAT TABLE FULL - %d ACQUISITIONS NOT RECORDED\n",
+                lockstat_dropped);
+    }
+}
+
+#endif
@@ -4,7 +4,22 @@
 #include <sched.h>
 #include <mutex.h>
 #include <utils.h>
+#include <clock.h>
+#include <platform.h>
+#include <lockstat.h>
 
+#define PI_NODE_TO_MUTEX(x) ((struct mutex*) ((uint8_t*)(x) -  \
+                             offsetof(struct mutex, pi_node)))
+
+/* serializes the priority inheritance chains and the wait queues */
+static struct spinlock mtx_pi_lock = SPINLOCK_INIT
+
+static int mtx_acquire_caller
+(
+    struct mutex *mtx,
+    uint64_t timeout_ns,
+    uintptr_t caller
+);
 
 struct mutex *mtx_init
 (
@@ -21,10 +36,10 @@ struct mutex *mtx_init
     mtx->opts = options;
     mtx->rlevel = 0;
     mtx->owner = 0;
-    mtx->owner_prio = 0;
+    mtx->owner_prio = SCHED_PRIO_NONE;
+    mtx->pi_linked = 0;
     
-    linked_list_init(&mtx->pendq);
-    spinlock_init(&mtx->lock);
+    wait_queue_init(&mtx->wq);
 
     return(mtx);
 }
@@ -60,138 +75,405 @@ int mtx_acquire
     uint32_t wait_ms
 )
 {
-    uint8_t         int_state    = 0;
-    void           *expected     = NULL;
-    struct sched_thread *thread       = NULL;
-    uint8_t         looped       = 0;
-    struct list_node     *iter_node   = NULL;
-    struct sched_thread  *iter_thread = NULL;
-
-    if(mtx == NULL)
+    if(wait_ms == WAIT_FOREVER)
     {
-        return(-1);
+        return(mtx_acquire_caller(mtx, WAIT_FOREVER_NS, LOCKSTAT_CALLER));
     }
 
-    spinlock_lock_int(&mtx->lock, &int_state);
-
-    thread = sched_thread_self();
+    return(mtx_acquire_caller(mtx, 
+                              (uint64_t)wait_ms * 1000000ull, 
+                              LOCKSTAT_CALLER));
+}
 
+static inline struct sched_thread *mtx_owner_thread
+(
+    uintptr_t owner
+)
+{
+    return((struct sched_thread*)(owner & ~MUTEX_OWNER_FLAGS));
+}
 
-    while(1)
-    {
-        expected = NULL;
+/* mtx_try_fast - take a free mutex that nobody waits for */
+static inline int mtx_try_fast
+(
+    struct mutex *mtx,
+    struct sched_thread *self
+)
+{
+    uintptr_t expected = 0;
 
-        /* Try to become the owner of the mutex*/
-        if(__atomic_compare_exchange_n(&mtx->owner,
+    return(__atomic_compare_exchange_n(&mtx->owner,
                                        &expected,
-                                       thread,
+                                       (uintptr_t)self,
                                        0,
-                                       __ATOMIC_SEQ_CST,
-                                       __ATOMIC_SEQ_CST
-                                       ))
+                                       __ATOMIC_ACQUIRE,
+                                       __ATOMIC_RELAXED));
+}
+
+/* highest priority of the threads waiting for the mutex */
+static uint16_t mtx_waiters_prio
+(
+    struct mutex *mtx
+)
+{
+    struct list_node    *node = NULL;
+    struct sched_thread *th   = NULL;
+    uint16_t prio = SCHED_PRIO_NONE;
+
+    node = linked_list_first(&mtx->wq.head);
+
+    while(node)
+    {
+        th = WAIT_ENTRY_TO_THREAD(node);
+
+        if(th->prio < prio)
         {
-            
-            /* set recursion level to 1 */
-            __atomic_store_n(&mtx->rlevel, 1, __ATOMIC_RELEASE);
+            prio = th->prio;
+        }
 
-            spinlock_unlock_int(&mtx->lock, int_state);
+        node = linked_list_next(node);
+    }
 
-            return(0);
+    return(prio);
+}
+
+/* priority a thread inherits from the mutexes it holds */
+static uint16_t mtx_held_prio
+(
+    struct sched_thread *th
+)
+{
+    struct list_node *node = NULL;
+    struct mutex     *mtx  = NULL;
+    uint16_t prio = SCHED_PRIO_NONE;
+
+    node = linked_list_first(&th->pi_held);
+
+    while(node)
+    {
+        mtx = PI_NODE_TO_MUTEX(node);
+
+        if(mtx->owner_prio < prio)
+        {
+            prio = mtx->owner_prio;
         }
 
-        expected = thread;
+        node = linked_list_next(node);
+    }
 
-        /* Check if we already own the mutex */
-        if(__atomic_compare_exchange_n(&mtx->owner,
-                                       &expected,
-                                       thread,
-                                       0,
-                                       __ATOMIC_SEQ_CST,
-                                       __ATOMIC_SEQ_CST
-                                       ))
+    return(prio);
+}
+
+/*
+ * mtx_pi_propagate - pass the priority of the waiters to the owner
+ * If the owner is itself blocked on a mutex, the owner of that one is
+ * updated too and so on. A mutex with waiters stays in the pi_held
+ * list of its owner so the priority can be restored on release.
+ * Must be called with mtx_pi_lock held.
+ */
+
+static void mtx_pi_propagate
+(
+    struct mutex *mtx
+)
+{
+    struct sched_thread *owner = NULL;
+    uint16_t prio = 0;
+    uint32_t depth = 0;
+
+    while((mtx != NULL) && (depth < MUTEX_PI_MAX_DEPTH))
+    {
+        mtx->owner_prio = mtx_waiters_prio(mtx);
+        owner = mtx_owner_thread(__atomic_load_n(&mtx->owner, 
+                                                 __ATOMIC_RELAXED));
+
+        if(owner == NULL)
         {
-            /* if we are already the owner, increase the recursion level */
-            
-            if(mtx->opts & MUTEX_RECUSRIVE)
-            {
-                __atomic_add_fetch(&mtx->rlevel, 1, __ATOMIC_SEQ_CST);
-            }
-            spinlock_unlock_int(&mtx->lock, int_state);
-            return(0);
+            break;
         }
 
-        /* if we looped already, then we timed out in case we had a timer
-         * therefore, just exit
-         */
-        if(looped > 0)
+        if((mtx->owner_prio != SCHED_PRIO_NONE) && (mtx->pi_linked == 0))
         {
-            spinlock_unlock_int(&mtx->lock, int_state);
-            return(-1);
+            linked_list_add_tail(&owner->pi_held, &mtx->pi_node);
+            mtx->pi_linked = 1;
         }
+        else if((mtx->owner_prio == SCHED_PRIO_NONE) && mtx->pi_linked)
+        {
+            linked_list_remove(&owner->pi_held, &mtx->pi_node);
+            mtx->pi_linked = 0;
+        }
+
+        prio = mtx_held_prio(owner);
 
-        /* if we are not waiting forever, set the looped flag so
-         * we are  exiting on the next iteration
-         */
-        if(wait_ms != WAIT_FOREVER)
+        /* nothing changes further down the chain */
+        if(prio == owner->pi_prio)
         {
-            looped = 1;
+            break;
         }
 
-        if(wait_ms == NO_WAIT)
+        sched_thread_inherit_priority(owner, prio);
+
+        mtx = owner->pi_blocked_on;
+        depth++;
+    }
+}
+
+/*
+ * mtx_spin - spin as long as the owner is running on another unit
+ * An owner that is on the CPU is likely to release the mutex soon so
+ * this is cheaper than a context switch. Gives up after MUTEX_SPIN_NS,
+ * at the deadline or as soon as the owner is switched out.
+ * Returns 1 if the mutex was taken.
+ */
+
+static int mtx_spin
+(
+    struct mutex *mtx,
+    struct sched_thread *self,
+    uint64_t deadline
+)
+{
+    struct sched_thread    *owner = NULL;
+    struct sched_exec_unit *unit  = NULL;
+    uintptr_t val = 0;
+    uint64_t  end = 0;
+
+    end = clock_monotonic_ns() + MUTEX_SPIN_NS;
+
+    if((deadline != 0) && (deadline < end))
+    {
+        end = deadline;
+    }
+
+    while(1)
+    {
+        val   = __atomic_load_n(&mtx->owner, __ATOMIC_RELAXED);
+        owner = mtx_owner_thread(val);
+
+        if(owner == NULL)
         {
-            spinlock_unlock_int(&mtx->lock, int_state);
-            return(-1);
+            /* a free mutex with waiters is given out by the slow path */
+            if(val != 0)
+            {
+                return(0);
+            }
+
+            if(mtx_try_fast(mtx, self))
+            {
+                return(1);
+            }
+
+            continue;
         }
 
-        /* Add it to the mutex pend queue */
-#ifdef MTX_DEBUG
-        kprintf("BLOCKING %x\n",thread);
-#endif
+        unit = __atomic_load_n(&owner->unit, __ATOMIC_RELAXED);
 
-        /* insert the mutex in the queue based on either
-         * FIFO or Priority
-         */
-        if(mtx->opts & MUTEX_FIFO)
+        if((unit == NULL) || (unit == self->unit) ||
+           (__atomic_load_n(&unit->current, __ATOMIC_RELAXED) != owner))
         {
-            linked_list_add_tail(&mtx->pendq, &thread->pend_node);
+            return(0);
         }
-        else
+
+        if(clock_monotonic_ns() >= end)
         {
-            iter_node = linked_list_first(&mtx->pendq);
-            
-            while(iter_node)
-            {
-                iter_thread = PEND_NODE_TO_THREAD(iter_node);
+            return(0);
+        }
+
+        cpu_pause();
+    }
+}
+
+/*
+ * mtx_acquire_timeout - wait at most timeout_ns for the mutex
+ * NO_WAIT only tries to take it and WAIT_FOREVER_NS never times out.
+ * A free mutex is taken with a single CAS on the owner word. A thread
+ * that has to sleep is handed the mutex by mtx_release so it owns it
+ * as soon as it is woken up.
+ */
+
+int mtx_acquire_timeout
+(
+    struct mutex *mtx, 
+    uint64_t timeout_ns
+)
+{
+    return(mtx_acquire_caller(mtx, timeout_ns, LOCKSTAT_CALLER));
+}
+
+/* mtx_acquire_caller - caller is the call site for the lock statistics */
+
+static int mtx_acquire_caller
+(
+    struct mutex *mtx,
+    uint64_t timeout_ns,
+    uintptr_t caller
+)
+{
+    uint8_t         int_state    = 0;
+    struct sched_thread *self    = NULL;
+    struct wait_queue_entry we;
+    uintptr_t       val          = 0;
+    uintptr_t       new_val      = 0;
+    uint64_t        deadline     = 0;
+    uint32_t        wq_flags     = WAIT_QUEUE_EXCLUSIVE;
+    uint64_t        wait_start   = 0;
+    int             ret          = 0;
+
+    if(mtx == NULL)
+    {
+        return(-1);
+    }
+
+    self = sched_thread_self();
+
+    if(mtx_try_fast(mtx, self))
+    {
+        mtx->rlevel = 1;
+        lockstat_acquired(mtx, LOCKSTAT_MUTEX, 0, caller);
+        return(0);
+    }
 
-                if(iter_thread->prio > thread->prio)
-                {
-                    linked_list_add_before(&mtx->pendq, 
-                                           iter_node, 
-                                           &thread->pend_node);
-                    break;
-                }
+    val = __atomic_load_n(&mtx->owner, __ATOMIC_RELAXED);
 
-                iter_node = linked_list_next(iter_node);
+    /* Check if we already own the mutex */
+    if(mtx_owner_thread(val) == self)
+    {
+        if(mtx->opts & MUTEX_RECUSRIVE)
+        {
+            mtx->rlevel++;
+        }
+
+        return(0);
+    }
+
+    if(timeout_ns == NO_WAIT)
+    {
+        return(-1);
+    }
+
+    if(timeout_ns != WAIT_FOREVER_NS)
+    {
+        deadline = clock_monotonic_ns() + timeout_ns;
+    }
+
+    wait_start = lockstat_now();
+
+    if(mtx_spin(mtx, self, deadline))
+    {
+        mtx->rlevel = 1;
+        lockstat_acquired(mtx, LOCKSTAT_MUTEX, wait_start, caller);
+        return(0);
+    }
+
+    spinlock_lock_int(&mtx->wq.lock, &int_state);
+
+    while(1)
+    {
+        val = __atomic_load_n(&mtx->owner, __ATOMIC_RELAXED);
+
+        /* Try to become the owner of the mutex */
+        if(mtx_owner_thread(val) == NULL)
+        {
+            new_val = (uintptr_t)self;
+
+            if(linked_list_count(&mtx->wq.head) > 0)
+            {
+                new_val |= MUTEX_WAITERS;
             }
 
-            if(iter_node == NULL)
+            if(__atomic_compare_exchange_n(&mtx->owner,
+                                           &val,
+                                           new_val,
+                                           0,
+                                           __ATOMIC_ACQUIRE,
+                                           __ATOMIC_RELAXED))
             {
-                linked_list_add_tail(&mtx->pendq, &thread->pend_node);
+                spinlock_lock(&mtx_pi_lock);
+
+                mtx->rlevel = 1;
+                mtx_pi_propagate(mtx);
+
+                spinlock_unlock(&mtx_pi_lock);
+                spinlock_unlock_int(&mtx->wq.lock, int_state);
+
+                lockstat_acquired(mtx, LOCKSTAT_MUTEX, wait_start, caller);
+
+                return(0);
             }
+
+            continue;
+        }
+
+        /* make the owner go through the slow release path */
+        if((val & MUTEX_WAITERS) ||
+           __atomic_compare_exchange_n(&mtx->owner,
+                                       &val,
+                                       val | MUTEX_WAITERS,
+                                       0,
+                                       __ATOMIC_RELAXED,
+                                       __ATOMIC_RELAXED))
+        {
+            break;
+        }
+    }
+
+#ifdef MTX_DEBUG
+    kprintf("BLOCKING %x\n",self);
+#endif
+
+    if(mtx->opts & MUTEX_PRIO)
+    {
+        wq_flags |= WAIT_QUEUE_PRIO;
+    }
+
+    spinlock_lock(&mtx_pi_lock);
+
+    wait_queue_add(&mtx->wq, &we, wq_flags);
+
+    /* lend our priority to the owner while we wait */
+    self->pi_blocked_on = mtx;
+    mtx_pi_propagate(mtx);
+
+    spinlock_unlock(&mtx_pi_lock);
+
+    ret = wait_queue_sleep(&mtx->wq, &we, timeout_ns, &int_state);
+
+    spinlock_lock(&mtx_pi_lock);
+
+    self->pi_blocked_on = NULL;
+
+    /* on success mtx_release made us the owner */
+    if(ret != 0)
+    {
+        wait_queue_remove(&mtx->wq, &we);
+
+        /* give back what we lent to the owner */
+        mtx_pi_propagate(mtx);
+
+        if(linked_list_count(&mtx->wq.head) == 0)
+        {
+            /* we were the last one waiting */
+            __atomic_fetch_and(&mtx->owner, ~MUTEX_WAITERS, __ATOMIC_RELAXED);
         }
+    }
 
-        spinlock_unlock_int(&mtx->lock, int_state);
-        
-        /* sleep */
-        sched_sleep(wait_ms);
+    spinlock_unlock(&mtx_pi_lock);
+    spinlock_unlock_int(&mtx->wq.lock, int_state);
 
-        spinlock_lock_int(&mtx->lock, &int_state);
-        linked_list_remove(&mtx->pendq, &thread->pend_node);
+    if(ret == 0)
+    {
+        lockstat_acquired(mtx, LOCKSTAT_MUTEX, wait_start, caller);
     }
 
-    return(0);
+    return(ret);
 }
 
+/*
+ * mtx_release - release the mutex
+ * Without waiters this is a single CAS. Otherwise the ownership is
+ * passed to the first waiter before it is woken up.
+ */
+
 int mtx_release
 (
     struct mutex *mtx
@@ -199,63 +481,92 @@ int mtx_release
 {
     uint8_t           int_state  = 0;
     struct sched_thread    *self      = NULL;
-    struct sched_thread    *thread    = NULL;
-    struct list_node       *pend_node = NULL;
-    void              *expected  = NULL;
+    struct sched_thread    *next      = NULL;
+    uintptr_t          expected  = 0;
+    uintptr_t          new_val   = 0;
+    uint16_t           prio      = 0;
 
     if(mtx == NULL)
     {
         return(-1);
     }
 
-    spinlock_lock_int(&mtx->lock, &int_state);
-
     self = sched_thread_self();
 
-    expected = self;
-
     /* If we are not the owner, then get out */
-    if(!__atomic_compare_exchange_n(&mtx->owner,
-                                       &expected,
-                                       0,
-                                       0,
-                                       __ATOMIC_SEQ_CST,
-                                       __ATOMIC_SEQ_CST
-                                       ))
+    if(mtx_owner_thread(__atomic_load_n(&mtx->owner, __ATOMIC_RELAXED)) != self)
     {
-        spinlock_unlock_int(&mtx->lock, int_state);
         return(-1);
     }
 
-    if(mtx->opts & MUTEX_RECUSRIVE)
+    /* reduce the recursion level */
+    if(mtx->rlevel > 1)
     {
-        /* reduce the recursion level */
-        if(__atomic_sub_fetch(&mtx->rlevel, 1, __ATOMIC_SEQ_CST) > 0)
-        {
-            spinlock_unlock_int(&mtx->lock, int_state);
-            return(0);
-        }
+        mtx->rlevel--;
+        return(0);
     }
 
-    /* Get the first pending task */
-    pend_node = linked_list_first(&mtx->pendq);
+    lockstat_released(mtx);
 
-    if(pend_node == NULL)
+    mtx->rlevel = 0;
+    expected = (uintptr_t)self;
+
+    if(__atomic_compare_exchange_n(&mtx->owner,
+                                   &expected,
+                                   0,
+                                   0,
+                                   __ATOMIC_RELEASE,
+                                   __ATOMIC_RELAXED))
     {
-        /* if we don't have a new owner, clear oursevles */
-        __atomic_clear(&mtx->owner, __ATOMIC_SEQ_CST);
-        spinlock_unlock_int(&mtx->lock, int_state);
         return(0);
     }
 
-    thread = PEND_NODE_TO_THREAD(pend_node);
+    spinlock_lock_int(&mtx->wq.lock, &int_state);
+    spinlock_lock(&mtx_pi_lock);
 
-    /* Set the new owner */
-    __atomic_store_n(&mtx->owner, thread, __ATOMIC_SEQ_CST);
+    /* drop the priority we inherited through this mutex */
+    if(mtx->pi_linked)
+    {
+        linked_list_remove(&self->pi_held, &mtx->pi_node);
+        mtx->pi_linked = 0;
+    }
+
+    prio = mtx_held_prio(self);
+
+    if(self->pi_prio != prio)
+    {
+        sched_thread_inherit_priority(self, prio);
+    }
 
-    sched_wake_thread(thread);
+    next = wait_queue_first(&mtx->wq);
+
+    if(next == NULL)
+    {
+        /* if we don't have a new owner, clear oursevles */
+        __atomic_store_n(&mtx->owner, 0, __ATOMIC_RELEASE);
+    }
+    else
+    {
+        /* hand the mutex over so nobody can take it before next runs */
+        new_val = (uintptr_t)next;
+
+        if(linked_list_count(&mtx->wq.head) > 1)
+        {
+            new_val |= MUTEX_WAITERS;
+        }
+
+        mtx->rlevel = 1;
+        __atomic_store_n(&mtx->owner, new_val, __ATOMIC_RELEASE);
+
+        wait_queue_wake_one(&mtx->wq);
+
+        /* the new owner inherits from the remaining waiters */
+        next->pi_blocked_on = NULL;
+        mtx_pi_propagate(mtx);
+    }
 
-    spinlock_unlock_int(&mtx->lock, int_state);
+    spinlock_unlock(&mtx_pi_lock);
+    spinlock_unlock_int(&mtx->wq.lock, int_state);
 
     return(0);
 }
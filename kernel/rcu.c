@@ -0,0 +1,266 @@
+/*
+ * Read-copy-update
+ *
+ * A grace period is started by bumping rcu_gp_seq. Each CPU copies
+ * the sequence to its own rcu_qs_seq whenever it passes a quiescent
+ * state, so the grace period is over once every online CPU has a
+ * sequence at least as new as the one of the grace period. CPUs that
+ * are late - idle with the tick stopped or running a single thread -
+ * are poked with an IPI, the interrupt exit reports for them.
+ */
+
+#include <rcu.h>
+#include <percpu.h>
+#include <platform.h>
+#include <spinlock.h>
+#include <semaphore.h>
+#include <sched.h>
+#include <thread.h>
+#include <intc.h>
+#include <cpu.h>
+
+#define RCU_THREAD_STACK_SIZE (PAGE_SIZE)
+#define RCU_THREAD_PRIO       (128)
+
+static PERCPU_DEFINE(uint64_t, rcu_qs_seq)  = 0;
+static PERCPU_DEFINE(uint32_t, rcu_nesting) = 0;
+static PERCPU_DEFINE(uint8_t,  rcu_online)  = 0;
+
+static uint64_t         rcu_gp_seq = 0;
+
+/* callbacks waiting for the rcu thread */
+static struct list_head rcu_cb_list = LINKED_LIST_INIT;
+static struct spinlock  rcu_cb_lock = SPINLOCK_INIT
+static struct sem       rcu_cb_sem;
+static void            *rcu_thread  = NULL;
+
+void rcu_read_lock
+(
+    void
+)
+{
+    sched_disable_preempt();
+
+    percpu_write(rcu_nesting, percpu_read(rcu_nesting) + 1);
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+}
+
+void rcu_read_unlock
+(
+    void
+)
+{
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    percpu_write(rcu_nesting, percpu_read(rcu_nesting) - 1);
+
+    sched_enable_preempt();
+}
+
+/*
+ * rcu_quiescent - report that this CPU holds no reference to RCU data
+ * It is safe to call from any context, an interrupt that hit a reader
+ * does not report anything.
+ */
+
+void rcu_quiescent
+(
+    void
+)
+{
+    if((percpu_read(rcu_online) == 0) || (percpu_read(rcu_nesting) != 0))
+    {
+        return;
+    }
+
+    /* the accesses of the readers must be done before we report */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    percpu_write(rcu_qs_seq, __atomic_load_n(&rcu_gp_seq, __ATOMIC_ACQUIRE));
+}
+
+/* rcu_cpu_online - start taking the current CPU into account */
+
+void rcu_cpu_online
+(
+    void
+)
+{
+    percpu_write(rcu_qs_seq, __atomic_load_n(&rcu_gp_seq, __ATOMIC_ACQUIRE));
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    percpu_write(rcu_online, 1);
+}
+
+/*
+ * rcu_cpus_pending - count the CPUs that did not pass through
+ * a quiescent state since the grace period started
+ */
+
+static uint32_t rcu_cpus_pending
+(
+    uint64_t gp_seq,
+    uint8_t  kick
+)
+{
+    virt_addr_t base = 0;
+    uint32_t count = 0;
+    uint32_t pending = 0;
+    uint32_t i = 0;
+
+    count = percpu_area_count();
+
+    for(i = 0; i < count; i++)
+    {
+        base = percpu_area_get(i);
+
+        if(base == 0)
+        {
+            continue;
+        }
+
+        if(__atomic_load_n(percpu_remote_ptr(base, rcu_online), 
+                           __ATOMIC_ACQUIRE) == 0)
+        {
+            continue;
+        }
+
+        if(__atomic_load_n(percpu_remote_ptr(base, rcu_qs_seq), 
+                           __ATOMIC_ACQUIRE) >= gp_seq)
+        {
+            continue;
+        }
+
+        pending++;
+
+        if(kick)
+        {
+            cpu_issue_ipi(IPI_DEST_NO_SHORTHAND, 
+                          *percpu_remote_ptr(base, percpu_cpu_id), 
+                          IPI_SCHED);
+        }
+    }
+
+    return(pending);
+}
+
+/*
+ * synchronize_rcu - wait for the readers that are running now to finish
+ * Must not be called from a read-side critical section.
+ */
+
+void synchronize_rcu
+(
+    void
+)
+{
+    uint64_t gp_seq = 0;
+    uint8_t  kick = 0;
+
+    gp_seq = __atomic_add_fetch(&rcu_gp_seq, 1, __ATOMIC_SEQ_CST);
+
+    /* we are not a reader so this CPU is done already */
+    rcu_quiescent();
+
+    while(rcu_cpus_pending(gp_seq, kick) != 0)
+    {
+        if(sched_thread_self() != NULL)
+        {
+            sched_sleep_ns(RCU_POLL_NS);
+        }
+        else
+        {
+            cpu_pause();
+        }
+
+        kick = 1;
+    }
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+/*
+ * call_rcu - call func once the current readers are done
+ * The callbacks are invoked in batches from the rcu thread.
+ */
+
+void call_rcu
+(
+    struct rcu_head *head,
+    void (*func)(struct rcu_head *head)
+)
+{
+    uint8_t int_flag = 0;
+
+    head->func = func;
+
+    spinlock_lock_int(&rcu_cb_lock, &int_flag);
+    linked_list_add_tail(&rcu_cb_list, &head->node);
+    spinlock_unlock_int(&rcu_cb_lock, int_flag);
+
+    if(rcu_thread != NULL)
+    {
+        sem_release(&rcu_cb_sem);
+    }
+}
+
+static void *rcu_thread_main
+(
+    void *arg
+)
+{
+    struct list_head batch = LINKED_LIST_INIT;
+    struct list_node *ln = NULL;
+    struct rcu_head *head = NULL;
+    uint8_t int_flag = 0;
+
+    while(1)
+    {
+        sem_acquire(&rcu_cb_sem, WAIT_FOREVER);
+
+        spinlock_lock_int(&rcu_cb_lock, &int_flag);
+        linked_list_concat(&rcu_cb_list, &batch);
+        spinlock_unlock_int(&rcu_cb_lock, int_flag);
+
+        if(linked_list_count(&batch) == 0)
+        {
+            continue;
+        }
+
+        /* one grace period covers the whole batch */
+        synchronize_rcu();
+
+        while((ln = linked_list_get_first(&batch)) != NULL)
+        {
+            head = (struct rcu_head*)ln;
+            head->func(head);
+        }
+    }
+
+    return(NULL);
+}
+
+int rcu_init
+(
+    void
+)
+{
+    sem_init(&rcu_cb_sem, 0, 1);
+
+    rcu_thread = kthread_create("rcu", 
+                                rcu_thread_main, 
+                                NULL, 
+                                RCU_THREAD_STACK_SIZE, 
+                                RCU_THREAD_PRIO, 
+                                NULL);
+
+    if(rcu_thread == NULL)
+    {
+        return(-1);
+    }
+
+    thread_start(rcu_thread);
+
+    /* run the callbacks queued before we had a thread */
+    sem_release(&rcu_cb_sem);
+
+    return(0);
+}
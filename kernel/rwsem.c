@@ -0,0 +1,403 @@
+/*
+ * Reader-writer semaphore
+ *
+ * The fast paths only touch the count. Everything that has to do with
+ * the waiters is done with the wait queue locked: a waiter sets
+ * RWSEM_WAITERS before it queues itself, so whoever releases the lock
+ * afterwards comes here and hands it over. A writer is woken with the
+ * writer bit already set and readers are woken with their share of the
+ * count already added, so nobody can take the lock in between.
+ */
+
+#include <rwsem.h>
+#include <sched.h>
+#include <platform.h>
+
+void rwsem_init
+(
+    struct rwsem *sem
+)
+{
+    __atomic_store_n(&sem->count, 0, __ATOMIC_RELEASE);
+    wait_queue_init(&sem->wq);
+}
+
+/*
+ * rwsem_wake_locked - hand the lock to the waiters at the head of the queue
+ * This is done only if nobody holds it. A writer at the head is woken
+ * alone, otherwise all the readers up to the first writer are woken.
+ * Must be called with the wait queue locked.
+ */
+
+static void rwsem_wake_locked
+(
+    struct rwsem *sem
+)
+{
+    struct list_node        *node      = NULL;
+    struct wait_queue_entry *we        = NULL;
+    int64_t                  count     = 0;
+    int64_t                  new_count = 0;
+    uint32_t                 readers   = 0;
+
+    count = __atomic_load_n(&sem->count, __ATOMIC_RELAXED);
+
+    while(1)
+    {
+        /* a reader backing out of the fast path will try again */
+        if(((count & RWSEM_FLAGS_MASK) != RWSEM_WAITERS) ||
+           (RWSEM_READERS(count) != 0))
+        {
+            return;
+        }
+
+        we      = NULL;
+        readers = 0;
+        node    = linked_list_first(&sem->wq.head);
+
+        if(node == NULL)
+        {
+            new_count = count & ~RWSEM_WAITERS;
+        }
+        else
+        {
+            we = (struct wait_queue_entry*)node;
+
+            if(we->flags & WAIT_QUEUE_EXCLUSIVE)
+            {
+                new_count = count | RWSEM_WRITER;
+                node = linked_list_next(node);
+            }
+            else
+            {
+                while((node != NULL) &&
+                     (~((struct wait_queue_entry*)node)->flags &
+                        WAIT_QUEUE_EXCLUSIVE))
+                {
+                    readers++;
+                    node = linked_list_next(node);
+                }
+
+                new_count = count + (int64_t)readers * RWSEM_READER;
+            }
+
+            if(node == NULL)
+            {
+                new_count &= ~RWSEM_WAITERS;
+            }
+        }
+
+        if(__atomic_compare_exchange_n(&sem->count,
+                                       &count,
+                                       new_count,
+                                       0,
+                                       __ATOMIC_ACQ_REL,
+                                       __ATOMIC_RELAXED))
+        {
+            break;
+        }
+    }
+
+    /* only the waiters that were counted in may run */
+    if(readers != 0)
+    {
+        wait_queue_wake(&sem->wq, 0);
+    }
+    else if(we != NULL)
+    {
+        wait_queue_wake_one(&sem->wq);
+    }
+}
+
+/*
+ * rwsem_can_sleep - tell if the caller has to sleep rather than spin
+ * Until the scheduler runs on this CPU no thread of this CPU can hold
+ * the lock, so the holder makes progress while we spin. Once it runs,
+ * the callers must be able to sleep: spinning with the preemption or
+ * the interrupts disabled could keep a preempted holder from running.
+ */
+
+static inline uint8_t rwsem_can_sleep
+(
+    void
+)
+{
+    return(sched_thread_self() != NULL);
+}
+
+/*
+ * rwsem_wait - queue the current thread until the lock is handed to it
+ * Must be called with the wait queue locked and RWSEM_WAITERS set.
+ */
+
+static void rwsem_wait
+(
+    struct rwsem *sem,
+    uint32_t      flags,
+    uint8_t      *int_state
+)
+{
+    struct wait_queue_entry we;
+
+    wait_queue_add(&sem->wq, &we, flags);
+    wait_queue_sleep(&sem->wq, &we, WAIT_FOREVER_NS, int_state);
+}
+
+int rwsem_read_try_lock
+(
+    struct rwsem *sem
+)
+{
+    int64_t count = 0;
+
+    count = __atomic_load_n(&sem->count, __ATOMIC_RELAXED);
+
+    while((count & (RWSEM_WRITER | RWSEM_WAITERS)) == 0)
+    {
+        if(__atomic_compare_exchange_n(&sem->count,
+                                       &count,
+                                       count + RWSEM_READER,
+                                       0,
+                                       __ATOMIC_ACQUIRE,
+                                       __ATOMIC_RELAXED))
+        {
+            return(0);
+        }
+    }
+
+    return(-1);
+}
+
+void rwsem_read_lock
+(
+    struct rwsem *sem
+)
+{
+    uint8_t int_state = 0;
+    uint8_t can_sleep = 0;
+    int64_t count     = 0;
+
+    count = __atomic_fetch_add(&sem->count, RWSEM_READER, __ATOMIC_ACQUIRE);
+
+    if((count & (RWSEM_WRITER | RWSEM_WAITERS)) == 0)
+    {
+        return;
+    }
+
+    can_sleep = rwsem_can_sleep();
+
+    spinlock_lock_int(&sem->wq.lock, &int_state);
+
+    /* back out and let a release we may have hidden go through */
+    __atomic_sub_fetch(&sem->count, RWSEM_READER, __ATOMIC_RELAXED);
+    rwsem_wake_locked(sem);
+
+    if(!can_sleep)
+    {
+        spinlock_unlock_int(&sem->wq.lock, int_state);
+
+        /* no thread of this CPU holds the lock - wait for the writer */
+        count = __atomic_load_n(&sem->count, __ATOMIC_RELAXED);
+
+        while(1)
+        {
+            if((count & RWSEM_WRITER) == 0)
+            {
+                if(__atomic_compare_exchange_n(&sem->count,
+                                               &count,
+                                               count + RWSEM_READER,
+                                               0,
+                                               __ATOMIC_ACQUIRE,
+                                               __ATOMIC_RELAXED))
+                {
+                    return;
+                }
+
+                continue;
+            }
+
+            cpu_pause();
+            count = __atomic_load_n(&sem->count, __ATOMIC_RELAXED);
+        }
+    }
+
+    while(1)
+    {
+        count = __atomic_load_n(&sem->count, __ATOMIC_RELAXED);
+
+        if((count & (RWSEM_WRITER | RWSEM_WAITERS)) == 0)
+        {
+            if(__atomic_compare_exchange_n(&sem->count,
+                                           &count,
+                                           count + RWSEM_READER,
+                                           0,
+                                           __ATOMIC_ACQUIRE,
+                                           __ATOMIC_RELAXED))
+            {
+                spinlock_unlock_int(&sem->wq.lock, int_state);
+                return;
+            }
+
+            continue;
+        }
+
+        if((count & RWSEM_WAITERS) ||
+           __atomic_compare_exchange_n(&sem->count,
+                                       &count,
+                                       count | RWSEM_WAITERS,
+                                       0,
+                                       __ATOMIC_RELAXED,
+                                       __ATOMIC_RELAXED))
+        {
+            break;
+        }
+    }
+
+    rwsem_wait(sem, 0, &int_state);
+
+    spinlock_unlock_int(&sem->wq.lock, int_state);
+}
+
+void rwsem_read_unlock
+(
+    struct rwsem *sem
+)
+{
+    uint8_t int_state = 0;
+    int64_t count     = 0;
+
+    count = __atomic_sub_fetch(&sem->count, RWSEM_READER, __ATOMIC_RELEASE);
+
+    /* the last reader hands the lock to the waiters */
+    if((RWSEM_READERS(count) == 0) &&
+       ((count & RWSEM_FLAGS_MASK) == RWSEM_WAITERS))
+    {
+        spinlock_lock_int(&sem->wq.lock, &int_state);
+        rwsem_wake_locked(sem);
+        spinlock_unlock_int(&sem->wq.lock, int_state);
+    }
+}
+
+int rwsem_write_try_lock
+(
+    struct rwsem *sem
+)
+{
+    int64_t expected = 0;
+
+    if(__atomic_compare_exchange_n(&sem->count,
+                                   &expected,
+                                   RWSEM_WRITER,
+                                   0,
+                                   __ATOMIC_ACQUIRE,
+                                   __ATOMIC_RELAXED))
+    {
+        return(0);
+    }
+
+    return(-1);
+}
+
+void rwsem_write_lock
+(
+    struct rwsem *sem
+)
+{
+    uint8_t int_state = 0;
+    int64_t count     = 0;
+
+    if(rwsem_write_try_lock(sem) == 0)
+    {
+        return;
+    }
+
+    if(!rwsem_can_sleep())
+    {
+        count = __atomic_load_n(&sem->count, __ATOMIC_RELAXED);
+
+        while(1)
+        {
+            if((count & ~(int64_t)RWSEM_WAITERS) == 0)
+            {
+                if(__atomic_compare_exchange_n(&sem->count,
+                                               &count,
+                                               count | RWSEM_WRITER,
+                                               0,
+                                               __ATOMIC_ACQUIRE,
+                                               __ATOMIC_RELAXED))
+                {
+                    return;
+                }
+
+                continue;
+            }
+
+            cpu_pause();
+            count = __atomic_load_n(&sem->count, __ATOMIC_RELAXED);
+        }
+    }
+
+    spinlock_lock_int(&sem->wq.lock, &int_state);
+
+    while(1)
+    {
+        count = __atomic_load_n(&sem->count, __ATOMIC_RELAXED);
+
+        if((count & ~(int64_t)RWSEM_WAITERS) == 0)
+        {
+            if(__atomic_compare_exchange_n(&sem->count,
+                                           &count,
+                                           count | RWSEM_WRITER,
+                                           0,
+                                           __ATOMIC_ACQUIRE,
+                                           __ATOMIC_RELAXED))
+            {
+                spinlock_unlock_int(&sem->wq.lock, int_state);
+                return;
+            }
+
+            continue;
+        }
+
+        if((count & RWSEM_WAITERS) ||
+           __atomic_compare_exchange_n(&sem->count,
+                                       &count,
+                                       count | RWSEM_WAITERS,
+                                       0,
+                                       __ATOMIC_RELAXED,
+                                       __ATOMIC_RELAXED))
+        {
+            break;
+        }
+    }
+
+    rwsem_wait(sem, WAIT_QUEUE_EXCLUSIVE, &int_state);
+
+    spinlock_unlock_int(&sem->wq.lock, int_state);
+}
+
+void rwsem_write_unlock
+(
+    struct rwsem *sem
+)
+{
+    uint8_t int_state = 0;
+    int64_t expected  = RWSEM_WRITER;
+
+    if(__atomic_compare_exchange_n(&sem->count,
+                                   &expected,
+                                   0,
+                                   0,
+                                   __ATOMIC_RELEASE,
+                                   __ATOMIC_RELAXED))
+    {
+        return;
+    }
+
+    spinlock_lock_int(&sem->wq.lock, &int_state);
+
+    __atomic_fetch_and(&sem->count, ~(int64_t)RWSEM_WRITER, __ATOMIC_RELEASE);
+    rwsem_wake_locked(sem);
+
+    spinlock_unlock_int(&sem->wq.lock, int_state);
+}
@@ -174,6 +174,45 @@ static int32_t basic_tick
    return(status);
 }
 
+static int32_t basic_select_migrate
+(
+    struct sched_exec_unit *src,
+    struct sched_exec_unit *dst,
+    struct sched_thread   **th
+)
+{
+    struct basic_policy_unit *bpu = NULL;
+    struct list_node *n = NULL;
+    struct sched_thread *cand = NULL;
+    int32_t result = -1;
+
+    bpu = basic_unit_get(src);
+
+    if((bpu != NULL) && (th != NULL))
+    {
+        /* start from the tail - the threads there waited the longest
+         * so they are the least likely to have their data cached
+         */
+        n = linked_list_last(&bpu->threads);
+
+        while(n != NULL)
+        {
+            cand = SCHED_NODE_TO_THREAD(n);
+
+            if(sched_can_migrate(src, dst, cand))
+            {
+                *th = cand;
+                result = 0;
+                break;
+            }
+
+            n = linked_list_prev(n);
+        }
+    }
+
+    return(result);
+}
+
 static int basic_unit_init
 (
     struct sched_exec_unit *unit
@@ -203,6 +242,7 @@ static struct sched_policy basic_policy =
     .pick_next        = basic_pick_next_thread,
     .select_thread    = basic_select_thread,
     .put_prev         = basic_put_prev_thread,
+    .select_migrate   = basic_select_migrate,
     .policy_name      = "basic",
     .id               = sched_basic_policy,
     .pv               = &policy
@@ -0,0 +1,589 @@
+#include <sched.h>
+#include <linked_list.h>
+#include <rb_tree.h>
+#include <spinlock.h>
+#include <timer.h>
+#include <utils.h>
+#include <liballoc.h>
+
+/*
+ * Earliest deadline first policy - a thread reserves a budget of runtime
+ * that is replenished every period and must be served before its
+ * relative deadline. Ready threads are kept in a red-black tree ordered
+ * by their absolute deadline on the unit clock and the leftmost one runs.
+ *
+ * A thread that used its budget is throttled until the periodic timer
+ * replenishes it. Reservations are admitted only if the total bandwidth
+ * of the unit stays below EDF_MAX_BW and the threads are never moved to
+ * another unit by the load balancer.
+ */
+
+#define EDF_POLICY_MAX_UNITS   4096
+#define EDF_BW_SHIFT           (20)
+#define EDF_BW_SCALE           (1ull << EDF_BW_SHIFT)
+#define EDF_MAX_BW             ((EDF_BW_SCALE * 95) / 100)
+
+#define EDF_NODE_TO_THREAD(x) (struct sched_thread*) (((uint8_t*)(x)) -  \
+                              offsetof(struct sched_thread, edf.node))
+
+struct edf_policy_unit
+{
+    struct sched_exec_unit *unit;
+    struct rb_tree          tree;
+    uint64_t                bw;     /* admitted bandwidth, in EDF_BW_SCALE units */
+};
+
+struct edf_policy
+{
+    struct spinlock         lock;   /* protects the admitted bandwidth */
+    struct edf_policy_unit *units[EDF_POLICY_MAX_UNITS];
+};
+
+static struct edf_policy policy = {0};
+static struct sched_policy edf_policy;
+
+static struct edf_policy_unit *edf_unit_get
+(
+    struct sched_exec_unit *unit
+)
+{
+    struct cpu *cpu = NULL;
+    struct edf_policy_unit *eu = NULL;
+
+    if(unit != NULL)
+    {
+        cpu = unit->cpu;
+    }
+
+    if(cpu != NULL)
+    {
+        if(cpu->cpu_id < EDF_POLICY_MAX_UNITS)
+        {
+            eu = policy.units[cpu->cpu_id];
+        }
+    }
+
+    return(eu);
+}
+
+static int edf_cmp
+(
+    struct rb_node *node,
+    void *key
+)
+{
+    struct sched_thread *th = NULL;
+    uint64_t deadline = 0;
+
+    th = EDF_NODE_TO_THREAD(node);
+    deadline = *(uint64_t*)key;
+
+    if(th->edf.abs_deadline > deadline)
+    {
+        return(1);
+    }
+    else if(th->edf.abs_deadline < deadline)
+    {
+        return(-1);
+    }
+
+    return(0);
+}
+
+static struct sched_thread *edf_leftmost
+(
+    struct edf_policy_unit *eu
+)
+{
+    if(eu->tree.root == &eu->tree.nil)
+    {
+        return(NULL);
+    }
+
+    return(EDF_NODE_TO_THREAD(rb_tree_minimum(&eu->tree, eu->tree.root)));
+}
+
+static void edf_insert
+(
+    struct edf_policy_unit *eu,
+    struct sched_thread *th
+)
+{
+    rb_insert(&eu->tree, &th->edf.node, edf_cmp, &th->edf.abs_deadline);
+}
+
+/* ask the running thread to give up the CPU if th is more urgent */
+static int edf_check_preempt
+(
+    struct sched_exec_unit *unit,
+    struct sched_thread *th
+)
+{
+    struct sched_thread *cur = NULL;
+
+    cur = unit->current;
+
+    if((cur == NULL) || (cur == th))
+    {
+        return(0);
+    }
+
+    if((cur->policy != &edf_policy) ||
+       (cur->edf.abs_deadline > th->edf.abs_deadline))
+    {
+        cur->flags |= THREAD_NEED_RESCHEDULE;
+        return(1);
+    }
+
+    return(0);
+}
+
+/* periodic timer - called from the interrupt context */
+static uint32_t edf_replenish
+(
+    struct timer *tm,
+    void *arg,
+    const void *isr_inf
+)
+{
+    struct sched_thread *th = NULL;
+    struct sched_exec_unit *unit = NULL;
+    struct edf_policy_unit *eu = NULL;
+    int kick = 0;
+    int queued = 0;
+
+    th = arg;
+    unit = th->unit;
+    eu = edf_unit_get(unit);
+
+    if(eu == NULL)
+    {
+        return(0);
+    }
+
+    spinlock_lock(&unit->lock);
+
+    /* a dead thread stays throttled */
+    if(~th->flags & THREAD_DEAD)
+    {
+        /* the thread wanted to run but did not get its budget in time */
+        if((th->edf.runtime_left > 0)     &&
+           (th->flags & THREAD_READY)     &&
+           (th->edf.abs_deadline != 0)    &&
+           (~th->edf.flags & EDF_MISS_COUNTED))
+        {
+            th->edf.misses++;
+        }
+
+        /* the deadline is the key of the tree - take the thread out
+         * while it changes
+         */
+        queued = (th->flags & THREAD_READY) &&
+                 (unit->current != th) &&
+                 (~th->edf.flags & EDF_THROTTLED);
+
+        if(queued)
+        {
+            rb_delete(&eu->tree, &th->edf.node);
+        }
+
+        th->edf.runtime_left = th->edf.runtime;
+        th->edf.abs_deadline = unit->clock_ns + th->edf.deadline;
+        th->edf.flags &= ~EDF_MISS_COUNTED;
+
+        if(th->edf.flags & EDF_THROTTLED)
+        {
+            th->edf.flags &= ~EDF_THROTTLED;
+
+            if((th->flags & THREAD_READY) && (unit->current != th))
+            {
+                edf_insert(eu, th);
+                kick = edf_check_preempt(unit, th);
+            }
+        }
+        else if(queued)
+        {
+            edf_insert(eu, th);
+            kick = edf_check_preempt(unit, th);
+        }
+    }
+
+    spinlock_unlock(&unit->lock);
+
+    /* the unit may be idle with its tick stopped */
+    if(kick)
+    {
+        sched_unit_kick(unit);
+    }
+
+    return(0);
+}
+
+static int32_t edf_enqueue
+(
+    struct sched_exec_unit *unit,
+    struct sched_thread *th
+)
+{
+    struct edf_policy_unit *eu = NULL;
+
+    eu = edf_unit_get(unit);
+
+    if((eu == NULL) || (th == NULL))
+    {
+        return(-1);
+    }
+
+    /* the thread woke up past its deadline - start a new job */
+    if(th->edf.abs_deadline <= unit->clock_ns)
+    {
+        th->edf.abs_deadline = unit->clock_ns + th->edf.deadline;
+        th->edf.runtime_left = th->edf.runtime;
+        th->edf.flags &= ~(EDF_THROTTLED | EDF_MISS_COUNTED);
+    }
+
+    /* a throttled thread is queued by the replenishment timer */
+    if(~th->edf.flags & EDF_THROTTLED)
+    {
+        edf_insert(eu, th);
+    }
+
+    return(0);
+}
+
+static int32_t edf_dequeue
+(
+    struct sched_exec_unit *unit,
+    struct sched_thread *th
+)
+{
+    struct edf_policy_unit *eu = NULL;
+
+    eu = edf_unit_get(unit);
+
+    if((eu == NULL) || (th == NULL))
+    {
+        return(-1);
+    }
+
+    /* the running and the throttled threads are not in the tree */
+    if((unit->current != th) && (~th->edf.flags & EDF_THROTTLED))
+    {
+        rb_delete(&eu->tree, &th->edf.node);
+    }
+
+    return(0);
+}
+
+static int32_t edf_pick_next_thread
+(
+    struct sched_exec_unit *unit,
+    struct sched_thread **th
+)
+{
+    struct edf_policy_unit *eu = NULL;
+    struct sched_thread *next = NULL;
+
+    eu = edf_unit_get(unit);
+
+    if((eu == NULL) || (th == NULL))
+    {
+        return(-1);
+    }
+
+    next = edf_leftmost(eu);
+
+    if(next == NULL)
+    {
+        return(-1);
+    }
+
+    *th = next;
+
+    return(0);
+}
+
+static int32_t edf_select_thread
+(
+    struct sched_exec_unit *unit,
+    struct sched_thread *th
+)
+{
+    struct edf_policy_unit *eu = NULL;
+
+    eu = edf_unit_get(unit);
+
+    if(eu == NULL)
+    {
+        return(-1);
+    }
+
+    rb_delete(&eu->tree, &th->edf.node);
+    th->cpu_left = 0;
+
+    return(0);
+}
+
+static int32_t edf_put_prev_thread
+(
+    struct sched_exec_unit *unit,
+    struct sched_thread *th
+)
+{
+    struct edf_policy_unit *eu = NULL;
+
+    eu = edf_unit_get(unit);
+
+    if((eu == NULL) || (th == NULL))
+    {
+        return(-1);
+    }
+
+    /* blocked threads were dequeued and throttled ones wait for the timer */
+    if((th->flags & THREAD_READY) && (~th->edf.flags & EDF_THROTTLED))
+    {
+        edf_insert(eu, th);
+    }
+
+    return(0);
+}
+
+static int32_t edf_tick
+(
+    struct sched_exec_unit *unit
+)
+{
+    struct edf_policy_unit *eu = NULL;
+    struct sched_thread *th = NULL;
+    struct sched_thread *first = NULL;
+
+    eu = edf_unit_get(unit);
+    th = unit->current;
+
+    if((eu == NULL) || (th == NULL))
+    {
+        return(1);
+    }
+
+    if(th->edf.runtime_left > unit->tick_ns)
+    {
+        th->edf.runtime_left -= unit->tick_ns;
+    }
+    else
+    {
+        th->edf.runtime_left = 0;
+    }
+
+    /* still running after the deadline passed */
+    if((unit->clock_ns > th->edf.abs_deadline) &&
+       (th->edf.runtime_left > 0) &&
+       (~th->edf.flags & EDF_MISS_COUNTED))
+    {
+        th->edf.misses++;
+        th->edf.flags |= EDF_MISS_COUNTED;
+    }
+
+    if(th->edf.runtime_left == 0)
+    {
+        th->edf.flags |= EDF_THROTTLED;
+        return(0);
+    }
+
+    first = edf_leftmost(eu);
+
+    if((first != NULL) && (first->edf.abs_deadline < th->edf.abs_deadline))
+    {
+        return(0);
+    }
+
+    return(1);
+}
+
+static int32_t edf_check_preempt_hook
+(
+    struct sched_exec_unit *unit,
+    struct sched_thread *cur,
+    struct sched_thread *th
+)
+{
+    return(th->edf.abs_deadline < cur->edf.abs_deadline);
+}
+
+static int32_t edf_unit_init
+(
+    struct sched_exec_unit *unit
+)
+{
+    struct edf_policy_unit *eu = NULL;
+
+    if((unit == NULL) || (unit->cpu == NULL) ||
+       (unit->cpu->cpu_id >= EDF_POLICY_MAX_UNITS))
+    {
+        return(-1);
+    }
+
+    eu = kcalloc(sizeof(struct edf_policy_unit), 1);
+
+    if(eu == NULL)
+    {
+        return(-1);
+    }
+
+    eu->unit = unit;
+    rb_tree_init(&eu->tree);
+
+    policy.units[unit->cpu->cpu_id] = eu;
+
+    return(0);
+}
+
+/*
+ * sched_edf_reserve - reserve runtime_ns every period_ns, to be served
+ * within deadline_ns, for a thread that was not started yet.
+ * The thread is placed on the allowed unit with the least admitted
+ * bandwidth that can still fit the reservation.
+ */
+
+int sched_edf_reserve
+(
+    struct sched_thread *th,
+    uint64_t runtime_ns,
+    uint64_t deadline_ns,
+    uint64_t period_ns
+)
+{
+    struct edf_policy_unit *eu = NULL;
+    struct edf_policy_unit *best = NULL;
+    struct time_spec period;
+    uint64_t bw = 0;
+    uint32_t i = 0;
+    uint8_t int_status = 0;
+
+    if((th == NULL) || (th->unit != NULL) || (runtime_ns == 0) ||
+       (runtime_ns > deadline_ns) || (deadline_ns > period_ns))
+    {
+        return(-1);
+    }
+
+    bw = (runtime_ns << EDF_BW_SHIFT) / period_ns;
+
+    spinlock_lock_int(&policy.lock, &int_status);
+
+    for(i = 0; i < EDF_POLICY_MAX_UNITS; i++)
+    {
+        eu = policy.units[i];
+
+        if((eu == NULL) || !sched_unit_allowed(eu->unit, th))
+        {
+            continue;
+        }
+
+        if(eu->bw + bw > EDF_MAX_BW)
+        {
+            continue;
+        }
+
+        if((best == NULL) || (eu->bw < best->bw))
+        {
+            best = eu;
+        }
+    }
+
+    if(best != NULL)
+    {
+        best->bw += bw;
+    }
+
+    spinlock_unlock_int(&policy.lock, int_status);
+
+    /* admission failed */
+    if(best == NULL)
+    {
+        return(-1);
+    }
+
+    memset(&th->edf, 0, sizeof(struct sched_edf));
+
+    th->edf.runtime      = runtime_ns;
+    th->edf.deadline     = deadline_ns;
+    th->edf.period       = period_ns;
+    th->edf.runtime_left = runtime_ns;
+
+    th->policy = &edf_policy;
+    th->unit   = best->unit;
+
+    period.seconds = period_ns / TIMER_RESOLUTION_NS;
+    period.nanosec = period_ns % TIMER_RESOLUTION_NS;
+
+    timer_enqeue_static(NULL,
+                        &period,
+                        edf_replenish,
+                        th,
+                        TIMER_PERIODIC,
+                        &th->edf.timer);
+
+    return(0);
+}
+
+/*
+ * sched_edf_release - give back the bandwidth of a dead thread
+ */
+
+int sched_edf_release
+(
+    struct sched_thread *th
+)
+{
+    struct edf_policy_unit *eu = NULL;
+    uint8_t int_status = 0;
+
+    if((th == NULL) || (th->policy != &edf_policy) ||
+       (~th->flags & THREAD_DEAD))
+    {
+        return(-1);
+    }
+
+    eu = edf_unit_get(th->unit);
+
+    if(eu == NULL)
+    {
+        return(-1);
+    }
+
+    timer_dequeue(NULL, &th->edf.timer);
+
+    spinlock_lock_int(&policy.lock, &int_status);
+
+    eu->bw -= (th->edf.runtime << EDF_BW_SHIFT) / th->edf.period;
+
+    spinlock_unlock_int(&policy.lock, int_status);
+
+    return(0);
+}
+
+static struct sched_policy edf_policy =
+{
+    .node             = {.next = NULL, .prev = NULL},
+    .dequeue          = edf_dequeue,
+    .enqueue          = edf_enqueue,
+    .tick             = edf_tick,
+    .unit_init        = edf_unit_init,
+    .pick_next        = edf_pick_next_thread,
+    .select_thread    = edf_select_thread,
+    .put_prev         = edf_put_prev_thread,
+    .check_preempt    = edf_check_preempt_hook,
+    .select_migrate   = NULL,
+    .policy_name      = "edf",
+    .id               = sched_edf_policy,
+    .pv               = &policy
+};
+
+int edf_register
+(
+    void
+)
+{
+    spinlock_init(&policy.lock);
+    sched_policy_register(&edf_policy);
+    return(0);
+}
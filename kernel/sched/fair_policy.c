@@ -0,0 +1,481 @@
+#include <sched.h>
+#include <linked_list.h>
+#include <rb_tree.h>
+#include <utils.h>
+#include <liballoc.h>
+#include <platform.h>
+
+/*
+ * Fair policy - the ready threads are kept in a red-black tree ordered
+ * by their virtual runtime and the leftmost one runs next. The runtime
+ * is measured with the timestamp counter and weighted by the priority
+ * of the thread so lower prio values get a bigger share of the CPU.
+ *
+ * The running thread is kept out of the tree and the vruntime of a
+ * thread that is not on any unit is kept relative to the min_vruntime
+ * of the unit it left, so it can be placed correctly on wake up or
+ * when it is moved to another unit.
+ */
+
+#define FAIR_POLICY_MAX_UNITS   4096
+#define FAIR_WEIGHT_BASE        (128)  /* weight of a thread with prio 128 */
+#define FAIR_GRANULARITY_TICKS  (2)    /* runtime lead before preempting   */
+#define FAIR_SLEEPER_CREDIT     (4)    /* ticks of credit for a waking thread */
+
+#define FAIR_NODE_TO_THREAD(x) (struct sched_thread*) (((uint8_t*)(x)) -  \
+                               offsetof(struct sched_thread, fair_node))
+
+struct fair_policy_unit
+{
+    struct sched_exec_unit *unit;
+    struct rb_tree          tree;
+    int64_t                 min_vruntime;
+    uint64_t                last_tick;    /* timestamp of the last tick    */
+    uint64_t                tick_cycles;  /* average timestamp ticks per tick */
+};
+
+struct fair_policy
+{
+    struct fair_policy_unit *units[FAIR_POLICY_MAX_UNITS];
+};
+
+static struct fair_policy policy = {0};
+
+static struct fair_policy_unit *fair_unit_get
+(
+    struct sched_exec_unit *unit
+)
+{
+    struct cpu *cpu = NULL;
+    struct fair_policy_unit *fpu = NULL;
+
+    if(unit != NULL)
+    {
+        cpu = unit->cpu;
+    }
+
+    if(cpu != NULL)
+    {
+        if(cpu->cpu_id < FAIR_POLICY_MAX_UNITS)
+        {
+            fpu = policy.units[cpu->cpu_id];
+        }
+    }
+
+    return(fpu);
+}
+
+static int fair_cmp
+(
+    struct rb_node *node,
+    void *key
+)
+{
+    struct sched_thread *th = NULL;
+    int64_t diff = 0;
+
+    th = FAIR_NODE_TO_THREAD(node);
+    diff = th->vruntime - *(int64_t*)key;
+
+    if(diff > 0)
+    {
+        return(1);
+    }
+    else if(diff < 0)
+    {
+        return(-1);
+    }
+
+    return(0);
+}
+
+static uint64_t fair_weight
+(
+    struct sched_thread *th
+)
+{
+    if(th->prio > SCHED_MAX_PRIORITY)
+    {
+        return(1);
+    }
+
+    return(SCHED_MAX_PRIORITY + 1 - th->prio);
+}
+
+static struct sched_thread *fair_leftmost
+(
+    struct fair_policy_unit *fpu
+)
+{
+    if(fpu->tree.root == &fpu->tree.nil)
+    {
+        return(NULL);
+    }
+
+    return(FAIR_NODE_TO_THREAD(rb_tree_minimum(&fpu->tree, fpu->tree.root)));
+}
+
+/* charge the time spent on the CPU since the last charge */
+static void fair_charge
+(
+    struct sched_thread *th
+)
+{
+    uint64_t now   = 0;
+    uint64_t delta = 0;
+
+    now   = cpu_timestamp();
+    delta = now - th->exec_start;
+    th->exec_start = now;
+
+    th->vruntime += (delta * FAIR_WEIGHT_BASE) / fair_weight(th);
+}
+
+static void fair_update_min
+(
+    struct fair_policy_unit *fpu,
+    struct sched_thread *cur
+)
+{
+    struct sched_thread *first = NULL;
+    int64_t vruntime = 0;
+
+    first = fair_leftmost(fpu);
+
+    if(cur != NULL)
+    {
+        vruntime = cur->vruntime;
+
+        if((first != NULL) && (first->vruntime < vruntime))
+        {
+            vruntime = first->vruntime;
+        }
+    }
+    else if(first != NULL)
+    {
+        vruntime = first->vruntime;
+    }
+    else
+    {
+        return;
+    }
+
+    /* min_vruntime never goes back */
+    if(vruntime > fpu->min_vruntime)
+    {
+        fpu->min_vruntime = vruntime;
+    }
+}
+
+static int32_t fair_enqueue
+(
+    struct sched_exec_unit *unit,
+    struct sched_thread *th
+)
+{
+    struct fair_policy_unit *fpu = NULL;
+    int64_t floor = 0;
+
+    fpu = fair_unit_get(unit);
+
+    if((fpu == NULL) || (th == NULL))
+    {
+        return(-1);
+    }
+
+    th->vruntime += fpu->min_vruntime;
+
+    /* don't let a long sleeper monopolize the CPU when it wakes up */
+    floor = fpu->min_vruntime -
+            (int64_t)(fpu->tick_cycles * FAIR_SLEEPER_CREDIT);
+
+    if(th->vruntime < floor)
+    {
+        th->vruntime = floor;
+    }
+
+    rb_insert(&fpu->tree, &th->fair_node, fair_cmp, &th->vruntime);
+
+    return(0);
+}
+
+static int32_t fair_dequeue
+(
+    struct sched_exec_unit *unit,
+    struct sched_thread *th
+)
+{
+    struct fair_policy_unit *fpu = NULL;
+
+    fpu = fair_unit_get(unit);
+
+    if((fpu == NULL) || (th == NULL))
+    {
+        return(-1);
+    }
+
+    /* the running thread is not in the tree */
+    if(unit->current == th)
+    {
+        fair_charge(th);
+        fair_update_min(fpu, th);
+    }
+    else
+    {
+        rb_delete(&fpu->tree, &th->fair_node);
+    }
+
+    th->vruntime -= fpu->min_vruntime;
+
+    return(0);
+}
+
+static int32_t fair_pick_next_thread
+(
+    struct sched_exec_unit *unit,
+    struct sched_thread **th
+)
+{
+    struct fair_policy_unit *fpu = NULL;
+    struct sched_thread *next = NULL;
+
+    fpu = fair_unit_get(unit);
+
+    if((fpu == NULL) || (th == NULL))
+    {
+        return(-1);
+    }
+
+    next = fair_leftmost(fpu);
+
+    if(next == NULL)
+    {
+        return(-1);
+    }
+
+    *th = next;
+
+    return(0);
+}
+
+static int32_t fair_select_thread
+(
+    struct sched_exec_unit *unit,
+    struct sched_thread *th
+)
+{
+    struct fair_policy_unit *fpu = NULL;
+
+    fpu = fair_unit_get(unit);
+
+    if(fpu == NULL)
+    {
+        return(-1);
+    }
+
+    rb_delete(&fpu->tree, &th->fair_node);
+
+    th->exec_start = cpu_timestamp();
+    th->cpu_left   = 0;
+
+    return(0);
+}
+
+static int32_t fair_put_prev_thread
+(
+    struct sched_exec_unit *unit,
+    struct sched_thread *th
+)
+{
+    struct fair_policy_unit *fpu = NULL;
+
+    fpu = fair_unit_get(unit);
+
+    if((fpu == NULL) || (th == NULL))
+    {
+        return(-1);
+    }
+
+    /* a blocked thread was already dequeued by the scheduler */
+    if(th->flags & THREAD_READY)
+    {
+        fair_charge(th);
+        rb_insert(&fpu->tree, &th->fair_node, fair_cmp, &th->vruntime);
+        fair_update_min(fpu, NULL);
+    }
+
+    return(0);
+}
+
+static int32_t fair_tick
+(
+    struct sched_exec_unit *unit
+)
+{
+    struct fair_policy_unit *fpu = NULL;
+    struct sched_thread *th = NULL;
+    struct sched_thread *first = NULL;
+    uint64_t now = 0;
+    uint64_t sample = 0;
+
+    fpu = fair_unit_get(unit);
+    th = unit->current;
+
+    if((fpu == NULL) || (th == NULL))
+    {
+        return(1);
+    }
+
+    /* keep track of how long a tick is in timestamp units */
+    now = cpu_timestamp();
+
+    if(fpu->last_tick != 0)
+    {
+        sample = now - fpu->last_tick;
+
+        /* scale a long tick of a stopped periodic tick to a regular one */
+        if((unit->tick_period_ns != 0) && 
+           (unit->tick_ns > unit->tick_period_ns))
+        {
+            sample = (sample * unit->tick_period_ns) / unit->tick_ns;
+        }
+
+        if(fpu->tick_cycles == 0)
+        {
+            fpu->tick_cycles = sample;
+        }
+        else
+        {
+            fpu->tick_cycles = (fpu->tick_cycles * 7 + sample) / 8;
+        }
+    }
+
+    fpu->last_tick = now;
+
+    fair_charge(th);
+    fair_update_min(fpu, th);
+
+    first = fair_leftmost(fpu);
+
+    /* reschedule if another thread fell too far behind */
+    if((first != NULL) &&
+       (th->vruntime - first->vruntime >
+        (int64_t)(fpu->tick_cycles * FAIR_GRANULARITY_TICKS)))
+    {
+        return(0);
+    }
+
+    return(1);
+}
+
+static int32_t fair_check_preempt
+(
+    struct sched_exec_unit *unit,
+    struct sched_thread *cur,
+    struct sched_thread *th
+)
+{
+    struct fair_policy_unit *fpu = NULL;
+
+    fpu = fair_unit_get(unit);
+
+    if(fpu == NULL)
+    {
+        return(0);
+    }
+
+    /* same rule as the tick - avoid switching for a small lead */
+    return(cur->vruntime - th->vruntime >
+           (int64_t)(fpu->tick_cycles * FAIR_GRANULARITY_TICKS));
+}
+
+static int32_t fair_select_migrate
+(
+    struct sched_exec_unit *src,
+    struct sched_exec_unit *dst,
+    struct sched_thread   **th
+)
+{
+    struct fair_policy_unit *fpu = NULL;
+    struct rb_node *n = NULL;
+    struct sched_thread *cand = NULL;
+
+    fpu = fair_unit_get(src);
+
+    if((fpu == NULL) || (th == NULL) || (fpu->tree.root == &fpu->tree.nil))
+    {
+        return(-1);
+    }
+
+    /* the rightmost threads are the last ones to run here */
+    n = rb_tree_maximum(&fpu->tree, fpu->tree.root);
+
+    while(n != NULL)
+    {
+        cand = FAIR_NODE_TO_THREAD(n);
+
+        if(sched_can_migrate(src, dst, cand))
+        {
+            *th = cand;
+            return(0);
+        }
+
+        n = rb_tree_predecessor(&fpu->tree, n);
+    }
+
+    return(-1);
+}
+
+static int32_t fair_unit_init
+(
+    struct sched_exec_unit *unit
+)
+{
+    struct fair_policy_unit *fpu = NULL;
+
+    if((unit == NULL) || (unit->cpu == NULL) ||
+       (unit->cpu->cpu_id >= FAIR_POLICY_MAX_UNITS))
+    {
+        return(-1);
+    }
+
+    fpu = kcalloc(sizeof(struct fair_policy_unit), 1);
+
+    if(fpu == NULL)
+    {
+        return(-1);
+    }
+
+    fpu->unit = unit;
+    rb_tree_init(&fpu->tree);
+
+    policy.units[unit->cpu->cpu_id] = fpu;
+
+    return(0);
+}
+
+static struct sched_policy fair_policy =
+{
+    .node             = {.next = NULL, .prev = NULL},
+    .dequeue          = fair_dequeue,
+    .enqueue          = fair_enqueue,
+    .tick             = fair_tick,
+    .unit_init        = fair_unit_init,
+    .pick_next        = fair_pick_next_thread,
+    .select_thread    = fair_select_thread,
+    .put_prev         = fair_put_prev_thread,
+    .check_preempt    = fair_check_preempt,
+    .select_migrate   = fair_select_migrate,
+    .policy_name      = "fair",
+    .id               = sched_fair_policy,
+    .pv               = &policy
+};
+
+int fair_register
+(
+    void
+)
+{
+    sched_policy_register(&fair_policy);
+    return(0);
+}
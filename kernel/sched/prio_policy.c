@@ -0,0 +1,398 @@
+#include <sched.h>
+#include <linked_list.h>
+#include <utils.h>
+#include <liballoc.h>
+
+/*
+ * Priority policy - 256 FIFO queues, one per priority level, and a
+ * bitmap of the non-empty queues. Lower value means higher priority.
+ * The highest priority queue is found by scanning the bitmap with
+ * tzcnt so enqueue, dequeue, pick_next and put_prev do not depend
+ * on the number of threads.
+ */
+
+#define PRIO_POLICY_MAX_UNITS   4096
+#define PRIO_POLICY_LEVELS      (SCHED_MAX_PRIORITY + 1)
+#define PRIO_POLICY_MAP_WORDS   (PRIO_POLICY_LEVELS / 64)
+#define PRIO_POLICY_TIMESLICE   (10)
+
+struct prio_policy_unit
+{
+    struct sched_exec_unit *unit;
+    uint64_t                map[PRIO_POLICY_MAP_WORDS];
+    struct list_head        queues[PRIO_POLICY_LEVELS];
+};
+
+struct prio_policy
+{
+    struct prio_policy_unit *units[PRIO_POLICY_MAX_UNITS];
+};
+
+static struct prio_policy policy = {0};
+
+static struct prio_policy_unit *prio_unit_get
+(
+    struct sched_exec_unit *unit
+)
+{
+    struct cpu *cpu = NULL;
+    struct prio_policy_unit *ppu = NULL;
+
+    if(unit != NULL)
+    {
+        cpu = unit->cpu;
+    }
+
+    if(cpu != NULL)
+    {
+        if(cpu->cpu_id < PRIO_POLICY_MAX_UNITS)
+        {
+            ppu = policy.units[cpu->cpu_id];
+        }
+    }
+
+    return(ppu);
+}
+
+static inline uint16_t prio_level
+(
+    struct sched_thread *th
+)
+{
+    if(th->prio > SCHED_MAX_PRIORITY)
+    {
+        return(SCHED_MAX_PRIORITY);
+    }
+
+    return(th->prio);
+}
+
+static int32_t prio_highest_level
+(
+    struct prio_policy_unit *ppu
+)
+{
+    uint32_t i = 0;
+
+    for(i = 0; i < PRIO_POLICY_MAP_WORDS; i++)
+    {
+        if(ppu->map[i] != 0)
+        {
+            return(i * 64 + __builtin_ctzll(ppu->map[i]));
+        }
+    }
+
+    return(-1);
+}
+
+static void prio_queue_add
+(
+    struct prio_policy_unit *ppu,
+    struct sched_thread *th
+)
+{
+    uint16_t level = 0;
+
+    level = prio_level(th);
+
+    linked_list_add_tail(&ppu->queues[level], &th->sched_node);
+    ppu->map[level / 64] |= (1ull << (level % 64));
+}
+
+static void prio_queue_remove_level
+(
+    struct prio_policy_unit *ppu,
+    struct sched_thread *th,
+    uint16_t level
+)
+{
+    linked_list_remove(&ppu->queues[level], &th->sched_node);
+
+    if(linked_list_count(&ppu->queues[level]) == 0)
+    {
+        ppu->map[level / 64] &= ~(1ull << (level % 64));
+    }
+}
+
+static void prio_queue_remove
+(
+    struct prio_policy_unit *ppu,
+    struct sched_thread *th
+)
+{
+    prio_queue_remove_level(ppu, th, prio_level(th));
+}
+
+static int32_t prio_enqueue
+(
+    struct sched_exec_unit *unit,
+    struct sched_thread *th
+)
+{
+    struct prio_policy_unit *ppu = NULL;
+    int32_t status = -1;
+
+    ppu = prio_unit_get(unit);
+
+    if(ppu != NULL && th != NULL)
+    {
+        prio_queue_add(ppu, th);
+        status = 0;
+    }
+
+    return(status);
+}
+
+/* the priority of a queued thread only changes through prio_changed */
+static int32_t prio_dequeue
+(
+    struct sched_exec_unit *unit,
+    struct sched_thread *th
+)
+{
+    struct prio_policy_unit *ppu = NULL;
+    int32_t status = -1;
+
+    ppu = prio_unit_get(unit);
+
+    if(ppu != NULL && th != NULL)
+    {
+        prio_queue_remove(ppu, th);
+        status = 0;
+    }
+
+    return(status);
+}
+
+static int32_t prio_pick_next_thread
+(
+    struct sched_exec_unit *unit,
+    struct sched_thread **th
+)
+{
+    struct prio_policy_unit *ppu = NULL;
+    struct list_node *n = NULL;
+    int32_t level = -1;
+    int32_t result = -1;
+
+    ppu = prio_unit_get(unit);
+
+    if((ppu != NULL) && (th != NULL))
+    {
+        level = prio_highest_level(ppu);
+
+        if(level >= 0)
+        {
+            n = linked_list_first(&ppu->queues[level]);
+            *th = SCHED_NODE_TO_THREAD(n);
+            result = 0;
+        }
+    }
+
+    return(result);
+}
+
+static int32_t prio_select_thread
+(
+    struct sched_exec_unit *unit,
+    struct sched_thread *th
+)
+{
+    th->cpu_left = PRIO_POLICY_TIMESLICE;
+    return(0);
+}
+
+static int32_t prio_put_prev_thread
+(
+    struct sched_exec_unit *unit,
+    struct sched_thread *th
+)
+{
+    struct prio_policy_unit *ppu = NULL;
+    int32_t result = -1;
+
+    ppu = prio_unit_get(unit);
+
+    if((ppu != NULL) && (th != NULL))
+    {
+        /* a blocked thread was already removed by the scheduler */
+        if(th->flags & THREAD_READY)
+        {
+            /* round-robin within the same priority level */
+            prio_queue_remove(ppu, th);
+            prio_queue_add(ppu, th);
+
+            result = 0;
+        }
+    }
+
+    return(result);
+}
+
+static int32_t prio_tick
+(
+    struct sched_exec_unit *unit
+)
+{
+    struct sched_thread *th = NULL;
+    int32_t status = 0;
+
+    th = unit->current;
+
+    if(th != NULL)
+    {
+        if(th->cpu_left > 0)
+        {
+            th->cpu_left--;
+            status = 1;
+        }
+    }
+
+    return(status);
+}
+
+static int32_t prio_check_preempt
+(
+    struct sched_exec_unit *unit,
+    struct sched_thread *cur,
+    struct sched_thread *th
+)
+{
+    return(prio_level(th) < prio_level(cur));
+}
+
+static int32_t prio_select_migrate
+(
+    struct sched_exec_unit *src,
+    struct sched_exec_unit *dst,
+    struct sched_thread   **th
+)
+{
+    struct prio_policy_unit *ppu = NULL;
+    struct sched_thread *cand = NULL;
+    struct list_node *n = NULL;
+    int32_t level = 0;
+    int32_t result = -1;
+
+    ppu = prio_unit_get(src);
+
+    if((ppu == NULL) || (th == NULL))
+    {
+        return(-1);
+    }
+
+    /* prefer moving the highest priority threads that are waiting */
+    for(level = 0; (level < PRIO_POLICY_LEVELS) && (result != 0); level++)
+    {
+        if((ppu->map[level / 64] & (1ull << (level % 64))) == 0)
+        {
+            continue;
+        }
+
+        n = linked_list_last(&ppu->queues[level]);
+
+        while(n != NULL)
+        {
+            cand = SCHED_NODE_TO_THREAD(n);
+
+            if(sched_can_migrate(src, dst, cand))
+            {
+                *th = cand;
+                result = 0;
+                break;
+            }
+
+            n = linked_list_prev(n);
+        }
+    }
+
+    return(result);
+}
+
+/* move a queued thread to the queue of its new priority */
+static int32_t prio_changed
+(
+    struct sched_exec_unit *unit,
+    struct sched_thread *th,
+    uint16_t old_prio
+)
+{
+    struct prio_policy_unit *ppu = NULL;
+
+    ppu = prio_unit_get(unit);
+
+    if((ppu == NULL) || (th == NULL))
+    {
+        return(-1);
+    }
+
+    if(old_prio > SCHED_MAX_PRIORITY)
+    {
+        old_prio = SCHED_MAX_PRIORITY;
+    }
+
+    prio_queue_remove_level(ppu, th, old_prio);
+    prio_queue_add(ppu, th);
+
+    return(0);
+}
+
+static int32_t prio_unit_init
+(
+    struct sched_exec_unit *unit
+)
+{
+    struct prio_policy_unit *ppu = NULL;
+    uint32_t i = 0;
+
+    if((unit == NULL) || (unit->cpu == NULL) ||
+       (unit->cpu->cpu_id >= PRIO_POLICY_MAX_UNITS))
+    {
+        return(-1);
+    }
+
+    ppu = kcalloc(sizeof(struct prio_policy_unit), 1);
+
+    if(ppu == NULL)
+    {
+        return(-1);
+    }
+
+    ppu->unit = unit;
+
+    for(i = 0; i < PRIO_POLICY_LEVELS; i++)
+    {
+        linked_list_init(&ppu->queues[i]);
+    }
+
+    policy.units[unit->cpu->cpu_id] = ppu;
+
+    return(0);
+}
+
+static struct sched_policy prio_policy =
+{
+    .node             = {.next = NULL, .prev = NULL},
+    .dequeue          = prio_dequeue,
+    .enqueue          = prio_enqueue,
+    .tick             = prio_tick,
+    .unit_init        = prio_unit_init,
+    .pick_next        = prio_pick_next_thread,
+    .select_thread    = prio_select_thread,
+    .put_prev         = prio_put_prev_thread,
+    .check_preempt    = prio_check_preempt,
+    .select_migrate   = prio_select_migrate,
+    .prio_changed     = prio_changed,
+    .policy_name      = "prio",
+    .id               = sched_prio_policy,
+    .pv               = &policy
+};
+
+int prio_register
+(
+    void
+)
+{
+    sched_policy_register(&prio_policy);
+    return(0);
+}
@@ -1,6 +1,7 @@
 #include <linked_list.h>
 #include <defs.h>
 #include <spinlock.h>
+#include <brlock.h>
 #include <liballoc.h>
 #include <utils.h>
 #include <intc.h>
@@ -15,15 +16,27 @@
 #include <isr.h>
 #include <platform.h>
 #include <owner.h>
+#include <percpu.h>
+#include <clock.h>
+#include <rcu.h>
+#include <lockstat.h>
 
 #define SCHED_IDLE_THREAD_STACK_SIZE    (PAGE_SIZE)
+#define SCHED_BALANCE_INTERVAL          (100) /* ticks between balancing */
+#define SCHED_CACHE_HOT_TICKS           (2)   /* ticks a thread stays hot */
+#define SCHED_TICK_NS                   (1000000ull) /* nominal tick length */
+#define SCHED_DEFAULT_POLICY            (sched_prio_policy)
 
 static struct list_head    threads       = LINKED_LIST_INIT;
 static struct list_head    units         = LINKED_LIST_INIT;
 static struct list_head    policies      = LINKED_LIST_INIT;
-static struct spinlock_rw  units_lock    = SPINLOCK_RW_INIT;
-static struct spinlock_rw  threads_lock  = SPINLOCK_RW_INIT;
-static struct spinlock_rw  policies_lock = SPINLOCK_RW_INIT;
+static struct brlock       units_lock;
+static struct spinlock     threads_lock  = SPINLOCK_INIT
+static struct spinlock     policies_lock = SPINLOCK_INIT /* writers - readers use RCU */
+
+/* execution unit and thread running on the current CPU */
+static PERCPU_DEFINE(struct sched_exec_unit*, current_unit)   = NULL;
+static PERCPU_DEFINE(struct sched_thread*,    current_thread) = NULL;
 
 
 static void *sched_idle_thread
@@ -85,12 +98,60 @@ static uint8_t sched_preemption_enabled
     struct sched_exec_unit *unit
 );
 
+static int sched_balance_needed
+(
+    struct sched_exec_unit *unit
+);
+
+static int32_t sched_balance
+(
+    struct sched_exec_unit *dst
+);
+
+static int sched_should_preempt
+(
+    struct sched_exec_unit *unit,
+    struct sched_thread    *th
+);
+
+static uint32_t sched_unit_load
+(
+    struct sched_exec_unit *unit
+);
+
+static void sched_tick_update
+(
+    struct sched_exec_unit *unit,
+    struct sched_thread    *next
+);
+
+/* imbalance needed to pull threads from each domain level */
+static const uint32_t sched_domain_imbalance[SCHED_DOMAIN_LEVELS] = 
+{
+    1, 1, 2, 2
+};
+
 
 int basic_register
 (
     void
 );
 
+int prio_register
+(
+    void
+);
+
+int edf_register
+(
+    void
+);
+
+int fair_register
+(
+    void
+);
+
 int idle_task_register
 (
     void
@@ -108,6 +169,7 @@ void sched_thread_entry_point
 {
     th_entry_point_t entry_point = NULL;
     uint8_t int_flag = 0;
+    uint8_t died = 0;
     void *ret_val = NULL;
 
     entry_point = (th_entry_point_t)th->entry_point;
@@ -117,7 +179,7 @@ void sched_thread_entry_point
      * failing to do so will cause one thread to run on the locked unit
      * and will cause the unit to be unable to switch between threads
      */
-    spinlock_unlock_int(&th->unit->lock, int_flag);
+    spinlock_unlock_int(&percpu_read(current_unit)->lock, int_flag);
     cpu_int_unlock();
 
     if(entry_point != NULL)
@@ -132,10 +194,17 @@ void sched_thread_entry_point
      {
          sched_thread_mark_dead(th);
          th->rval = ret_val;
+         died = 1;
      }
     
     spinlock_unlock_int(&th->lock, int_flag);
 
+    /* stop the replenish timer and give back the EDF bandwidth */
+    if(died)
+    {
+        sched_edf_release(th);
+    }
+
     while(1)
     {
         cpu_pause();
@@ -149,10 +218,10 @@ int32_t sched_track_thread
 {
     uint8_t int_flag = 0;
 
-    /* add thread to the global list */
-    spinlock_write_lock_int(&threads_lock, &int_flag);
-    linked_list_add_tail(&threads, &th->system_node);
-    spinlock_write_unlock_int(&threads_lock, int_flag);
+    /* add thread to the global list - it is walked under RCU */
+    spinlock_lock_int(&threads_lock, &int_flag);
+    linked_list_add_tail_rcu(&threads, &th->system_node);
+    spinlock_unlock_int(&threads_lock, int_flag);
 
     return(0);
 }
@@ -165,10 +234,12 @@ int32_t sched_untrack_thread
 {
     uint8_t int_flag = 0;
 
-    /* remove thread to the global list */
-    spinlock_write_lock_int(&threads_lock, &int_flag);
-    linked_list_remove(&threads, &th->system_node);
-    spinlock_write_unlock_int(&threads_lock, int_flag);
+    /* remove thread to the global list - the caller must
+     * wait for a grace period before freeing the thread
+     */
+    spinlock_lock_int(&threads_lock, &int_flag);
+    linked_list_remove_rcu(&threads, &th->system_node);
+    spinlock_unlock_int(&threads_lock, int_flag);
 
     return(0);
 }
@@ -178,13 +249,12 @@ void sched_show_threads
     void
 )
 {
-    uint8_t int_sts = 0;
     struct list_node *ln = NULL;
     struct sched_thread *th = NULL;
 
-    spinlock_read_lock_int(&threads_lock, &int_sts);
+    rcu_read_lock();
 
-    ln = linked_list_first(&threads);
+    ln = linked_list_first_rcu(&threads);
 
     while(ln)
     {
@@ -192,11 +262,11 @@ void sched_show_threads
 
         kprintf("THREAD %x\n", th);
 
-        ln = linked_list_next(ln);
+        ln = linked_list_next_rcu(ln);
         
     }
 
-    spinlock_read_unlock_int(&threads_lock, int_sts);
+    rcu_read_unlock();
 }
 
 int32_t sched_pin_task_to_unit
@@ -237,41 +307,161 @@ int32_t sched_unpin_task_from_unit
     return(status);
 }
 
+int sched_unit_allowed
+(
+    struct sched_exec_unit *unit,
+    struct sched_thread    *th
+)
+{
+    uint32_t cpu_id = 0;
+
+    cpu_id = unit->cpu->cpu_id;
+
+    /* the affinity vector covers only the first CPUs
+     * so the others are always allowed
+     */
+    if(cpu_id >= CPU_AFFINITY_VECTOR * 8)
+    {
+        return(1);
+    }
+
+    return((th->affinity[cpu_id / 8] & (1 << (cpu_id % 8))) != 0);
+}
+
+/* lowest domain level that contains both units */
+static uint32_t sched_domain_level
+(
+    struct sched_exec_unit *a,
+    struct sched_exec_unit *b
+)
+{
+    uint32_t level = 0;
+
+    for(level = 0; level < SCHED_DOMAIN_SYSTEM; level++)
+    {
+        if(a->domain_id[level] == b->domain_id[level])
+        {
+            break;
+        }
+    }
+
+    return(level);
+}
+
+/* build the domain hierarchy of the unit from the topology of its cpu */
+static void sched_domain_init
+(
+    struct sched_exec_unit *unit
+)
+{
+    struct cpu *cpu = unit->cpu;
+
+    unit->domain_id[SCHED_DOMAIN_SMT]     = cpu->core_id;
+    unit->domain_id[SCHED_DOMAIN_PACKAGE] = cpu->package_id;
+    unit->domain_id[SCHED_DOMAIN_NUMA]    = cpu->proximity_domain;
+    unit->domain_id[SCHED_DOMAIN_SYSTEM]  = 0;
+}
+
+static int sched_unit_less_busy
+(
+    struct sched_exec_unit *a,
+    struct sched_exec_unit *b
+)
+{
+    uint32_t load_a = 0;
+    uint32_t load_b = 0;
+
+    load_a = sched_unit_load(a);
+    load_b = sched_unit_load(b);
+
+    if(load_a != load_b)
+    {
+        return(load_a < load_b);
+    }
+
+    return(linked_list_count(&a->unit_threads) < 
+           linked_list_count(&b->unit_threads));
+}
+
+/*
+ * sched_find_least_used_unit - pick the unit for a new thread
+ * An idle unit is searched from the closest domain of the calling
+ * unit outwards so the thread stays near its creator's cache and
+ * memory. If there is none, the least busy unit of the system is used.
+ */
+
 int32_t sched_find_least_used_unit
 (
+    struct sched_thread     *th,
     struct sched_exec_unit **unit
 )
 {
     uint8_t int_status = 0;
     struct list_node *ln = NULL;
-    struct sched_exec_unit *least_busy = NULL;
+    struct sched_exec_unit *best[SCHED_DOMAIN_LEVELS] = {NULL};
+    struct sched_exec_unit *fallback = NULL;
+    struct sched_exec_unit *local = NULL;
     struct sched_exec_unit *cursor = NULL;
+    uint32_t level = 0;
+    uint32_t i = 0;
     
-    spinlock_read_lock_int(&units_lock, &int_status);
+    local = percpu_read(current_unit);
+
+    brlock_read_lock_int(&units_lock, &int_status);
     ln = linked_list_first(&units);
 
     while(ln)
     {
         cursor = (struct sched_exec_unit*)ln;
+        ln = linked_list_next(ln);
 
-        if(least_busy == NULL)
+        /* used only if the thread is not allowed anywhere */
+        if((fallback == NULL) || sched_unit_less_busy(cursor, fallback))
         {
-            least_busy = cursor;
+            fallback = cursor;
+        }
+
+        if(!sched_unit_allowed(cursor, th))
+        {
+            continue;
+        }
+
+        if(local != NULL)
+        {
+            level = sched_domain_level(local, cursor);
         }
         else
         {
-            if(linked_list_count(&cursor->unit_threads) < 
-               linked_list_count(&least_busy->unit_threads))
+            level = SCHED_DOMAIN_SYSTEM;
+        }
+
+        /* the unit belongs to its level and to all the ones above */
+        for(i = level; i < SCHED_DOMAIN_LEVELS; i++)
+        {
+            if((best[i] == NULL) || sched_unit_less_busy(cursor, best[i]))
             {
-                least_busy = cursor;
+                best[i] = cursor;
             }
         }
+    }
 
-        ln = linked_list_next(ln);
+    *unit = best[SCHED_DOMAIN_SYSTEM];
+
+    for(i = 0; i < SCHED_DOMAIN_SYSTEM; i++)
+    {
+        if((best[i] != NULL) && (sched_unit_load(best[i]) == 0))
+        {
+            *unit = best[i];
+            break;
+        }
     }
 
-    *unit = least_busy;
-    spinlock_read_unlock_int(&units_lock, int_status);
+    if(*unit == NULL)
+    {
+        *unit = fallback;
+    }
+
+    brlock_read_unlock_int(&units_lock, int_status);
     return(0);
 }
 
@@ -282,18 +472,29 @@ int sched_start_thread
 {
     struct sched_exec_unit *unit = NULL;
     uint8_t int_status = 0;
+    int preempt = 0;
 
     spinlock_lock_int(&th->lock, &int_status);
     
-    /* get the most available unit */
-    sched_find_least_used_unit(&unit);
+    /* get the most available unit unless the policy already placed it */
+    if(th->unit != NULL)
+    {
+        unit = th->unit;
+    }
+    else
+    {
+        sched_find_least_used_unit(th, &unit);
+    }
 
     /* add the thread to the tracking list */
     sched_track_thread(th);
 
-    /* pick the policy for the thread */
-    th->policy = sched_get_policy_by_id(th != &unit->idle ? sched_basic_policy : 
-                                                            sched_idle_task_policy);
+    /* pick the policy for the thread unless one was already set */
+    if(th->policy == NULL)
+    {
+        th->policy = sched_get_policy_by_id(th != &unit->idle ? SCHED_DEFAULT_POLICY : 
+                                                                sched_idle_task_policy);
+    }
 
 
     /* pin the thread to the unit */
@@ -302,8 +503,23 @@ int sched_start_thread
     /* enqueue the thread to the policy so it will get executed */
     spinlock_lock(&unit->lock);
     sched_enq(unit, th);
+    preempt = sched_should_preempt(unit, th) || 
+              (__atomic_load_n(&unit->flags, __ATOMIC_RELAXED) & 
+               UNIT_TICK_STOPPED);
+
+    if(preempt && (unit->current != NULL))
+    {
+        unit->current->flags |= THREAD_NEED_RESCHEDULE;
+    }
+
     spinlock_unlock(&unit->lock);
     spinlock_unlock_int(&th->lock, int_status);
+
+    if(preempt)
+    {
+        sched_unit_kick(unit);
+    }
+
     return(0);
 }
 
@@ -312,57 +528,10 @@ struct sched_thread *sched_thread_self
     void
 )
 {
-    struct sched_exec_unit *unit = NULL;
-    struct cpu             *cpu  = NULL;
-    struct sched_thread    *self = NULL;
-    uint8_t           iflag = 0;
-
-    iflag = cpu_int_check();
-
-    if(iflag)
-    {
-        /* lock the interrupts to prevent rescheduling */
-        cpu_int_lock();
-    }
-    
-    cpu = cpu_current_get();
-
-    if(cpu == NULL)
-    {
-        if(iflag)
-        {
-            cpu_int_unlock();
-        }
-        return(NULL);
-    }
-    
-    unit = cpu->sched;
-
-    if(unit == NULL)
-    {
-        if(iflag)
-        {
-            cpu_int_unlock();
-        }
-
-        return(NULL);
-    }
-
-    /* lock the unit to extract the thread */
-    spinlock_lock(&unit->lock);
-    
-    self = unit->current;
-
-    /* unlock the unit */
-    spinlock_unlock(&unit->lock);
-
-    /* enable interrupts */
-    if(iflag)
-    {
-        cpu_int_unlock();
-    }
-    
-    return(self);
+    /* a single load from the per-CPU area so there is no
+     * window in which we could be rescheduled
+     */
+    return(percpu_read(current_thread));
 }
 
 void sched_thread_mark_dead
@@ -393,6 +562,9 @@ void sched_thread_exit
 
            self->rval = exit_val;
 
+           /* stop the replenish timer and give back the EDF bandwidth */
+           sched_edf_release(self);
+
            /* we're dead so we can release the cpu */
            sched_yield();
        }
@@ -485,22 +657,61 @@ int32_t sched_policy_register
     int32_t node_found = 0;
     int32_t ret = -1;
 
-    spinlock_write_lock_int(&policies_lock, &int_status);
+    spinlock_lock_int(&policies_lock, &int_status);
 
     node_found = linked_list_find_node(&policies, &p->node);
 
+    /* policies are never removed so the readers need no grace period */
     if(node_found == -1)
     {
-        linked_list_add_tail(&policies, &p->node);
+        linked_list_add_tail_rcu(&policies, &p->node);
         ret = 0;
     }
 
-    spinlock_write_unlock_int(&policies_lock, int_status);
+    spinlock_unlock_int(&policies_lock, int_status);
 
     return(ret);
 
 }
 
+/*
+ * sched_thread_policy_set - select the policy of a thread before it is started
+ */
+
+int sched_thread_policy_set
+(
+    struct sched_thread *th,
+    enum sched_policy_id id
+)
+{
+    struct sched_policy *policy = NULL;
+    uint8_t int_status = 0;
+    int ret = -1;
+
+    rcu_read_lock();
+    policy = sched_get_policy_by_id(id);
+    rcu_read_unlock();
+
+    if(policy == NULL)
+    {
+        return(-1);
+    }
+
+    spinlock_lock_int(&th->lock, &int_status);
+
+    /* the thread is already queued by a policy */
+    if(th->unit == NULL)
+    {
+        th->policy = policy;
+        ret = 0;
+    }
+
+    spinlock_unlock_int(&th->lock, int_status);
+
+    return(ret);
+}
+
+/* the caller must be in an RCU read section or have the interrupts off */
 struct sched_policy *sched_get_policy_by_id
 (
     enum sched_policy_id id
@@ -509,7 +720,7 @@ struct sched_policy *sched_get_policy_by_id
     struct list_node *ln = NULL;
     struct sched_policy *policy = NULL;
 
-    ln = linked_list_first(&policies);
+    ln = linked_list_first_rcu(&policies);
 
     while(ln != NULL)
     {
@@ -524,7 +735,7 @@ struct sched_policy *sched_get_policy_by_id
             policy = NULL;
         }
 
-        ln = linked_list_next(ln);
+        ln = linked_list_next_rcu(ln);
     }
 
     return(policy);
@@ -537,12 +748,26 @@ struct sched_policy *sched_get_policy_by_id
 
 int sched_init(void)
 {
-    /* Set up RW spinlock to protect execution unit list */
-    spinlock_rw_init(&units_lock);
+    /* the unit and policy lists are read on every context switch */
+    brlock_init(&units_lock);
+    spinlock_init(&policies_lock);
+
+    lockstat_name(&threads_lock, "threads_lock");
 
     /* Initialize units list */
     linked_list_init(&units);
     
+    /* register the real-time policies first so that their
+     * threads are picked before the ones of the basic policy
+     */
+    edf_register();
+
+    /* register priority scheduling policy */
+    prio_register();
+
+    /* register fair scheduling policy */
+    fair_register();
+
     /* register basic scheduling policy */
     basic_register();
 
@@ -608,17 +833,23 @@ int sched_unit_init
 
     /* assign scheduler unit to the cpu */
     cpu->sched = unit;
+    percpu_write(current_unit, unit);
 
     /* tell the scheduler unit on which cpu it belongs */
     unit->cpu = cpu;
 
+    /* find out which units share the core, package and NUMA node */
+    sched_domain_init(unit);
+
     /* Set up the spinlock for the unit */
     spinlock_init(&unit->lock);
+    lockstat_name(&unit->lock, "unit->lock");
+    seqcount_init(&unit->stats_seq);
 
     /* Do per policy initalization */
-    spinlock_read_lock_int(&policies_lock, &int_flag);
+    rcu_read_lock();
 
-    node = linked_list_first(&policies);
+    node = linked_list_first_rcu(&policies);
  
     while(node != NULL)
     {
@@ -626,10 +857,10 @@ int sched_unit_init
     
         policy->unit_init(unit);
 
-        node = linked_list_next(node);    
+        node = linked_list_next_rcu(node);    
     }
 
-    spinlock_read_unlock_int(&policies_lock, int_flag);
+    rcu_read_unlock();
 
    
 
@@ -650,11 +881,11 @@ int sched_unit_init
     unit->idle.flags |= THREAD_READY;
 
     /* Add the unit to the list */
-    spinlock_write_lock_int(&units_lock, &int_flag);
+    brlock_write_lock_int(&units_lock, &int_flag);
 
     linked_list_add_tail(&units, &unit->node);
     
-    spinlock_write_unlock_int(&units_lock, int_flag);
+    brlock_write_unlock_int(&units_lock, int_flag);
 
 
     /* check if we have a thread to start at the end of the initalization */
@@ -668,6 +899,16 @@ int sched_unit_init
      */
     
 
+    /* grace periods have to wait for this CPU from now on */
+    rcu_cpu_online();
+
+    /* timers armed on this CPU will be driven by its tick */
+    if((use_tick_ipi == 0) && (timer_cpu_init() != 0))
+    {
+        kprintf("No timer queue for CPU %d - using the system timer\n",
+                cpu->cpu_id);
+    }
+
     if(use_tick_ipi == 0)
     {
         unit->timer_dev = timer;
@@ -692,98 +933,452 @@ void sched_yield(void)
    schedule();
 }
 
-void sched_wake_thread
+/* mark the thread as ready - the unit must be locked 
+ * returns 1 if the current thread of the unit was asked to reschedule
+ */
+static int sched_wake_locked
 (
-    struct sched_thread *th
+    struct sched_exec_unit *unit,
+    struct sched_thread    *th
 )
 {
-    uint8_t int_flag = 0;
+    int preempt = 0;
 
-    if(th != NULL)
-    {
-        spinlock_lock(&th->unit->lock);
-        spinlock_lock_int(&th->lock, &int_flag);
+    spinlock_lock(&th->lock);
 
+    /* a thread left in the wake list of this unit may have been
+     * moved by the load balancer since - the drain passes it on
+     */
+    if((th->unit == unit) && (~th->flags & THREAD_READY))
+    {
         th->flags |= THREAD_READY;
-       
-        /* put the thread back to the policy */
-        sched_enq(th->unit, th);
+   
+        /* if the thread did not get to block itself
+         * it is still in the queue of the policy
+         */
+        if(unit->current != th)
+        {
+            /* put the thread back to the policy */
+            sched_enq(unit, th);
 
-        spinlock_unlock(&th->unit->lock);
+            preempt = sched_should_preempt(unit, th);
 
-        spinlock_unlock_int(&th->lock, int_flag);
+            /* go through the scheduler to start the tick again */
+            if(__atomic_load_n(&unit->flags, __ATOMIC_RELAXED) & 
+               UNIT_TICK_STOPPED)
+            {
+                preempt = 1;
+            }
+
+            if(preempt && (unit->current != NULL))
+            {
+                unit->current->flags |= THREAD_NEED_RESCHEDULE;
+            }
+        }
     }
-}
 
+    spinlock_unlock(&th->lock);
 
-static uint32_t sched_timer_wake_thread
-(
-    struct timer *timer,
-    void *thread,
-    const void *isr
-)
-{
-//    kprintf("Waking up thread %x\n",thread);
-    sched_wake_thread(thread);
-    return(0);
+    return(preempt);
 }
 
-void sched_sleep
+/* wake up the threads queued by other CPUs - the unit must be locked */
+static void sched_wake_list_drain
 (
-    uint32_t delay
+    struct sched_exec_unit *unit
 )
 {
-    uint8_t int_status = 0;
-    struct timer tm;
-    struct time_spec timeout ={.seconds = delay / 1000ull,
-                          .nanosec = delay % 1000000ull
-                         };
-                         
-    struct sched_thread *self = NULL;
-    
-    if(delay == 0)
-    {
-        kprintf("NO DELAY\n");
-        return;
-    }
-    
-    self = sched_thread_self();
-    spinlock_lock_int(&self->lock, &int_status);
-    /* mark thread as sleeping if we have any delay specified*/
-    if(delay != 0)
-    {    
-        self->flags &= ~THREAD_READY;
-    }
+    struct sched_thread *list = NULL;
+    struct sched_thread *prev = NULL;
+    struct sched_thread *next = NULL;
+
+    list = __atomic_exchange_n(&unit->wake_list, NULL, __ATOMIC_ACQUIRE);
 
-    /* don't bother to add the thread to the timer if delay is WAIT_FOREVER */
-    if((delay != WAIT_FOREVER) && (delay != 0))
+    /* the list is built by pushing at the head so
+     * reverse it to wake the threads in order
+     */
+    while(list != NULL)
     {
-        timer_enqeue_static(NULL, 
-                            &timeout, 
-                            sched_timer_wake_thread, 
-                            self,
-                            TIMER_ONESHOT, 
-                            &tm);
+        next = list->wake_next;
+        list->wake_next = prev;
+        prev = list;
+        list = next;
     }
 
-    spinlock_unlock_int(&self->lock, int_status);
-    
-    /* ask the scheduler to put the thread to sleep */
-    schedule();
-    
-    /* If the delay is wait forever, then we did not push anything so
-     * don't look for a timer because there isn't one
-     */
-    if((delay != WAIT_FOREVER) && (delay != 0))
+    list = prev;
+
+    while(list != NULL)
     {
-        /* if we were woken up earlier, delete the timer from the timer queue*/
-        if(timer_dequeue(NULL, &tm))
+        next = list->wake_next;
+
+        /* from now on the thread can be queued again */
+        __atomic_store_n(&list->wake_pending, 0, __ATOMIC_RELEASE);
+
+        /* the thread was migrated after it was queued and may have
+         * blocked on its new unit - a waker that found it pending
+         * relies on this wake up so hand it to the new unit
+         */
+        if(list->unit != unit)
         {
-            kprintf("TIMER NO LONGER IN QUEUE\n");
+            sched_wake_thread(list);
         }
+        else
+        {
+            sched_wake_locked(unit, list);
+        }
+
+        list = next;
     }
 }
 
+/* position of the policy in the list - lower goes first */
+static uint32_t sched_policy_rank
+(
+    struct sched_policy *policy
+)
+{
+    struct list_node *ln = NULL;
+    uint32_t rank = 0;
+
+    rcu_read_lock();
+
+    ln = linked_list_first_rcu(&policies);
+
+    while((ln != NULL) && (ln != &policy->node))
+    {
+        rank++;
+        ln = linked_list_next_rcu(ln);
+    }
+
+    rcu_read_unlock();
+
+    return(rank);
+}
+
+/* check if th should run instead of the current thread of the unit 
+ * this is only a hint if the unit is not locked
+ */
+static int sched_should_preempt
+(
+    struct sched_exec_unit *unit,
+    struct sched_thread    *th
+)
+{
+    struct sched_thread *cur = NULL;
+
+    cur = __atomic_load_n(&unit->current, __ATOMIC_RELAXED);
+
+    if((cur == NULL) || (cur == &unit->idle))
+    {
+        return(1);
+    }
+
+    if(cur == th)
+    {
+        return(0);
+    }
+
+    if((cur->policy == NULL) || (th->policy == NULL))
+    {
+        return(0);
+    }
+
+    if(cur->policy == th->policy)
+    {
+        if(th->policy->check_preempt == NULL)
+        {
+            return(0);
+        }
+
+        return(th->policy->check_preempt(unit, cur, th) != 0);
+    }
+
+    return(sched_policy_rank(th->policy) < sched_policy_rank(cur->policy));
+}
+
+/* make the unit go through the scheduler 
+ * the interrupt is taken once the caller enables interrupts
+ */
+void sched_unit_kick
+(
+    struct sched_exec_unit *unit
+)
+{
+    if(unit == percpu_read(current_unit))
+    {
+        cpu_issue_ipi(IPI_DEST_SELF, 0, IPI_SCHED);
+    }
+    else
+    {
+        cpu_issue_ipi(IPI_DEST_NO_SHORTHAND, unit->cpu->cpu_id, IPI_SCHED);
+    }
+}
+
+void sched_wake_thread
+(
+    struct sched_thread *th
+)
+{
+    struct sched_exec_unit *unit = NULL;
+    struct sched_thread    *head = NULL;
+    struct sched_thread    *cur  = NULL;
+    uint8_t int_flag = 0;
+    int preempt = 0;
+
+    if(th == NULL)
+    {
+        return;
+    }
+
+    unit = __atomic_load_n(&th->unit, __ATOMIC_ACQUIRE);
+
+    if(unit == percpu_read(current_unit))
+    {
+        /* the thread can be moved to another unit by the 
+         * load balancer so make sure we locked the right one
+         */
+        while(1)
+        {
+            spinlock_lock_int(&unit->lock, &int_flag);
+
+            if(unit == th->unit)
+            {
+                break;
+            }
+
+            spinlock_unlock_int(&unit->lock, int_flag);
+            unit = __atomic_load_n(&th->unit, __ATOMIC_ACQUIRE);
+        }
+
+        preempt = sched_wake_locked(unit, th);
+
+        spinlock_unlock_int(&unit->lock, int_flag);
+
+        if(preempt)
+        {
+            sched_unit_kick(unit);
+        }
+
+        return;
+    }
+
+    /* remote unit - leave the thread in its wake list 
+     * instead of taking the lock of the unit
+     */
+    if(__atomic_exchange_n(&th->wake_pending, 1, __ATOMIC_ACQUIRE))
+    {
+        /* already in the list */
+        return;
+    }
+
+    head = __atomic_load_n(&unit->wake_list, __ATOMIC_RELAXED);
+
+    do
+    {
+        th->wake_next = head;
+    }while(!__atomic_compare_exchange_n(&unit->wake_list, 
+                                        &head, 
+                                        th, 
+                                        0, 
+                                        __ATOMIC_RELEASE, 
+                                        __ATOMIC_RELAXED));
+
+    /* the list is drained on the next tick unless 
+     * the unit has to switch to the thread right now
+     * or its tick is stopped
+     */
+    if(sched_should_preempt(unit, th) ||
+       (__atomic_load_n(&unit->flags, __ATOMIC_RELAXED) & UNIT_TICK_STOPPED))
+    {
+        cur = __atomic_load_n(&unit->current, __ATOMIC_RELAXED);
+
+        if(cur != NULL)
+        {
+            __atomic_or_fetch(&cur->flags, THREAD_NEED_RESCHEDULE, 
+                              __ATOMIC_RELEASE);
+        }
+
+        sched_unit_kick(unit);
+    }
+}
+
+
+static uint32_t sched_timer_wake_thread
+(
+    struct timer *timer,
+    void *thread,
+    const void *isr
+)
+{
+//    kprintf("Waking up thread %x\n",thread);
+    sched_wake_thread(thread);
+    return(0);
+}
+
+/*
+ * sched_sleep_timeout - block the current thread for ns nanoseconds
+ * or until it is woken up. WAIT_FOREVER_NS only waits for the wake up.
+ * If lock is given it is released once the thread is marked as
+ * sleeping so a wake up issued under that lock cannot be missed.
+ * Returns 1 if the thread was woken up before the timeout
+ */
+
+static int sched_sleep_timeout
+(
+    struct spinlock *lock,
+    uint8_t          lock_int,
+    uint64_t         ns
+)
+{
+    uint8_t int_status = 0;
+    struct timer tm;
+    struct time_spec timeout;
+    struct sched_thread *self = NULL;
+    int status = 0;
+    
+    self = sched_thread_self();
+    spinlock_lock_int(&self->lock, &int_status);
+
+    /* mark thread as sleeping */
+    self->flags &= ~THREAD_READY;
+
+    /* don't bother to add the thread to the timer if we wait forever */
+    if(ns != WAIT_FOREVER_NS)
+    {
+        timeout.seconds = ns / TIMER_RESOLUTION_NS;
+        timeout.nanosec = ns % TIMER_RESOLUTION_NS;
+
+        timer_enqeue_slack(NULL, 
+                           &timeout, 
+                           self->timer_slack,
+                           sched_timer_wake_thread, 
+                           self,
+                           TIMER_ONESHOT, 
+                           &tm);
+    }
+
+    spinlock_unlock_int(&self->lock, int_status);
+
+    if(lock != NULL)
+    {
+        spinlock_unlock_int(lock, lock_int);
+    }
+    
+    /* ask the scheduler to put the thread to sleep */
+    schedule();
+    
+    /* if we were woken up earlier, delete the timer from the timer queue */
+    if(ns != WAIT_FOREVER_NS)
+    {
+        if((timer_dequeue(NULL, &tm) == 0) && 
+           (~tm.flags & TIMER_PROCESSED))
+        {
+            status = 1;
+        }
+    }
+
+    return(status);
+}
+
+void sched_sleep
+(
+    uint32_t delay
+)
+{
+    if(delay == 0)
+    {
+        kprintf("NO DELAY\n");
+        return;
+    }
+
+    if(delay == WAIT_FOREVER)
+    {
+        sched_sleep_timeout(NULL, 0, WAIT_FOREVER_NS);
+    }
+    else
+    {
+        sched_sleep_timeout(NULL, 0, (uint64_t)delay * 1000000ull);
+    }
+}
+
+/*
+ * sched_sleep_ns - sleep for ns nanoseconds or until woken up if ns is
+ * WAIT_FOREVER_NS. The sleep may be extended by the timer slack of the 
+ * thread. Returns 1 if the thread was woken up earlier, 0 otherwise
+ */
+
+int sched_sleep_ns
+(
+    uint64_t ns
+)
+{
+    if(ns == 0)
+    {
+        return(0);
+    }
+
+    return(sched_sleep_timeout(NULL, 0, ns));
+}
+
+/*
+ * sched_sleep_unlock - release lock and block the current thread
+ * The lock must have been taken with spinlock_lock_int and int_state
+ * is the state it returned. Returns 1 if woken up before the timeout.
+ */
+
+int sched_sleep_unlock
+(
+    struct spinlock *lock,
+    uint8_t          int_state,
+    uint64_t         ns
+)
+{
+    return(sched_sleep_timeout(lock, int_state, ns));
+}
+
+/*
+ * sched_sleep_until - sleep until the monotonic clock reaches deadline_ns
+ */
+
+int sched_sleep_until
+(
+    uint64_t deadline_ns
+)
+{
+    uint64_t now = 0;
+
+    now = clock_monotonic_ns();
+
+    if(deadline_ns <= now)
+    {
+        return(0);
+    }
+
+    return(sched_sleep_timeout(NULL, 0, deadline_ns - now));
+}
+
+/*
+ * sched_thread_timer_slack_set - set how late the timed sleeps of th may
+ * be woken up. A latency sensitive thread uses 0 while a background
+ * thread uses a larger slack so its wake ups are batched with others.
+ */
+
+int sched_thread_timer_slack_set
+(
+    struct sched_thread *th,
+    uint64_t             slack_ns
+)
+{
+    if(th == NULL)
+    {
+        return(-1);
+    }
+
+    __atomic_store_n(&th->timer_slack, slack_ns, __ATOMIC_RELAXED);
+
+    return(0);
+}
+
 
 /* time tracking - called from the interrupt context */
 static uint32_t sched_tick
@@ -799,9 +1394,44 @@ static uint32_t sched_tick
     uint8_t preempt = 0;
     unit = pv_unit;
 
+    /* expire the timers of this CPU - their callbacks may wake 
+     * threads on this unit so do it before locking it
+     */
+    timer_cpu_tick(step, isr_inf);
+
     /* lock the unit */
     spinlock_lock(&unit->lock);
 
+    seqcount_write_begin(&unit->stats_seq);
+
+    unit->tick_ns   = (uint64_t)step->seconds * TIMER_RESOLUTION_NS + 
+                      step->nanosec;
+    unit->clock_ns += unit->tick_ns;
+
+    /* a tick of a stopped periodic tick can cover many ticks */
+    if(__atomic_load_n(&unit->flags, __ATOMIC_RELAXED) & UNIT_TICK_STOPPED)
+    {
+        unit->ticks += (unit->tick_ns + SCHED_TICK_NS - 1) / SCHED_TICK_NS;
+    }
+    else
+    {
+        unit->ticks++;
+        unit->tick_period_ns = unit->tick_ns;
+    }
+
+    seqcount_write_end(&unit->stats_seq);
+
+    sched_wake_list_drain(unit);
+
+    /* ask for periodic load balancing */
+    if(unit->ticks >= unit->next_balance)
+    {
+        unit->next_balance = unit->ticks + SCHED_BALANCE_INTERVAL;
+
+        __atomic_or_fetch(&unit->flags, UNIT_BALANCE_PENDING, 
+                          __ATOMIC_RELAXED);
+    }
+
     th = unit->current;
 
     if(th != NULL)
@@ -814,31 +1444,241 @@ static uint32_t sched_tick
             }
         }
 
-        if(resched)
+        if(resched)
+        {
+            preempt = sched_preemption_enabled(unit);
+
+            if(preempt)
+            {
+                th->flags |= THREAD_NEED_RESCHEDULE;
+            }
+        }
+
+        /* the one-shot timer has to be armed again */
+        if(__atomic_load_n(&unit->flags, __ATOMIC_RELAXED) & UNIT_TICK_STOPPED)
+        {
+            sched_tick_update(unit, th);
+        }
+    }
+
+    /* all good, unlock the unit */
+    spinlock_unlock(&unit->lock);
+
+    return(0);
+    
+}
+
+/*
+ * sched_tick_update - stop the periodic tick if nothing needs it
+ * When the unit is idle or runs a single thread the timer is put in
+ * one-shot mode and armed for the next periodic balancing or the next
+ * timer of the CPU, whichever comes first.
+ * Must be called on the CPU of the unit with the unit locked.
+ */
+
+static void sched_tick_update
+(
+    struct sched_exec_unit *unit,
+    struct sched_thread    *next
+)
+{
+    struct timer_api *funcs  = NULL;
+    struct time_spec  ts;
+    uint64_t          ns     = 0;
+    uint64_t          tm_ns  = 0;
+    uint32_t          flags  = 0;
+    int               stop   = 0;
+
+    if(unit->timer_dev == NULL)
+    {
+        return;
+    }
+
+    funcs = devmgr_dev_api_get(unit->timer_dev);
+
+    if((funcs == NULL) || (funcs->set_mode == NULL) || (funcs->set_timer == NULL))
+    {
+        return;
+    }
+
+    if(next == &unit->idle)
+    {
+        stop = 1;
+    }
+    else if((next != NULL)                                     && 
+            (__atomic_load_n(&unit->nr_ready, __ATOMIC_RELAXED) == 1) && 
+            (__atomic_load_n(&unit->wake_list, __ATOMIC_RELAXED) == NULL) &&
+            (next->policy != NULL)                             &&
+            (next->policy->id != sched_edf_policy))
+    {
+        /* nobody to share the CPU with - EDF still needs 
+         * the tick for its budget accounting
+         */
+        stop = 1;
+    }
+
+    flags = __atomic_load_n(&unit->flags, __ATOMIC_RELAXED);
+
+    if(stop)
+    {
+        if(unit->next_balance > unit->ticks)
+        {
+            ns = (unit->next_balance - unit->ticks) * SCHED_TICK_NS;
+        }
+        else
+        {
+            ns = SCHED_TICK_NS;
+        }
+
+        /* wake up earlier for the timers of this CPU */
+        if((timer_cpu_next_event(&tm_ns) == 0) && (tm_ns < ns))
+        {
+            ns = tm_ns;
+        }
+
+        ts.seconds = ns / TIMER_RESOLUTION_NS;
+        ts.nanosec = ns % TIMER_RESOLUTION_NS;
+
+        if(~flags & UNIT_TICK_STOPPED)
+        {
+            funcs->set_mode(unit->timer_dev, TIMER_ONESHOT);
+            __atomic_or_fetch(&unit->flags, UNIT_TICK_STOPPED, __ATOMIC_RELAXED);
+        }
+
+        funcs->set_timer(unit->timer_dev, &ts);
+    }
+    else if(flags & UNIT_TICK_STOPPED)
+    {
+        __atomic_and_fetch(&unit->flags, ~UNIT_TICK_STOPPED, __ATOMIC_RELAXED);
+        funcs->set_mode(unit->timer_dev, TIMER_PERIODIC);
+    }
+}
+
+/*
+ * sched_thread_prio_update - apply the effective priority of a thread
+ * The effective priority is the higher one of the base and the inherited
+ * priorities. A queued thread is moved by its policy and may preempt
+ * the current thread of its unit.
+ */
+
+static void sched_thread_prio_update
+(
+    struct sched_thread *th
+)
+{
+    struct sched_exec_unit *unit = NULL;
+    uint16_t old_prio = 0;
+    uint16_t prio = 0;
+    uint8_t int_flag = 0;
+    int queued = 0;
+    int preempt = 0;
+
+    unit = __atomic_load_n(&th->unit, __ATOMIC_ACQUIRE);
+
+    /* lock the unit the thread is on - it might be moved meanwhile */
+    while(unit != NULL)
+    {
+        spinlock_lock_int(&unit->lock, &int_flag);
+
+        if(unit == th->unit)
+        {
+            break;
+        }
+
+        spinlock_unlock_int(&unit->lock, int_flag);
+        unit = __atomic_load_n(&th->unit, __ATOMIC_ACQUIRE);
+    }
+
+    if(unit == NULL)
+    {
+        spinlock_lock_int(&th->lock, &int_flag);
+    }
+    else
+    {
+        spinlock_lock(&th->lock);
+    }
+
+    prio = th->base_prio;
+
+    if(th->pi_prio < prio)
+    {
+        prio = th->pi_prio;
+    }
+
+    old_prio = th->prio;
+    th->prio = prio;
+
+    if((unit != NULL) && (old_prio != prio))
+    {
+        /* a thread about to block is still queued while it is current */
+        queued = (th->flags & THREAD_READY) || (unit->current == th);
+
+        if(queued && (th->policy != NULL) && 
+           (th->policy->prio_changed != NULL))
         {
-            preempt = sched_preemption_enabled(unit);
+            th->policy->prio_changed(unit, th, old_prio);
+        }
 
-            if(preempt)
-            {
-                th->flags |= THREAD_NEED_RESCHEDULE;
-            }
+        if(queued && (unit->current != th) && (unit->current != NULL) &&
+           sched_should_preempt(unit, th))
+        {
+            unit->current->flags |= THREAD_NEED_RESCHEDULE;
+            preempt = 1;
         }
     }
 
-    /* all good, unlock the unit */
-    spinlock_unlock(&unit->lock);
+    if(unit == NULL)
+    {
+        spinlock_unlock_int(&th->lock, int_flag);
+        return;
+    }
 
-    return(0);
-    
+    spinlock_unlock(&th->lock);
+    spinlock_unlock_int(&unit->lock, int_flag);
+
+    if(preempt)
+    {
+        sched_unit_kick(unit);
+    }
 }
 
+/* sched_thread_set_priority - change the base priority of a thread */
+
 void sched_thread_set_priority
 (
     struct sched_thread *th, 
     uint16_t prio
 )
 {
+    if((th == NULL) || (prio > SCHED_MAX_PRIORITY))
+    {
+        return;
+    }
+
+    th->base_prio = prio;
+
+    sched_thread_prio_update(th);
+}
+
+/* 
+ * sched_thread_inherit_priority - set the priority a thread inherits
+ * from the waiters of its mutexes, SCHED_PRIO_NONE drops it
+ */
+
+void sched_thread_inherit_priority
+(
+    struct sched_thread *th,
+    uint16_t pi_prio
+)
+{
+    if(th == NULL)
+    {
+        return;
+    }
 
+    th->pi_prio = pi_prio;
+
+    sched_thread_prio_update(th);
 }
 
 /******************************************************************************/
@@ -848,7 +1688,6 @@ static void *sched_idle_thread
 )
 {
     struct sched_exec_unit *unit       = NULL;
-    struct timer_api        *func      = NULL;
     unit = (struct sched_exec_unit*)pv;
 
     kprintf("Entered idle loop on %d UNIT ID 0x%x\n", unit->cpu->cpu_id, unit);
@@ -857,28 +1696,14 @@ static void *sched_idle_thread
      * so that the BSP can continue waking up other cores
      */
 
-    cpu_signal_on(unit->cpu->cpu_id);
-#if 1
-    /* When entering the idle loop, disable the timer
-     * for the AP CPU as currently it does not have anything
-     * to handle
-     */ 
-
-    if(unit->cpu->cpu_id > 0)
-    {
-        #if 0
-        func = devmgr_dev_api_get(unit->timer_dev);
-
-        if((func != NULL) && (func->disable != NULL))
-        {
-            func->disable(unit->timer_dev);
-        }
-        #endif
-    }
-#endif
+    cpu_signal_on();
 
+    /* the periodic tick is stopped by the scheduler while
+     * we are here so halting really idles the CPU
+     */
     while(1)
     {
+        rcu_quiescent();
         cpu_halt();
     }
 
@@ -970,6 +1795,9 @@ static int32_t sched_put_prev
 {
     int32_t status = -1;
 
+    /* the thread is giving up the CPU so the request is served */
+    th->flags &= ~THREAD_NEED_RESCHEDULE;
+
     if((th->policy != NULL) && 
        (th->policy->put_prev != NULL))
     {
@@ -996,6 +1824,11 @@ static int32_t sched_enq
         status = th->policy->enqueue(unit, th);
     }
 
+    if(status == 0)
+    {
+        __atomic_add_fetch(&unit->nr_ready, 1, __ATOMIC_RELAXED);
+    }
+
     return(status);
 }
 
@@ -1015,6 +1848,11 @@ static int32_t sched_deq
         status = th->policy->dequeue(unit, th);
     }
 
+    if(status == 0)
+    {
+        __atomic_sub_fetch(&unit->nr_ready, 1, __ATOMIC_RELAXED);
+    }
+
     return(status);
 }
 
@@ -1027,13 +1865,12 @@ static int32_t sched_pick_next
     struct sched_thread *next = NULL;
     struct list_node *pn = NULL;
     struct sched_policy *policy = NULL;
-    uint8_t int_sts = 0;
     int32_t status = -1;
 
-    spinlock_read_lock_int(&policies_lock, &int_sts);
+    rcu_read_lock();
 
     /* find a policy that has something ready t run */
-    pn = linked_list_first(&policies);
+    pn = linked_list_first_rcu(&policies);
 
     while(pn != NULL)
     {
@@ -1049,10 +1886,10 @@ static int32_t sched_pick_next
             }
         }
 
-        pn = linked_list_next(pn);
+        pn = linked_list_next_rcu(pn);
     }
 
-    spinlock_read_unlock_int(&policies_lock, int_sts);
+    rcu_read_unlock();
 
     if(status == 0)
     {
@@ -1103,26 +1940,388 @@ static void  sched_block_thread
     sched_deq(unit, th);   
 }
 
+/* number of threads that would still be runnable on the unit */
+static uint32_t sched_unit_load
+(
+    struct sched_exec_unit *unit
+)
+{
+    struct sched_thread *th = NULL;
+    uint32_t load = 0;
+
+    load = __atomic_load_n(&unit->nr_ready, __ATOMIC_RELAXED);
+    th   = __atomic_load_n(&unit->current,  __ATOMIC_RELAXED);
+
+    /* the current thread is about to block so don't count it */
+    if((th != NULL) && (load > 0) && (~th->flags & THREAD_READY))
+    {
+        load--;
+    }
+
+    return(load);
+}
+
+static int sched_balance_needed
+(
+    struct sched_exec_unit *unit
+)
+{
+    if(__atomic_load_n(&unit->flags, __ATOMIC_RELAXED) & UNIT_BALANCE_PENDING)
+    {
+        return(1);
+    }
+
+    /* about to go idle - try to steal some work */
+    return(sched_unit_load(unit) == 0);
+}
+
+int sched_can_migrate
+(
+    struct sched_exec_unit *src,
+    struct sched_exec_unit *dst,
+    struct sched_thread    *th
+)
+{
+    /* never touch the thread that is running */
+    if(src->current == th)
+    {
+        return(0);
+    }
+
+    if(th->flags & THREAD_DEAD)
+    {
+        return(0);
+    }
+
+    if(!sched_unit_allowed(dst, th))
+    {
+        return(0);
+    }
+
+    /* the thread has just ran so its data is still in the cache */
+    if(src->ticks - th->last_run < SCHED_CACHE_HOT_TICKS)
+    {
+        return(0);
+    }
+
+    return(1);
+}
+
+/*
+ * sched_find_busiest_unit - find the unit to pull threads from
+ * The closest domain with enough imbalance wins so threads are moved
+ * between SMT siblings and cores of a package before crossing a 
+ * package or a NUMA node.
+ */
+
+static struct sched_exec_unit *sched_find_busiest_unit
+(
+    struct sched_exec_unit *dst
+)
+{
+    struct list_node       *ln      = NULL;
+    struct sched_exec_unit *cursor  = NULL;
+    struct sched_exec_unit *busiest[SCHED_DOMAIN_LEVELS] = {NULL};
+    uint32_t max_load[SCHED_DOMAIN_LEVELS] = {0};
+    uint32_t dst_load = 0;
+    uint32_t load     = 0;
+    uint32_t level    = 0;
+    uint8_t  int_sts  = 0;
+
+    dst_load = sched_unit_load(dst);
+
+    brlock_read_lock_int(&units_lock, &int_sts);
+
+    ln = linked_list_first(&units);
+
+    while(ln)
+    {
+        cursor = (struct sched_exec_unit*)ln;
+
+        if(cursor != dst)
+        {
+            load  = sched_unit_load(cursor);
+            level = sched_domain_level(dst, cursor);
+
+            /* only move threads if the imbalance is worth it */
+            if((load > dst_load + sched_domain_imbalance[level]) &&
+               (load > max_load[level]))
+            {
+                max_load[level] = load;
+                busiest[level]  = cursor;
+            }
+        }
+
+        ln = linked_list_next(ln);
+    }
+
+    brlock_read_unlock_int(&units_lock, int_sts);
+
+    for(level = 0; level < SCHED_DOMAIN_LEVELS; level++)
+    {
+        if(busiest[level] != NULL)
+        {
+            return(busiest[level]);
+        }
+    }
+
+    return(NULL);
+}
+
+static int32_t sched_pick_migrate
+(
+    struct sched_exec_unit *src,
+    struct sched_exec_unit *dst,
+    struct sched_thread   **th
+)
+{
+    struct list_node    *pn     = NULL;
+    struct sched_policy *policy = NULL;
+    int32_t status  = -1;
+
+    rcu_read_lock();
+
+    pn = linked_list_first_rcu(&policies);
+
+    while(pn != NULL)
+    {
+        policy = (struct sched_policy*)pn;
+
+        if(policy->select_migrate != NULL)
+        {
+            status = policy->select_migrate(src, dst, th);
+
+            if(status == 0)
+            {
+                break;
+            }
+        }
+
+        pn = linked_list_next_rcu(pn);
+    }
+
+    rcu_read_unlock();
+
+    return(status);
+}
+
+/* both units must be locked by the caller */
+static int32_t sched_migrate_thread
+(
+    struct sched_exec_unit *src,
+    struct sched_exec_unit *dst,
+    struct sched_thread    *th
+)
+{
+    int32_t status = -1;
+
+    spinlock_lock(&th->lock);
+
+    if(sched_deq(src, th) == 0)
+    {
+        linked_list_remove(&src->unit_threads, &th->unit_node);
+        linked_list_add_head(&dst->unit_threads, &th->unit_node);
+
+        /* keep the age of the thread relative to the new unit */
+        th->last_run = dst->ticks - (src->ticks - th->last_run);
+
+        __atomic_store_n(&th->unit, dst, __ATOMIC_RELEASE);
+
+        status = sched_enq(dst, th);
+
+        seqcount_write_begin(&src->stats_seq);
+        src->migrations_out++;
+        seqcount_write_end(&src->stats_seq);
+
+        seqcount_write_begin(&dst->stats_seq);
+        dst->migrations_in++;
+        seqcount_write_end(&dst->stats_seq);
+    }
+
+    spinlock_unlock(&th->lock);
+
+    return(status);
+}
+
+/*
+ * sched_balance - pull threads from the busiest unit to dst
+ */
+
+static int32_t sched_balance
+(
+    struct sched_exec_unit *dst
+)
+{
+    struct sched_exec_unit *src    = NULL;
+    struct sched_exec_unit *first  = NULL;
+    struct sched_exec_unit *second = NULL;
+    struct sched_thread    *th     = NULL;
+    uint32_t src_load = 0;
+    uint32_t dst_load = 0;
+    uint32_t to_move  = 0;
+    uint32_t moved    = 0;
+    uint8_t  int_flag = 0;
+
+    __atomic_and_fetch(&dst->flags, ~UNIT_BALANCE_PENDING, __ATOMIC_RELAXED);
+
+    src = sched_find_busiest_unit(dst);
+
+    if(src == NULL)
+    {
+        return(0);
+    }
+
+    /* lock the units in the same order on every CPU */
+    if(src < dst)
+    {
+        first  = src;
+        second = dst;
+    }
+    else
+    {
+        first  = dst;
+        second = src;
+    }
+
+    spinlock_lock_int(&first->lock, &int_flag);
+    spinlock_lock(&second->lock);
+
+    /* the load might have changed until we got the locks */
+    src_load = sched_unit_load(src);
+    dst_load = sched_unit_load(dst);
+
+    if(src_load > dst_load + 1)
+    {
+        to_move = (src_load - dst_load) / 2;
+    }
+
+    while(moved < to_move)
+    {
+        if(sched_pick_migrate(src, dst, &th) != 0)
+        {
+            break;
+        }
+
+        if(sched_migrate_thread(src, dst, th) != 0)
+        {
+            break;
+        }
+
+        moved++;
+    }
+
+    spinlock_unlock(&second->lock);
+    spinlock_unlock_int(&first->lock, int_flag);
+
+    return(moved);
+}
+
+/*
+ * sched_unit_stats_get - take a snapshot of the statistics of a unit
+ * The unit is not locked and its cache lines are only read.
+ */
+
+int sched_unit_stats_get
+(
+    struct sched_exec_unit  *unit,
+    struct sched_unit_stats *stats
+)
+{
+    uint32_t seq = 0;
+
+    if((unit == NULL) || (stats == NULL))
+    {
+        return(-1);
+    }
+
+    do
+    {
+        seq = seqcount_read_begin(&unit->stats_seq);
+
+        stats->ticks          = unit->ticks;
+        stats->clock_ns       = unit->clock_ns;
+        stats->tick_ns        = unit->tick_ns;
+        stats->migrations_in  = unit->migrations_in;
+        stats->migrations_out = unit->migrations_out;
+    }while(seqcount_read_retry(&unit->stats_seq, seq));
+
+    /* kept up to date atomically by the enqueue and dequeue paths */
+    stats->nr_ready = __atomic_load_n(&unit->nr_ready, __ATOMIC_RELAXED);
+
+    return(0);
+}
+
+void sched_show_units
+(
+    void
+)
+{
+    uint8_t int_sts = 0;
+    struct list_node *ln = NULL;
+    struct sched_exec_unit *unit = NULL;
+    struct sched_unit_stats stats;
+
+    brlock_read_lock_int(&units_lock, &int_sts);
+
+    ln = linked_list_first(&units);
+
+    while(ln)
+    {
+        unit = (struct sched_exec_unit*)ln;
+
+        sched_unit_stats_get(unit, &stats);
+
+        kprintf("UNIT %d CORE %d PACKAGE %d NODE %d "
+                "READY %d MIGRATIONS IN %d OUT %d TICKS %d\n",
+                unit->cpu->cpu_id,
+                unit->domain_id[SCHED_DOMAIN_SMT],
+                unit->domain_id[SCHED_DOMAIN_PACKAGE],
+                unit->domain_id[SCHED_DOMAIN_NUMA],
+                stats.nr_ready,
+                stats.migrations_in,
+                stats.migrations_out,
+                stats.ticks);
+
+        ln = linked_list_next(ln);
+    }
+
+    brlock_read_unlock_int(&units_lock, int_sts);
+}
+
 static void sched_main(void)
 {
-    struct cpu             *cpu     = NULL;
     struct sched_exec_unit *unit    = NULL;
     struct sched_thread    *next_th = NULL;
     struct sched_thread    *prev_th = NULL;
     uint8_t           int_flag = 0;
 
-    cpu    = cpu_current_get();
-    unit   = cpu->sched;
+    unit   = percpu_read(current_unit);
     
     if(sched_preemption_enabled(unit))
     {
+        /* we are switching so this CPU holds no RCU references */
+        rcu_quiescent();
+
+        /* pull threads from other units if we are 
+         * running out of work or if it's time to balance
+         */
+        if(sched_balance_needed(unit))
+        {
+            sched_balance(unit);
+        }
+
         /* Lock the execution unit */
         spinlock_lock_int(&unit->lock, &int_flag);
 
+        /* wake up the threads before we decide if prev blocks */
+        sched_wake_list_drain(unit);
+
         prev_th = unit->current;
 
        if(prev_th != NULL)
         {
+            prev_th->last_run = unit->ticks;
+
             if(~prev_th->flags & THREAD_READY)
             {
                 sched_block_thread(unit, prev_th);
@@ -1130,12 +2329,21 @@ static void sched_main(void)
         }
 
         sched_next_thread(unit, prev_th, &next_th);
+
+        /* stop or restart the periodic tick for the next thread */
+        sched_tick_update(unit, next_th);
     
         unit->current = next_th;
+        percpu_write(current_thread, next_th);
 
         /* Switch context */
         sched_context_switch(prev_th, next_th);
 
+        /* The thread might have been moved to another unit while 
+         * it was switched out so unlock the unit that switched to it
+         */
+        unit = percpu_read(current_unit);
+
         /* Unlock unit */
         spinlock_unlock_int(&unit->lock, int_flag);
     }
@@ -3,6 +3,16 @@
 #include <linked_list.h>
 #include <sched.h>
 #include <semaphore.h>
+#include <clock.h>
+#include <wait_queue.h>
+#include <lockstat.h>
+
+static int sem_acquire_caller
+(
+    struct sem *sem, 
+    uint64_t timeout_ns,
+    uintptr_t caller
+);
 
 struct sem *sem_init
 (
@@ -17,12 +27,11 @@ struct sem *sem_init
     }
     
     sem->max_count = max_count;
+    sem->wakeups   = 0;
 
-    __atomic_store_n(&sem->count, init_val, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&sem->count, (int64_t)init_val, __ATOMIC_SEQ_CST);
 
-    linked_list_init(&sem->pendq);
-
-    spinlock_init(&sem->lock);
+    wait_queue_init(&sem->wq);
 
     return(sem);
 }
@@ -55,115 +64,208 @@ int sem_acquire
     uint32_t wait_ms
 )
 {
-    uint8_t         int_state = 0;
-    struct sched_thread *thread = NULL;
-    uint32_t        looped = 0;
+    if(wait_ms == WAIT_FOREVER)
+    {
+        return(sem_acquire_caller(sem, WAIT_FOREVER_NS, LOCKSTAT_CALLER));
+    }
+
+    return(sem_acquire_caller(sem, 
+                              (uint64_t)wait_ms * 1000000ull, 
+                              LOCKSTAT_CALLER));
+}
+
+/* sem_try_acquire - take a unit of the count if one is available */
+
+static int sem_try_acquire
+(
+    struct sem *sem
+)
+{
+    int64_t count = 0;
+
+    count = __atomic_load_n(&sem->count, __ATOMIC_RELAXED);
+
+    while(count > 0)
+    {
+        if(__atomic_compare_exchange_n(&sem->count,
+                                       &count,
+                                       count - 1,
+                                       0,
+                                       __ATOMIC_ACQUIRE,
+                                       __ATOMIC_RELAXED))
+        {
+            return(0);
+        }
+    }
+
+    return(-1);
+}
+
+/*
+ * sem_acquire_timeout - wait at most timeout_ns for the semaphore
+ * NO_WAIT only tries to take it and WAIT_FOREVER_NS never times out.
+ * The count is taken with a single atomic decrement. If it went
+ * negative, the thread waits for a release that is meant for it - 
+ * either a direct wake-up or one recorded in wakeups if the release
+ * came before the thread got in the queue.
+ */
+
+int sem_acquire_timeout
+(
+    struct sem *sem, 
+    uint64_t timeout_ns
+)
+{
+    return(sem_acquire_caller(sem, timeout_ns, LOCKSTAT_CALLER));
+}
+
+/* sem_acquire_caller - caller is the call site for the lock statistics */
+
+static int sem_acquire_caller
+(
+    struct sem *sem, 
+    uint64_t timeout_ns,
+    uintptr_t caller
+)
+{
+    uint8_t         int_state  = 0;
+    struct wait_queue_entry we;
+    int64_t         count      = 0;
+    uint64_t        wait_start = 0;
+    int             status     = 0;
 
     if(sem == NULL)
     {
         return(-1);
     }
 
-    spinlock_lock_int(&sem->lock, &int_state);
+    if(timeout_ns == NO_WAIT)
+    {
+        status = sem_try_acquire(sem);
 
-    /* If we have the semaphore full, allow the task to continue 
-     * Otherwise, we will need to block the task
-     */
-    
-    if(__atomic_load_n(&sem->count, __ATOMIC_SEQ_CST) > 0)
+        if(status == 0)
+        {
+            lockstat_acquired(sem, LOCKSTAT_SEM, 0, caller);
+        }
+
+        return(status);
+    }
+
+    if(__atomic_fetch_sub(&sem->count, 1, __ATOMIC_ACQUIRE) > 0)
     {
-        __atomic_sub_fetch(&sem->count, 1, __ATOMIC_SEQ_CST);
-        spinlock_unlock_int(&sem->lock, int_state);
+        lockstat_acquired(sem, LOCKSTAT_SEM, 0, caller);
         return(0);
     }
 
-    thread = sched_thread_self();
+    wait_start = lockstat_now();
 
-    /* We will be able to acquire the semaphore here */
-    while(__atomic_load_n(&sem->count, __ATOMIC_SEQ_CST) < 1)
+    spinlock_lock_int(&sem->wq.lock, &int_state);
+
+    /* the release has already been here */
+    if(sem->wakeups > 0)
     {
-        /* if we looped already, then we timed out in case we had a timer
-         * therefore, just exit
+        sem->wakeups--;
+        spinlock_unlock_int(&sem->wq.lock, int_state);
+        lockstat_acquired(sem, LOCKSTAT_SEM, wait_start, caller);
+        return(0);
+    }
+
+    wait_queue_add(&sem->wq, &we, WAIT_QUEUE_EXCLUSIVE);
+
+    status = wait_queue_sleep(&sem->wq, &we, timeout_ns, &int_state);
+
+    if(status != 0)
+    {
+        count = __atomic_load_n(&sem->count, __ATOMIC_RELAXED);
+
+        /* give back our place in the count unless a release
+         * already accounted for us
          */
-        if(looped > 0)
+        while(count < 0)
         {
-            spinlock_unlock_int(&sem->lock, int_state);
-            return(-1);
+            if(__atomic_compare_exchange_n(&sem->count,
+                                           &count,
+                                           count + 1,
+                                           0,
+                                           __ATOMIC_RELAXED,
+                                           __ATOMIC_RELAXED))
+            {
+                break;
+            }
         }
 
-        /* if we are not waiting forever, set the looped flag so
-         * we are  exiting on the next iteration
-         */
-        if(wait_ms != WAIT_FOREVER)
+        if(count < 0)
         {
-            looped = 1;
+            wait_queue_remove(&sem->wq, &we);
         }
-
-        if(wait_ms == NO_WAIT)
+        else
         {
-            spinlock_unlock_int(&sem->lock, int_state);
-            return(-1);
+            /* every waiter has a release coming - wait for ours */
+            status = wait_queue_sleep(&sem->wq, 
+                                      &we, 
+                                      WAIT_FOREVER_NS, 
+                                      &int_state);
         }
-
-        /* Add it to the semaphore pend queue */
-        linked_list_add_tail(&sem->pendq, &thread->pend_node); 
-
-        /* release the semaphore spinlock */
-        spinlock_unlock_int(&sem->lock, int_state);
-
-        /* sleep */
-        sched_sleep(wait_ms);
-
-        /* once the thread is woken up, it would lock again the semaphore */
-        spinlock_lock_int(&sem->lock, &int_state);
-
-        /* remove the thread from the pend queue */
-        linked_list_remove(&sem->pendq, &thread->pend_node);
     }
     
-    __atomic_sub_fetch(&sem->count, 1, __ATOMIC_SEQ_CST);
-    
-    spinlock_unlock_int(&sem->lock, int_state);
+    spinlock_unlock_int(&sem->wq.lock, int_state);
 
-    return(0);
+    if(status == 0)
+    {
+        lockstat_acquired(sem, LOCKSTAT_SEM, wait_start, caller);
+    }
+
+    return(status);
 }
 
+/*
+ * sem_release - release a unit of the semaphore
+ * The count is raised with a single atomic operation and the wait
+ * queue is locked only if the count was negative.
+ */
+
 int sem_release
 (
     struct sem *sem
 )
 {
     uint8_t           int_state  = 0;
-    struct sched_thread    *thread    = NULL;
-    struct list_node       *pend_node = NULL;
+    int64_t           count      = 0;
     
     if(sem == NULL)
     {
         return(-1);
     }
-    
 
-    spinlock_lock_int(&sem->lock, &int_state);
+    count = __atomic_load_n(&sem->count, __ATOMIC_RELAXED);
 
-    if(__atomic_load_n(&sem->count, __ATOMIC_SEQ_CST) < sem->max_count)
+    do
     {
-        __atomic_add_fetch(&sem->count, 1, __ATOMIC_SEQ_CST);
-    }
-
-    /* Get the first pending task */
-    pend_node = linked_list_first(&sem->pendq);
-
-    if(pend_node == NULL)
+        if(count >= (int64_t)sem->max_count)
+        {
+            return(0);
+        }
+    }while(!__atomic_compare_exchange_n(&sem->count,
+                                        &count,
+                                        count + 1,
+                                        0,
+                                        __ATOMIC_RELEASE,
+                                        __ATOMIC_RELAXED));
+
+    if(count >= 0)
     {
-        spinlock_unlock_int(&sem->lock, int_state);
         return(0);
     }
+    
+    spinlock_lock_int(&sem->wq.lock, &int_state);
 
-    thread = PEND_NODE_TO_THREAD(pend_node);
+    /* hand the count to the first waiter, if it made it to the queue */
+    if(wait_queue_wake_one(&sem->wq) == NULL)
+    {
+        sem->wakeups++;
+    }
 
-    sched_wake_thread(thread);
-    
-    spinlock_unlock_int(&sem->lock, int_state);
+    spinlock_unlock_int(&sem->wq.lock, int_state);
 
     return(0);
-}
\ No newline at end of file
+}
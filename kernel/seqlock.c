@@ -0,0 +1,133 @@
+/*
+ * Sequence counter and sequence lock
+ */
+
+#include <defs.h>
+#include <seqlock.h>
+#include <platform.h>
+
+void seqcount_init
+(
+    struct seqcount *s
+)
+{
+    __atomic_store_n(&s->seq, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * seqcount_read_begin - start a read section
+ * Waits for a writer in progress and returns the sequence to be
+ * passed to seqcount_read_retry.
+ */
+
+uint32_t seqcount_read_begin
+(
+    const struct seqcount *s
+)
+{
+    uint32_t seq = 0;
+
+    while((seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE)) & 1)
+    {
+        cpu_pause();
+    }
+
+    return(seq);
+}
+
+/* seqcount_read_retry - tell if the data read since begin may be torn */
+
+int seqcount_read_retry
+(
+    const struct seqcount *s,
+    uint32_t seq
+)
+{
+    /* the reads of the data must not move past the check */
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    return(__atomic_load_n(&s->seq, __ATOMIC_RELAXED) != seq);
+}
+
+void seqcount_write_begin
+(
+    struct seqcount *s
+)
+{
+    __atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELAXED);
+
+    /* the odd sequence must be seen before any of the new data */
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void seqcount_write_end
+(
+    struct seqcount *s
+)
+{
+    __atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELEASE);
+}
+
+void seqlock_init
+(
+    struct seqlock *s
+)
+{
+    seqcount_init(&s->sc);
+    spinlock_ticket_init(&s->lock);
+}
+
+uint32_t seqlock_read_begin
+(
+    const struct seqlock *s
+)
+{
+    return(seqcount_read_begin(&s->sc));
+}
+
+int seqlock_read_retry
+(
+    const struct seqlock *s,
+    uint32_t seq
+)
+{
+    return(seqcount_read_retry(&s->sc, seq));
+}
+
+void seqlock_write_lock
+(
+    struct seqlock *s
+)
+{
+    spinlock_ticket_lock(&s->lock);
+    seqcount_write_begin(&s->sc);
+}
+
+void seqlock_write_unlock
+(
+    struct seqlock *s
+)
+{
+    seqcount_write_end(&s->sc);
+    spinlock_ticket_unlock(&s->lock);
+}
+
+void seqlock_write_lock_int
+(
+    struct seqlock *s,
+    uint8_t *flag
+)
+{
+    spinlock_ticket_lock_int(&s->lock, flag);
+    seqcount_write_begin(&s->sc);
+}
+
+void seqlock_write_unlock_int
+(
+    struct seqlock *s,
+    uint8_t flag
+)
+{
+    seqcount_write_end(&s->sc);
+    spinlock_ticket_unlock_int(&s->lock, flag);
+}
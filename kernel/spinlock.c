@@ -5,6 +5,8 @@
 #include <spinlock.h>
 #include <cpu.h>
 #include <platform.h>
+#include <percpu.h>
+#include <lockstat.h>
 
 void spinlock_init
 (
@@ -22,22 +24,165 @@ void spinlock_rw_init
     s->lock = UINT32_MAX;
 }
 
+/* queue nodes of this CPU - one for each context that can nest */
+static PERCPU_DEFINE(struct spinlock_node, spinlock_nodes[SPINLOCK_NODES]);
+static PERCPU_DEFINE(uint32_t, spinlock_nest) = 0;
+
+static inline int spinlock_fast_lock
+(
+    struct spinlock *s
+)
+{
+    uint64_t expected = 0;
+
+    return(__atomic_compare_exchange_n(&s->lock,
+                                       &expected, SPINLOCK_LOCKED, 0,
+                                       __ATOMIC_ACQUIRE,
+                                       __ATOMIC_RELAXED));
+}
+
+/*
+ * spinlock_slow_lock - queue behind the other waiters
+ * Only the waiter at the head of the queue looks at the lock word,
+ * the others spin on their own node until their predecessor hands
+ * them the head of the queue. Interrupts are kept off while queued
+ * so the node cannot be left behind by a preempted thread.
+ */
+
+static void spinlock_slow_lock
+(
+    struct spinlock *s
+)
+{
+    struct spinlock_node *node = NULL;
+    struct spinlock_node *prev = NULL;
+    struct spinlock_node *next = NULL;
+    uint64_t val  = 0;
+    uint64_t tail = 0;
+    uint32_t idx  = 0;
+    uint8_t  int_flag = 0;
+
+    int_flag = cpu_int_check();
+    cpu_int_lock();
+
+    idx = percpu_read(spinlock_nest);
+
+    /* out of nodes - fall back to spinning on the lock word */
+    if(idx >= SPINLOCK_NODES)
+    {
+        while(!spinlock_fast_lock(s))
+        {
+            cpu_pause();
+        }
+
+        if(int_flag)
+        {
+            cpu_int_unlock();
+        }
+
+        return;
+    }
+
+    percpu_write(spinlock_nest, idx + 1);
+
+    node = (struct spinlock_node*)percpu_ptr(spinlock_nodes) + idx;
+    node->next   = NULL;
+    node->locked = 0;
+
+    /* the lock might have been released in the meantime */
+    if(spinlock_fast_lock(s))
+    {
+        goto done;
+    }
+
+    /* become the new tail of the queue */
+    tail = (uint64_t)node;
+    val  = __atomic_load_n(&s->lock, __ATOMIC_RELAXED);
+
+    while(!__atomic_compare_exchange_n(&s->lock,
+                                       &val, 
+                                       (val & SPINLOCK_LOCKED) | tail, 0,
+                                       __ATOMIC_ACQ_REL,
+                                       __ATOMIC_RELAXED))
+    {
+        cpu_pause();
+    }
+
+    prev = (struct spinlock_node*)(val & SPINLOCK_TAIL_MASK);
+
+    /* wait for the predecessor to hand us the head of the queue */
+    if(prev != NULL)
+    {
+        __atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+
+        while(!__atomic_load_n(&node->locked, __ATOMIC_ACQUIRE))
+        {
+            cpu_pause();
+        }
+    }
+
+    /* head of the queue - wait for the owner to release the lock */
+    while(1)
+    {
+        val = __atomic_load_n(&s->lock, __ATOMIC_ACQUIRE);
+
+        if(val & SPINLOCK_LOCKED)
+        {
+            cpu_pause();
+            continue;
+        }
+
+        /* last in the queue - take the lock and clear the tail */
+        if((val & SPINLOCK_TAIL_MASK) == tail)
+        {
+            if(__atomic_compare_exchange_n(&s->lock,
+                                           &val, SPINLOCK_LOCKED, 0,
+                                           __ATOMIC_ACQUIRE,
+                                           __ATOMIC_RELAXED))
+            {
+                goto done;
+            }
+
+            /* somebody queued behind us */
+            continue;
+        }
+
+        /* with waiters queued only the head can set the locked bit */
+        __atomic_fetch_or(&s->lock, SPINLOCK_LOCKED, __ATOMIC_ACQUIRE);
+        break;
+    }
+
+    /* pass the head of the queue to the next waiter */
+    while((next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE)) == NULL)
+    {
+        cpu_pause();
+    }
+
+    __atomic_store_n(&next->locked, 1, __ATOMIC_RELEASE);
+
+done:
+    percpu_write(spinlock_nest, idx);
+
+    if(int_flag)
+    {
+        cpu_int_unlock();
+    }
+}
+
 void spinlock_lock
 (
     struct spinlock *s
 )
 {  
-    int expected = 0;    
-    
-    while(!__atomic_compare_exchange_n(&s->lock, 
-                                      &expected, 1, 0, 
-                                      __ATOMIC_SEQ_CST, 
-                                      __ATOMIC_SEQ_CST)
-         )
+    uint64_t wait_start = 0;
+
+    if(!spinlock_fast_lock(s))
     {
-        expected = 0;
-        cpu_pause();
+        wait_start = lockstat_now();
+        spinlock_slow_lock(s);
     }
+
+    lockstat_acquired(s, LOCKSTAT_SPINLOCK, wait_start, LOCKSTAT_CALLER);
 }
 
 int8_t spinlock_try_lock
@@ -45,17 +190,16 @@ int8_t spinlock_try_lock
     struct spinlock *s
 )
 {  
-    int expected = 0;    
     int8_t rc = 0;
-    if(!__atomic_compare_exchange_n(&s->lock, 
-                                      &expected, 1, 0, 
-                                      __ATOMIC_SEQ_CST, 
-                                      __ATOMIC_SEQ_CST)
-         )
+
+    if(!spinlock_fast_lock(s))
     {
-        expected = 0;
         rc = -1;
     }
+    else
+    {
+        lockstat_acquired(s, LOCKSTAT_SPINLOCK, 0, LOCKSTAT_CALLER);
+    }
 
     return(rc);
 }
@@ -65,13 +209,10 @@ void spinlock_unlock
     struct spinlock *s
 )
 {
-    int expected = 1;
-    
-    __atomic_compare_exchange_n(&s->lock, 
-                               &expected, 0, 0, 
-                               __ATOMIC_SEQ_CST, 
-                               __ATOMIC_SEQ_CST);
+    lockstat_released(s);
 
+    /* the tail bits belong to the waiters */
+    __atomic_fetch_and(&s->lock, ~SPINLOCK_LOCKED, __ATOMIC_RELEASE);
 }
 
 void spinlock_lock_int
@@ -80,22 +221,19 @@ void spinlock_lock_int
     uint8_t *flag
 )
 {
-    int expected = 0;
+    uint64_t wait_start = 0;
 
     *flag = cpu_int_check();
 
     cpu_int_lock();
 
-    while(!__atomic_compare_exchange_n(&s->lock, 
-                                      &expected, 1, 0, 
-                                      __ATOMIC_SEQ_CST, 
-                                      __ATOMIC_SEQ_CST)
-         )
+    if(!spinlock_fast_lock(s))
     {
-        expected = 0;
-        cpu_pause();
+        wait_start = lockstat_now();
+        spinlock_slow_lock(s);
     }
 
+    lockstat_acquired(s, LOCKSTAT_SPINLOCK, wait_start, LOCKSTAT_CALLER);
 }
 
 int8_t spinlock_try_lock_int
@@ -104,23 +242,21 @@ int8_t spinlock_try_lock_int
     uint8_t *flag
 )
 {
-    int expected = 0;
     int8_t rc = 0;
 
     *flag = cpu_int_check();
 
     cpu_int_lock();
 
-    if(!__atomic_compare_exchange_n(&s->lock, 
-                                      &expected, 1, 0, 
-                                      __ATOMIC_SEQ_CST, 
-                                      __ATOMIC_SEQ_CST)
-         )
+    if(!spinlock_fast_lock(s))
     {
-        expected = 0;
         rc = 0xff;
         cpu_int_unlock();
     }
+    else
+    {
+        lockstat_acquired(s, LOCKSTAT_SPINLOCK, 0, LOCKSTAT_CALLER);
+    }
 
     return(rc);
 }
@@ -131,12 +267,97 @@ void spinlock_unlock_int
     uint8_t flag
 )
 {
-    uint32_t expected = 1;
+    lockstat_released(s);
 
-    __atomic_compare_exchange_n(&s->lock, 
-                               &expected, 0, 0, 
-                               __ATOMIC_SEQ_CST, 
-                               __ATOMIC_SEQ_CST);
+    __atomic_fetch_and(&s->lock, ~SPINLOCK_LOCKED, __ATOMIC_RELEASE);
+
+    if(flag)
+    {
+        cpu_int_unlock();
+    }
+}
+
+void spinlock_ticket_init
+(
+    struct spinlock_ticket *s
+)
+{
+    s->next  = 0;
+    s->owner = 0;
+}
+
+void spinlock_ticket_lock
+(
+    struct spinlock_ticket *s
+)
+{
+    uint16_t ticket = 0;
+
+    ticket = __atomic_fetch_add(&s->next, 1, __ATOMIC_RELAXED);
+
+    while(__atomic_load_n(&s->owner, __ATOMIC_ACQUIRE) != ticket)
+    {
+        cpu_pause();
+    }
+}
+
+int8_t spinlock_ticket_try_lock
+(
+    struct spinlock_ticket *s
+)
+{
+    uint32_t val = 0;
+    uint32_t new_val = 0;
+    int8_t rc = -1;
+
+    /* next and owner are taken together - the lock is free when they match */
+    val = __atomic_load_n((volatile uint32_t*)s, __ATOMIC_RELAXED);
+
+    if((val & 0xffff) == (val >> 16))
+    {
+        new_val = (val & 0xffff0000) | ((val + 1) & 0xffff);
+
+        if(__atomic_compare_exchange_n((volatile uint32_t*)s,
+                                       &val, new_val, 0,
+                                       __ATOMIC_ACQUIRE,
+                                       __ATOMIC_RELAXED))
+        {
+            rc = 0;
+        }
+    }
+
+    return(rc);
+}
+
+void spinlock_ticket_unlock
+(
+    struct spinlock_ticket *s
+)
+{
+    /* only the owner writes this half */
+    __atomic_store_n(&s->owner, s->owner + 1, __ATOMIC_RELEASE);
+}
+
+void spinlock_ticket_lock_int
+(
+    struct spinlock_ticket *s,
+    uint8_t *flag
+)
+{
+    *flag = cpu_int_check();
+
+    cpu_int_lock();
+
+    spinlock_ticket_lock(s);
+}
+
+void spinlock_ticket_unlock_int
+(
+    struct spinlock_ticket *s,
+    uint8_t flag
+)
+{
+    spinlock_ticket_unlock(s);
 
     if(flag)
     {
@@ -78,12 +78,15 @@ static int thread_setup
     memset(th, 0, sizeof(struct sched_thread));
 
     th->prio         = prio;
+    th->base_prio    = prio;
+    th->pi_prio      = SCHED_PRIO_NONE;
     th->arg          = arg;
     th->entry_point  = entry_pt;
     th->stack_sz     = stack_sz;
     th->flags        = THREAD_READY;
     th->owner        = owner;
     th->policy       = NULL;
+    th->timer_slack  = SCHED_DEFAULT_TIMER_SLACK_NS;
     
     /* we skip the guard page */
     th->stack_origin = stack_origin + PAGE_SIZE;
@@ -1,4 +1,3 @@
-
 #include <linked_list.h>
 #include <timer.h>
 #include <spinlock.h>
@@ -6,75 +5,191 @@
 #include <liballoc.h>
 #include <cpu.h>
 #include <platform.h>
+#include <percpu.h>
+#include <lockstat.h>
+#include <clock.h>
 
+#define TIMER_WHEEL_TICK_NS  (1ull << TIMER_WHEEL_SHIFT)
 
 /* local variables */
 static struct timer_device system_timer = {0};
 
-static uint8_t timer_increment
+/* timers armed on a CPU are kept on that CPU, the system timer is only
+ * used before the CPU has its own tick and on CPUs without one
+ */
+static PERCPU_DEFINE(struct timer_device*, cpu_timer) = NULL;
+
+static inline uint64_t timer_ts_to_ns
+(
+    const struct time_spec *ts
+)
+{
+    return((uint64_t)ts->seconds * TIMER_RESOLUTION_NS + ts->nanosec);
+}
+
+/* 
+ * timer_wheel_add - place a timer in the wheel based on its deadline 
+ * Must be called with the wheel locked
+ */
+
+static void timer_wheel_add
 (
-    struct time_spec       *cursor,
-    const struct time_spec *step
+    struct timer_device *tmd,
+    struct timer        *tm
 )
 {
-    /* check if we are overflowing the nanoseconds
-     * if we do, increase the seconds and calculate the difference
-     * of the nanoseconds
+    uint64_t expires = 0;
+    uint64_t latest  = 0;
+    uint64_t mask    = 0;
+    uint64_t delta   = 0;
+    uint32_t level   = 0;
+    uint32_t idx     = 0;
+
+    /* round up to the wheel tick so we never fire early */
+    expires = (tm->expires + TIMER_WHEEL_TICK_NS - 1) >> TIMER_WHEEL_SHIFT;
+
+    /* pick the tick with the most low bits cleared in the slack window 
+     * so timers with overlapping windows expire together
      */
-    if(step->nanosec + cursor->nanosec >= 1000000000ull)
+    if(tm->slack != 0)
     {
-        cursor->seconds++;
-        cursor->nanosec = (cursor->nanosec + step->nanosec) - 1000000000ull;
+        latest = (tm->expires + tm->slack) >> TIMER_WHEEL_SHIFT;
+
+        if(latest > expires)
+        {
+            mask    = (1ull << (63 - __builtin_clzll(latest ^ expires))) - 1;
+            expires = latest & ~mask;
+        }
     }
-    else
+
+    if(expires < tmd->wheel_clk)
     {
-        cursor->nanosec += step->nanosec;
+        expires = tmd->wheel_clk;
     }
 
-    /* increment seconds */
-    cursor->seconds += step->seconds;
+    delta = expires - tmd->wheel_clk;
 
-    return(0);
+    /* park the timer at the end of the wheel */
+    if(delta >= TIMER_WHEEL_RANGE)
+    {
+        delta   = TIMER_WHEEL_RANGE - 1;
+        expires = tmd->wheel_clk + delta;
+    }
+
+    for(level = 0; level < TIMER_WHEEL_LEVELS - 1; level++)
+    {
+        if(delta < (1ull << (TIMER_WHEEL_BITS * (level + 1))))
+        {
+            break;
+        }
+    }
+
+    idx = (expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+
+    tm->slot = &tmd->wheel[level][idx];
+    linked_list_add_tail(tm->slot, &tm->node);
+    tmd->wheel_count++;
+}
+
+static void timer_wheel_remove
+(
+    struct timer_device *tmd,
+    struct timer        *tm
+)
+{
+    linked_list_remove(tm->slot, &tm->node);
+    tm->slot = NULL;
+    tmd->wheel_count--;
+}
+
+/* move the timers of a slot one level down */
+static void timer_wheel_cascade
+(
+    struct timer_device *tmd,
+    uint32_t             level,
+    uint32_t             idx
+)
+{
+    struct list_head  slot;
+    struct timer     *c = NULL;
+
+    linked_list_init(&slot);
+    linked_list_concat(&tmd->wheel[level][idx], &slot);
+
+    tmd->wheel_count -= slot.count;
+
+    while((c = (struct timer*)linked_list_first(&slot)) != NULL)
+    {
+        linked_list_remove(&slot, &c->node);
+        timer_wheel_add(tmd, c);
+    }
 }
 
-static uint8_t timer_expired
+/* expire the timers of the current wheel tick */
+static void timer_wheel_expire
 (
-    struct time_spec *target,
-    struct time_spec *current
+    struct timer_device *tmd,
+    const void          *isr_inf
 )
 {
-    uint8_t expired = 0;
+    struct list_head  slot;
+    struct timer     *c     = NULL;
+    uint32_t          idx   = 0;
+    uint32_t          level = 0;
+    uint32_t          lidx  = 0;
+
+    idx = tmd->wheel_clk & TIMER_WHEEL_MASK;
+
+    /* the lower level wrapped - bring down the next slot of each level */
+    if(idx == 0)
+    {
+        for(level = 1; level < TIMER_WHEEL_LEVELS; level++)
+        {
+            lidx = (tmd->wheel_clk >> (TIMER_WHEEL_BITS * level)) & 
+                   TIMER_WHEEL_MASK;
+
+            timer_wheel_cascade(tmd, level, lidx);
+
+            if(lidx != 0)
+            {
+                break;
+            }
+        }
+    }
 
-    /* Check if we went past the required seconds */
-    if(target->seconds <= current->seconds)
+    linked_list_init(&slot);
+    linked_list_concat(&tmd->wheel[0][idx], &slot);
+    tmd->wheel_count -= slot.count;
+
+    /* periodic timers re-armed below must land in a future tick */
+    tmd->wheel_clk++;
+
+    while((c = (struct timer*)linked_list_first(&slot)) != NULL)
     {
-        if(target->seconds == current->seconds)
+        linked_list_remove(&slot, &c->node);
+        c->slot = NULL;
+
+        if(c->flags & TIMER_PERIODIC)
         {
-            /* If we reached the target seconds, then check the nanoseconds */
-            if(target->nanosec <= current->nanosec)
+            c->callback(c, c->arg, isr_inf);
+
+            c->expires += timer_ts_to_ns(&c->to_sleep);
+
+            /* we fell behind - don't try to catch up */
+            if(c->expires <= tmd->now_ns)
             {
-                expired = 1;
+                c->expires = tmd->now_ns + timer_ts_to_ns(&c->to_sleep);
             }
+
+            timer_wheel_add(tmd, c);
         }
         else
         {
-            expired = 1;
+            /* the callback may enqueue the timer again */
+            __atomic_or_fetch(&c->flags, TIMER_PROCESSED, __ATOMIC_RELAXED);
+            c->callback(c, c->arg, isr_inf);
         }
     }
-
-    return(expired);
-}
-
-static void timer_compute_earliest_deadline
-(
-    struct time_spec *ed,
-    const struct time_spec *deadline,
-    const struct time_spec *cursor
-)
-{
-    
-    ed->seconds = deadline->seconds - cursor->seconds;
-    ed->nanosec = deadline->nanosec - cursor->nanosec;
 }
 
 static uint32_t timer_queue_callback
@@ -85,61 +200,47 @@ static uint32_t timer_queue_callback
 )
 { 
     struct timer_device *tm_dev  = NULL;
-    struct timer     *c       = NULL;
-    struct timer     *n       = NULL;
-    uint8_t     status   = 0;
+    struct timer        *c       = NULL;
+    uint64_t             target  = 0;
 
     tm_dev = tm;
     
-    spinlock_lock(&tm_dev->lock_active_q);
-   static uint32_t  prev_sec = 0;
-    /* increment our timer */
-    timer_increment(&tm_dev->current_increment, step);
-
-    if(prev_sec != tm_dev->current_increment.seconds)
-    {
-        prev_sec = tm_dev->current_increment.seconds;
-    }
+    spinlock_lock(&tm_dev->lock_wheel);
 
+    /* move the new timers in the wheel */
+    spinlock_lock(&tm_dev->lock_pend_q);
 
-    c = (struct timer*)linked_list_first(&tm_dev->active_q);
-
-    while(c != NULL)
+    while((c = (struct timer*)linked_list_first(&tm_dev->pend_q)) != NULL)
     {
-        n = (struct timer*)linked_list_next(&c->node);
+        linked_list_remove(&tm_dev->pend_q, &c->node);
+        timer_wheel_add(tm_dev, c);
+    }
 
-        timer_increment(&c->cursor, step);
+    spinlock_unlock(&tm_dev->lock_pend_q);
 
-        status = timer_expired(&c->to_sleep, &c->cursor);
+    __atomic_add_fetch(&tm_dev->now_ns, timer_ts_to_ns(step), 
+                       __ATOMIC_RELAXED);
 
-        /* Do stuff */
+    /* published after now_ns - see timer_pend */
+    __atomic_store_n(&tm_dev->now_clk, clock_monotonic_ns(), 
+                     __ATOMIC_RELEASE);
 
-        if(status)
-        {    
+    target = tm_dev->now_ns >> TIMER_WHEEL_SHIFT;
 
-            c->callback(c, c->arg, isr_inf);
-            /* if the timer was one-shot, then remove it from the list */
-            if(c->flags & TIMER_PERIODIC)
-            {
-                memset(&c->cursor, 0, sizeof(struct time_spec));
-            }
-            else
-            {
-                linked_list_remove(&tm_dev->active_q, &c->node);
-                c->flags |= TIMER_PROCESSED;
-            }
+    /* walk the wheel ticks covered by this step */
+    while(tm_dev->wheel_clk <= target)
+    {
+        /* nothing to expire or cascade - jump straight to the end */
+        if(tm_dev->wheel_count == 0)
+        {
+            tm_dev->wheel_clk = target + 1;
+            break;
         }
 
-        c = n;
+        timer_wheel_expire(tm_dev, isr_inf);
     }
 
-    spinlock_lock(&tm_dev->lock_pend_q);
-    
-    linked_list_concat(&tm_dev->pend_q, &tm_dev->active_q);
-    
-    spinlock_unlock(&tm_dev->lock_pend_q);
-
-    spinlock_unlock(&tm_dev->lock_active_q);
+    spinlock_unlock(&tm_dev->lock_wheel);
 
     return(0);
 }
@@ -164,26 +265,237 @@ int timer_set_system_timer
         return(-1);
     }
 
-    spinlock_lock_int(&system_timer.lock_active_q, &int_flag);
+    spinlock_lock_int(&system_timer.lock_wheel, &int_flag);
 
     system_timer.backing_dev = dev;
     func->set_handler(dev, timer_queue_callback, &system_timer);
 
-    spinlock_unlock_int(&system_timer.lock_active_q, int_flag);
+    spinlock_unlock_int(&system_timer.lock_wheel, int_flag);
 
     return(0);
 }
 
+static void timer_device_init
+(
+    struct timer_device *tmd
+)
+{
+    uint32_t level = 0;
+    uint32_t idx   = 0;
+
+    memset(tmd, 0, sizeof(struct timer_device));
+    linked_list_init(&tmd->pend_q);
+
+    /* the time of the queue starts now */
+    tmd->now_clk = clock_monotonic_ns();
+
+    for(level = 0; level < TIMER_WHEEL_LEVELS; level++)
+    {
+        for(idx = 0; idx < TIMER_WHEEL_SLOTS; idx++)
+        {
+            linked_list_init(&tmd->wheel[level][idx]);
+        }
+    }
+
+    spinlock_init(&tmd->lock_wheel);
+    spinlock_init(&tmd->lock_pend_q);
+
+    lockstat_name(&tmd->lock_wheel,  "timer lock_wheel");
+    lockstat_name(&tmd->lock_pend_q, "timer lock_pend_q");
+}
+
 int timer_system_init(void)
 {
-    memset(&system_timer, 0, sizeof(struct timer_device));
-    linked_list_init(&system_timer.active_q);
-    linked_list_init(&system_timer.pend_q);
-    spinlock_init(&system_timer.lock_active_q);
-    spinlock_init(&system_timer.lock_pend_q);
+    timer_device_init(&system_timer);
     return(0);
 }
 
+/* time counted by the ticks of the system timer */
+uint64_t timer_system_now_ns
+(
+    void
+)
+{
+    return(__atomic_load_n(&system_timer.now_ns, __ATOMIC_RELAXED));
+}
+
+/*
+ * timer_cpu_init - create the timer queue of the current CPU
+ * The queue is driven by the local tick through timer_cpu_tick
+ */
+
+int timer_cpu_init
+(
+    void
+)
+{
+    struct timer_device *tmd = NULL;
+
+    if(percpu_read(cpu_timer) != NULL)
+    {
+        return(0);
+    }
+
+    tmd = kcalloc(sizeof(struct timer_device), 1);
+
+    if(tmd == NULL)
+    {
+        return(-1);
+    }
+
+    timer_device_init(tmd);
+    percpu_write(cpu_timer, tmd);
+
+    return(0);
+}
+
+/* called from the tick handler of the current CPU */
+uint32_t timer_cpu_tick
+(
+    const struct time_spec *step,
+    const void             *isr_inf
+)
+{
+    struct timer_device *tmd = NULL;
+
+    tmd = percpu_read(cpu_timer);
+
+    if(tmd == NULL)
+    {
+        return(0);
+    }
+
+    return(timer_queue_callback(tmd, step, isr_inf));
+}
+
+/*
+ * timer_cpu_next_event - time until the timer queue of the current
+ * CPU needs a tick. Timers in the upper levels of the wheel are
+ * reported at the next cascade. Returns -1 if there are no timers
+ */
+
+int timer_cpu_next_event
+(
+    uint64_t *ns
+)
+{
+    struct timer_device *tmd    = NULL;
+    uint64_t             target = 0;
+    uint32_t             idx    = 0;
+    uint8_t              int_sts = 0;
+    int                  status = 0;
+
+    tmd = percpu_read(cpu_timer);
+
+    if((tmd == NULL) || (ns == NULL))
+    {
+        return(-1);
+    }
+
+    spinlock_lock_int(&tmd->lock_wheel, &int_sts);
+
+    if(linked_list_count(&tmd->pend_q) > 0)
+    {
+        /* new timers get in the wheel on the next tick */
+        target = tmd->wheel_clk;
+    }
+    else if(tmd->wheel_count == 0)
+    {
+        status = -1;
+    }
+    else
+    {
+        for(idx = tmd->wheel_clk & TIMER_WHEEL_MASK; 
+            idx < TIMER_WHEEL_SLOTS; 
+            idx++)
+        {
+            if(linked_list_count(&tmd->wheel[0][idx]) > 0)
+            {
+                break;
+            }
+        }
+
+        /* an empty lower level stops at the next wrap of the wheel */
+        target = (tmd->wheel_clk & ~(uint64_t)TIMER_WHEEL_MASK) + idx;
+    }
+
+    if(status == 0)
+    {
+        target <<= TIMER_WHEEL_SHIFT;
+
+        if(target > tmd->now_ns)
+        {
+            *ns = target - tmd->now_ns;
+        }
+        else
+        {
+            *ns = 0;
+        }
+    }
+
+    spinlock_unlock_int(&tmd->lock_wheel, int_sts);
+
+    return(status);
+}
+
+/* timers go on the queue of the CPU arming them */
+static struct timer_device *timer_device_get
+(
+    struct timer_device *timer_dev
+)
+{
+    struct timer_device *tmd = NULL;
+
+    if(timer_dev != NULL)
+    {
+        return(timer_dev);
+    }
+
+    tmd = percpu_read(cpu_timer);
+
+    if(tmd == NULL)
+    {
+        tmd = &system_timer;
+    }
+
+    return(tmd);
+}
+
+/* queue the timer until the next tick adds it to the wheel */
+static void timer_pend
+(
+    struct timer_device *tmd,
+    struct timer        *tm
+)
+{
+    uint8_t  int_sts = 0;
+    uint64_t now_clk = 0;
+    uint64_t now     = 0;
+    uint64_t clk     = 0;
+
+    /* now_ns lags while the tick of the CPU is stopped so add the 
+     * time passed since the last tick. now_clk is read first: a tick
+     * in between makes the timer late by one step, never early
+     */
+    now_clk = __atomic_load_n(&tmd->now_clk, __ATOMIC_ACQUIRE);
+    now     = __atomic_load_n(&tmd->now_ns, __ATOMIC_RELAXED);
+    clk     = clock_monotonic_ns();
+
+    if(clk > now_clk)
+    {
+        now += clk - now_clk;
+    }
+
+    tm->dev     = tmd;
+    tm->expires = now + timer_ts_to_ns(&tm->to_sleep);
+
+    spinlock_lock_int(&tmd->lock_pend_q, &int_sts);
+
+    tm->slot = &tmd->pend_q;
+    linked_list_add_tail(&tmd->pend_q, &tm->node);
+    
+    spinlock_unlock_int(&tmd->lock_pend_q, int_sts);
+}
 
 int timer_enqeue
 (
@@ -194,18 +506,10 @@ int timer_enqeue
     uint8_t         flags
 )
 {
-    uint8_t int_sts = 0;
     struct timer_device *tmd = NULL;
     struct timer     *tm = NULL;
 
-    if(timer_dev == NULL)
-    {
-        tmd = &system_timer;
-    }
-    else
-    {
-        tmd = timer_dev;
-    }
+    tmd = timer_device_get(timer_dev);
     
     if(func == NULL || ts == NULL)
     {
@@ -214,15 +518,17 @@ int timer_enqeue
 
     tm = (struct timer*)kcalloc(sizeof(struct timer), 1);
 
+    if(tm == NULL)
+    {
+        return(-1);
+    }
+
     tm->arg = arg;
     tm->callback = func;
     tm->to_sleep = *ts;
     tm->flags = flags;
-    spinlock_lock_int(&tmd->lock_pend_q, &int_sts);
 
-    linked_list_add_tail(&tmd->pend_q, &tm->node);
-    
-    spinlock_unlock_int(&tmd->lock_pend_q, int_sts);
+    timer_pend(tmd, tm);
     
     return(0);
 }
@@ -237,17 +543,28 @@ int timer_enqeue_static
     struct timer         *tm
 )
 {
-    uint8_t int_sts = 0;
+    return(timer_enqeue_slack(timer_dev, ts, 0, func, arg, flags, tm));
+}
+
+/*
+ * timer_enqeue_slack - queue a timer that may fire up to slack_ns late
+ * This lets the wheel expire it together with other timers
+ */
+
+int timer_enqeue_slack
+(
+    struct timer_device *timer_dev,
+    struct time_spec    *ts,
+    uint64_t             slack_ns,
+    timer_handler_t      func,
+    void                *arg,
+    uint8_t              flags,
+    struct timer        *tm
+)
+{
     struct timer_device *tmd = NULL;
 
-    if(timer_dev == NULL)
-    {
-        tmd = &system_timer;
-    }
-    else
-    {
-        tmd = timer_dev;
-    }
+    tmd = timer_device_get(timer_dev);
     
     if(tm == NULL || func == NULL || ts == NULL)
     {
@@ -260,12 +577,10 @@ int timer_enqeue_static
     tm->arg = arg;
     tm->callback = func;
     tm->to_sleep = *ts;
+    tm->slack = slack_ns;
     tm->flags = flags;
-    spinlock_lock_int(&tmd->lock_pend_q, &int_sts);   
 
-    linked_list_add_tail(&tmd->pend_q, &tm->node);
-    
-    spinlock_unlock_int(&tmd->lock_pend_q, int_sts);
+    timer_pend(tmd, tm);
     
     return(0);
 }
@@ -281,24 +596,25 @@ int timer_dequeue
     struct timer_device *tmd = NULL;
     int found = 0;
     
+    if(tm == NULL)
+    {
+        return(-1);
+    }
+
+    /* the timer may be on the queue of another CPU */
     if(timer_dev == NULL)
     {
-        tmd = &system_timer;
+        tmd = tm->dev;
     }
     else
     {
         tmd = timer_dev;
     }
 
-    if((tmd == NULL) || (tm == NULL))
+    if(tmd == NULL)
     {
         return(-1);
     }
-
-    if(tm->flags & TIMER_PROCESSED)
-    {
-        return(0);
-    }
     
     int_sts = cpu_int_check();
 
@@ -307,30 +623,31 @@ int timer_dequeue
         cpu_int_lock();
     }
 
-    /* Look into the active queue */
-    spinlock_lock(&tmd->lock_active_q);
+    /* the timer only moves between the queues with both locks held 
+     * and its callback runs with lock_wheel held, so once we get the
+     * lock a timer that fired is done with its callback
+     */
+    spinlock_lock(&tmd->lock_wheel);
+    spinlock_lock(&tmd->lock_pend_q);
 
-    if(linked_list_find_node(&tmd->active_q, &tm->node) == 0)
+    if(__atomic_load_n(&tm->flags, __ATOMIC_RELAXED) & TIMER_PROCESSED)
     {
-        linked_list_remove(&tmd->active_q, &tm->node);
         found = 1;
     }
-
-    spinlock_unlock(&tmd->lock_active_q);
-
-    if(found == 0)
+    else if(tm->slot == &tmd->pend_q)
     {
-        /* Look into the pend queue */
-        spinlock_lock(&tmd->lock_pend_q);
-
-        if(linked_list_find_node(&tmd->pend_q, &tm->node) == 0)
-        {
-            linked_list_remove(&tmd->pend_q, &tm->node);
-            found = 1;
-        }
-
-        spinlock_unlock(&tmd->lock_pend_q);
+        linked_list_remove(&tmd->pend_q, &tm->node);
+        tm->slot = NULL;
+        found = 1;
     }
+    else if(tm->slot != NULL)
+    {
+        timer_wheel_remove(tmd, tm);
+        found = 1;
+    }
+
+    spinlock_unlock(&tmd->lock_pend_q);
+    spinlock_unlock(&tmd->lock_wheel);
     
     if(int_sts)
     {
@@ -343,4 +660,4 @@ int timer_dequeue
     }
 
     return(-1);
-}
\ No newline at end of file
+}
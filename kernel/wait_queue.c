@@ -0,0 +1,235 @@
+/*
+ * Wait queues
+ *
+ * A waiter queues an entry while holding the lock of the queue and
+ * sleeps. The waker takes the entry off the queue, marks it as woken
+ * and wakes the thread, so whatever the waker decided to give to that
+ * waiter - a semaphore count, the ownership of a mutex - cannot be
+ * taken by anybody else before the waiter runs. Waiting forever does
+ * not arm a timer.
+ */
+
+#include <wait_queue.h>
+#include <sched.h>
+#include <clock.h>
+
+void wait_queue_init
+(
+    struct wait_queue *wq
+)
+{
+    linked_list_init(&wq->head);
+    spinlock_init(&wq->lock);
+}
+
+/*
+ * wait_queue_add - queue the current thread
+ * Must be called with the queue locked.
+ */
+
+void wait_queue_add
+(
+    struct wait_queue       *wq,
+    struct wait_queue_entry *we,
+    uint32_t                 flags
+)
+{
+    struct list_node        *iter = NULL;
+    struct wait_queue_entry *iter_we = NULL;
+
+    we->th    = sched_thread_self();
+    we->flags = flags;
+    we->woken = 0;
+
+    if(flags & WAIT_QUEUE_PRIO)
+    {
+        iter = linked_list_first(&wq->head);
+
+        while(iter)
+        {
+            iter_we = (struct wait_queue_entry*)iter;
+
+            if(iter_we->th->prio > we->th->prio)
+            {
+                linked_list_add_before(&wq->head, iter, &we->node);
+                return;
+            }
+
+            iter = linked_list_next(iter);
+        }
+    }
+
+    linked_list_add_tail(&wq->head, &we->node);
+}
+
+/* wait_queue_remove - take a waiter that was not woken off the queue */
+
+void wait_queue_remove
+(
+    struct wait_queue       *wq,
+    struct wait_queue_entry *we
+)
+{
+    if(!we->woken)
+    {
+        linked_list_remove(&wq->head, &we->node);
+    }
+}
+
+/*
+ * wait_queue_sleep - sleep until the entry is woken or the timeout expires
+ * Must be called with the queue locked by spinlock_lock_int and returns
+ * with it locked again. Returns 0 if the entry was woken and -1 on
+ * timeout, in which case the entry is still queued and the caller
+ * removes it with wait_queue_remove.
+ */
+
+int wait_queue_sleep
+(
+    struct wait_queue       *wq,
+    struct wait_queue_entry *we,
+    uint64_t                 timeout_ns,
+    uint8_t                 *int_state
+)
+{
+    uint64_t deadline = 0;
+    uint64_t now      = 0;
+    uint64_t wait_ns  = WAIT_FOREVER_NS;
+
+    if(timeout_ns != WAIT_FOREVER_NS)
+    {
+        deadline = clock_monotonic_ns() + timeout_ns;
+    }
+
+    while(!we->woken)
+    {
+        if(timeout_ns != WAIT_FOREVER_NS)
+        {
+            now = clock_monotonic_ns();
+
+            if(now >= deadline)
+            {
+                return(-1);
+            }
+
+            wait_ns = deadline - now;
+        }
+
+        /* the lock is dropped only after we are marked as sleeping */
+        sched_sleep_unlock(&wq->lock, *int_state, wait_ns);
+
+        spinlock_lock_int(&wq->lock, int_state);
+    }
+
+    return(0);
+}
+
+/*
+ * wait_queue_wake - wake the waiters up to nr_exclusive exclusive ones
+ * The non-exclusive waiters in front of them are woken as well. With
+ * nr_exclusive at 0 only the waiters up to the first exclusive one are
+ * woken. Must be called with the queue locked. Returns the number of
+ * waiters that were woken.
+ */
+
+uint32_t wait_queue_wake
+(
+    struct wait_queue *wq,
+    uint32_t           nr_exclusive
+)
+{
+    struct list_node        *node = NULL;
+    struct list_node        *next = NULL;
+    struct wait_queue_entry *we   = NULL;
+    struct sched_thread     *th   = NULL;
+    uint32_t woken     = 0;
+    uint32_t exclusive = 0;
+
+    node = linked_list_first(&wq->head);
+
+    while(node != NULL)
+    {
+        next = linked_list_next(node);
+        we   = (struct wait_queue_entry*)node;
+
+        exclusive = we->flags & WAIT_QUEUE_EXCLUSIVE;
+
+        if(exclusive)
+        {
+            if(nr_exclusive == 0)
+            {
+                break;
+            }
+
+            nr_exclusive--;
+        }
+
+        th = we->th;
+
+        linked_list_remove(&wq->head, node);
+        __atomic_store_n(&we->woken, 1, __ATOMIC_RELEASE);
+
+        sched_wake_thread(th);
+        woken++;
+
+        /* the waiters behind the last exclusive one keep waiting */
+        if(exclusive && (nr_exclusive == 0))
+        {
+            break;
+        }
+
+        node = next;
+    }
+
+    return(woken);
+}
+
+/*
+ * wait_queue_wake_one - wake the first waiter
+ * Returns the thread that was woken or NULL if nobody waits.
+ * Must be called with the queue locked.
+ */
+
+struct sched_thread *wait_queue_wake_one
+(
+    struct wait_queue *wq
+)
+{
+    struct wait_queue_entry *we = NULL;
+    struct sched_thread     *th = NULL;
+
+    we = (struct wait_queue_entry*)linked_list_first(&wq->head);
+
+    if(we == NULL)
+    {
+        return(NULL);
+    }
+
+    th = we->th;
+
+    linked_list_remove(&wq->head, &we->node);
+    __atomic_store_n(&we->woken, 1, __ATOMIC_RELEASE);
+
+    sched_wake_thread(th);
+
+    return(th);
+}
+
+/* wait_queue_first - the thread that would be woken next */
+
+struct sched_thread *wait_queue_first
+(
+    struct wait_queue *wq
+)
+{
+    struct list_node *node = NULL;
+
+    node = linked_list_first(&wq->head);
+
+    if(node == NULL)
+    {
+        return(NULL);
+    }
+
+    return(WAIT_ENTRY_TO_THREAD(node));
+}
@@ -8,6 +8,7 @@
 #include <memory_map.h>
 #include <pgmgr.h>
 #include <vm.h>
+#include <lockstat.h>
 
 #define PFMGR_FOUND (0)
 #define PFMGR_FOUND_MORE (1)
@@ -1306,6 +1307,8 @@ int pfmgr_init(void)
     linked_list_init(&base.freer);
     linked_list_init(&base.busyr);
 
+    lockstat_name(&pfmgr_lock, "pfmgr_lock");
+
     kprintf("Initializing Page Frame Manager\n");
 
     phys = base.physf_start;
@@ -291,4 +291,111 @@ struct list_node * linked_list_get_last
     }
 
     return(ln);
-}
\ No newline at end of file
+}
+
+/*
+ * RCU variants - the writers are serialized by the caller and the
+ * readers walk the list forward without a lock. A node is published
+ * only after it is fully linked and a removed node keeps its next
+ * pointer so a reader standing on it can carry on. The node must not
+ * be reused before a grace period passes.
+ */
+
+int32_t linked_list_add_head_rcu
+(
+    struct list_head *lh, 
+    struct list_node *ln
+)
+{
+    ln->next = lh->list.next;
+    ln->prev = NULL;
+
+    if(ln->next == NULL)
+    {
+        lh->list.prev = ln;
+    }
+    else
+    {
+        ln->next->prev = ln;
+    }
+
+    __atomic_store_n(&lh->list.next, ln, __ATOMIC_RELEASE);
+
+    lh->count++;
+
+    return(0);
+}
+
+int32_t linked_list_add_tail_rcu
+(
+    struct list_head *lh, 
+    struct list_node *ln
+)
+{
+    struct list_node *last = NULL;
+
+    last = lh->list.prev;
+
+    ln->next = NULL;
+    ln->prev = last;
+
+    lh->list.prev = ln;
+
+    if(last == NULL)
+    {
+        __atomic_store_n(&lh->list.next, ln, __ATOMIC_RELEASE);
+    }
+    else
+    {
+        __atomic_store_n(&last->next, ln, __ATOMIC_RELEASE);
+    }
+
+    lh->count++;
+
+    return(0);
+}
+
+int32_t linked_list_remove_rcu
+(
+    struct list_head *lh, 
+    struct list_node *ln
+)
+{
+    if(ln->prev == NULL)
+    {
+        __atomic_store_n(&lh->list.next, ln->next, __ATOMIC_RELEASE);
+    }
+    else
+    {
+        __atomic_store_n(&ln->prev->next, ln->next, __ATOMIC_RELEASE);
+    }
+
+    if(ln->next == NULL)
+    {
+        lh->list.prev  = ln->prev;
+    }
+    else
+    {
+        ln->next->prev = ln->prev;
+    }
+
+    lh->count--;
+
+    return(0);
+}
+
+struct list_node *linked_list_first_rcu
+(
+    struct list_head *lh
+)
+{
+    return(__atomic_load_n(&lh->list.next, __ATOMIC_ACQUIRE));
+}
+
+struct list_node *linked_list_next_rcu
+(
+    struct list_node *ln
+)
+{
+    return(__atomic_load_n(&ln->next, __ATOMIC_ACQUIRE));
+}
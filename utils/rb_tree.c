@@ -22,7 +22,7 @@ uint32_t rb_tree_find
 
     node = tree->root;
 
-    while(node != NULL)
+    while(node != &tree->nil)
     {
         cmp_result = cmp_func(node, key);
 
@@ -30,6 +30,7 @@ uint32_t rb_tree_find
         {
             *result = node;
             status = 0;
+            break;
         }
         else if(cmp_result > 0)
         {
@@ -95,6 +96,31 @@ struct rb_node *rb_tree_maximum
     return(x);
 }
 
+/* in-order predecessor of x or NULL if x is the first node */
+struct rb_node *rb_tree_predecessor
+(
+    struct rb_tree *t,
+    struct rb_node *x
+)
+{
+    struct rb_node *y = NULL;
+
+    if(x->left != &t->nil)
+    {
+        return(rb_tree_maximum(t, x->left));
+    }
+
+    y = x->parent;
+
+    while((y != &t->nil) && (x == y->left))
+    {
+        x = y;
+        y = y->parent;
+    }
+
+    return(y != &t->nil ? y : NULL);
+}
+
 static void rb_left_rotate
 (
     struct rb_tree *t,
@@ -306,6 +332,8 @@ static void rb_delete_fixup
             }
         }
     }
+
+    x->color = BLACK;
 }
 
 int rb_insert
@@ -332,7 +360,8 @@ int rb_insert
 
         cmp_result = cmp(y, cmp_pv);
 
-        if(cmp_result < 0)
+        /* equal keys go to the right so they keep the insertion order */
+        if(cmp_result > 0)
         {
             x = x->left;
         }
@@ -354,12 +383,12 @@ int rb_insert
         {
             t->root = z;
         }
-        else if(cmp_result < 0)
+        else if(cmp_result > 0)
         {
             y->left = z;
             
         }
-        else if(cmp_result > 0)
+        else
         {
             y->right = z;
         }